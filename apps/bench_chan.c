@@ -0,0 +1,129 @@
+/*
+ * Channel benchmark
+ *
+ * Passes values from a producer thread to consumer threads, through an
+ * unbuffered channel, a buffered channel, and the polling pattern channels
+ * replace: a global slot and a flag, with threads yielding until they can
+ * fill or empty it. With several consumers, polling threads keep getting
+ * switched to for nothing, while threads blocked on a channel stay off the
+ * ready queue.
+ *
+ * Usage: bench_chan.x [items]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <uthread.h>
+
+#define MAX_CONSUMERS 16
+#define CAPACITY 64
+
+long items = 1000000;
+int consumers;
+
+// Polling.
+volatile long slot;
+volatile int full;
+volatile int finished;
+
+uthread_chan_t chan;
+long total;
+
+double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int poll_producer(void)
+{
+	for (long i = 1; i <= items; i++)
+	{
+		while (full)
+			uthread_yield();
+		slot = i;
+		full = 1;
+	}
+	while (full)
+		uthread_yield();
+	finished = 1;
+	return 0;
+}
+
+int poll_consumer(void)
+{
+	long sum = 0;
+
+	for (;;)
+	{
+		while (!full && !finished)
+			uthread_yield();
+		if (!full)
+			break;
+		sum += slot;
+		full = 0;
+	}
+	total += sum;
+	return 0;
+}
+
+int chan_producer(void)
+{
+	for (long i = 1; i <= items; i++)
+		uthread_chan_send(chan, &i);
+	uthread_chan_close(chan);
+	return 0;
+}
+
+int chan_consumer(void)
+{
+	long sum = 0, value;
+
+	while (uthread_chan_recv(chan, &value) == 0)
+		sum += value;
+	total += sum;
+	return 0;
+}
+
+void run(const char *name, uthread_func_t producer, uthread_func_t consumer,
+	 size_t capacity)
+{
+	uthread_t tids[MAX_CONSUMERS + 1];
+	double start, elapsed;
+
+	uthread_start(0);
+	chan = uthread_chan_create(sizeof(long), capacity);
+	full = finished = 0;
+	total = 0;
+
+	start = now_ns();
+	for (int i = 0; i < consumers; i++)
+		tids[i] = uthread_create(consumer);
+	tids[consumers] = uthread_create(producer);
+	for (int i = 0; i <= consumers; i++)
+		uthread_join(tids[i], NULL);
+	elapsed = now_ns() - start;
+
+	if (total != items * (items + 1) / 2)
+		printf("%s: wrong sum\n", name);
+	printf("%-10s %2d consumers %8.1f ns/item\n", name, consumers, elapsed / items);
+	uthread_chan_destroy(chan);
+	uthread_stop();
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		items = atol(argv[1]);
+
+	for (consumers = 1; consumers <= MAX_CONSUMERS; consumers *= 4)
+	{
+		run("polling", poll_producer, poll_consumer, 0);
+		run("unbuffered", chan_producer, chan_consumer, 0);
+		run("buffered", chan_producer, chan_consumer, CAPACITY);
+	}
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Join benchmark
+ *
+ * Creates N threads, lets them all run to completion so that they are zombies,
+ * then joins them newest first, for increasing values of N. With a join whose
+ * cost does not depend on the number of threads, the time per join stays flat
+ * as N grows.
+ *
+ * Usage: bench_join.x [max threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <uthread.h>
+
+double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int thread(void)
+{
+	return 0;
+}
+
+void run(int num_threads)
+{
+	struct uthread_config config;
+	uthread_t *tids = malloc(num_threads * sizeof(uthread_t));
+	double start, create, join;
+	int i;
+
+	// Tens of thousands of guard pages would exceed the mapping limit.
+	uthread_config_init(&config);
+	config.stack_size = 16384;
+	config.stack_guard = 0;
+	uthread_start_config(&config);
+
+	start = now_ns();
+	for (i = 0; i < num_threads; i++)
+		tids[i] = uthread_create(thread);
+	create = now_ns() - start;
+
+	// Everyone runs and exits.
+	uthread_yield();
+
+	start = now_ns();
+	for (i = num_threads - 1; i >= 0; i--)
+		uthread_join(tids[i], NULL);
+	join = now_ns() - start;
+
+	printf("%6d threads %8.1f ns/create %8.1f ns/join\n", num_threads,
+	       create / num_threads, join / num_threads);
+	uthread_stop();
+	free(tids);
+}
+
+int main(int argc, char *argv[])
+{
+	int max = 60000, n;
+
+	if (argc > 1)
+		max = atoi(argv[1]);
+	for (n = max / 8; n <= max; n *= 2)
+		run(n);
+	return 0;
+}
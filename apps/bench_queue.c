@@ -0,0 +1,270 @@
+/*
+ * Queue throughput benchmark
+ *
+ * Compares queue_t, a ring buffer, with a linked list allocating a node per
+ * item as queue_t used to be, filling and draining them on a single thread,
+ * one item at a time and in batches.
+ *
+ * Then compares the lock-free MPMC queue with queue_t: first on a single
+ * thread, enqueueing and dequeueing in turn, then with increasing numbers of
+ * producer and consumer kernel threads, queue_t being protected by a mutex.
+ *
+ * Prints millions of items passed through per second.
+ *
+ * Usage: bench_queue.x [max producers]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <mpmc.h>
+#include <queue.h>
+
+#define ITEMS 2000000
+#define CAPACITY 1024
+#define FILL 1000
+#define BATCH 64
+
+double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Linked list FIFO, with a node allocated per item.
+struct list_node
+{
+	void *data;
+	struct list_node *next;
+};
+
+struct list
+{
+	struct list_node *oldest;
+	struct list_node *newest;
+};
+
+int list_push(struct list *list, void *data)
+{
+	struct list_node *node = malloc(sizeof(struct list_node));
+
+	if (node == NULL)
+		return -1;
+	node->data = data;
+	node->next = NULL;
+	if (list->newest != NULL)
+		list->newest->next = node;
+	else
+		list->oldest = node;
+	list->newest = node;
+	return 0;
+}
+
+int list_pop(struct list *list, void **data)
+{
+	struct list_node *node = list->oldest;
+
+	if (node == NULL)
+		return -1;
+	*data = node->data;
+	list->oldest = node->next;
+	if (list->oldest == NULL)
+		list->newest = NULL;
+	free(node);
+	return 0;
+}
+
+void print_fill(const char *name, double elapsed)
+{
+	printf("%-10s fill/drain %4d       %8.2f Mitems/s\n", name, FILL,
+	       ITEMS / elapsed * 1e3);
+}
+
+// Fill queues with FILL items, then drain them, over and over.
+void run_fill(void)
+{
+	struct list list = { NULL, NULL };
+	void *batch[BATCH], *data;
+	queue_t queue = queue_create();
+	double start;
+
+	start = now_ns();
+	for (int round = 0; round < ITEMS / FILL; round++)
+	{
+		for (int i = 0; i < FILL; i++)
+			list_push(&list, (void*) (uintptr_t) (i + 1));
+		while (list_pop(&list, &data) == 0);
+	}
+	print_fill("list", now_ns() - start);
+
+	start = now_ns();
+	for (int round = 0; round < ITEMS / FILL; round++)
+	{
+		for (int i = 0; i < FILL; i++)
+			queue_enqueue(queue, (void*) (uintptr_t) (i + 1));
+		while (queue_dequeue(queue, &data) == 0);
+	}
+	print_fill("ring", now_ns() - start);
+
+	for (int i = 0; i < BATCH; i++)
+		batch[i] = (void*) (uintptr_t) (i + 1);
+	start = now_ns();
+	for (int round = 0; round < ITEMS / FILL; round++)
+	{
+		for (int i = 0; i < FILL; i += BATCH)
+			queue_enqueue_batch(queue, batch, FILL - i < BATCH ? FILL - i : BATCH);
+		while (queue_dequeue_batch(queue, batch, BATCH) > 0);
+	}
+	print_fill("ring batch", now_ns() - start);
+
+	queue_destroy(queue);
+}
+
+// Both queues behind the same interface.
+struct bench_queue
+{
+	const char *name;
+	int (*enqueue)(void *data);
+	int (*dequeue)(void **data);
+};
+
+mpmc_queue_t mpmc;
+queue_t ring;
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int mpmc_enqueue(void *data)
+{
+	return mpmc_queue_enqueue(mpmc, data);
+}
+
+int mpmc_dequeue(void **data)
+{
+	return mpmc_queue_dequeue(mpmc, data);
+}
+
+int ring_enqueue(void *data)
+{
+	int ret;
+
+	pthread_mutex_lock(&ring_lock);
+	ret = queue_enqueue(ring, data);
+	pthread_mutex_unlock(&ring_lock);
+	return ret;
+}
+
+int ring_dequeue(void **data)
+{
+	int ret;
+
+	pthread_mutex_lock(&ring_lock);
+	ret = queue_dequeue(ring, data);
+	pthread_mutex_unlock(&ring_lock);
+	return ret;
+}
+
+struct bench_queue queues[] = {
+	{ "mpmc", mpmc_enqueue, mpmc_dequeue },
+	{ "ring+mutex", ring_enqueue, ring_dequeue },
+};
+
+struct bench_queue *bench;
+int per_producer;
+int consumed;
+
+void *producer(void *arg)
+{
+	(void) arg;
+	for (int i = 0; i < per_producer; i++)
+	{
+		while (bench->enqueue((void*) (uintptr_t) (i + 1)))
+			sched_yield();
+	}
+	return NULL;
+}
+
+void *consumer(void *arg)
+{
+	int total = *(int*) arg;
+	void *data;
+
+	while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < total)
+	{
+		if (bench->dequeue(&data))
+			sched_yield();
+		else
+			__atomic_add_fetch(&consumed, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+void run_single(struct bench_queue *queue)
+{
+	double start, elapsed;
+	void *data;
+
+	start = now_ns();
+	for (int i = 0; i < ITEMS; i++)
+	{
+		queue->enqueue((void*) (uintptr_t) (i + 1));
+		queue->dequeue(&data);
+	}
+	elapsed = now_ns() - start;
+	printf("%-10s  1 thread           %8.2f Mitems/s\n", queue->name,
+	       ITEMS / elapsed * 1e3);
+}
+
+void run_threads(struct bench_queue *queue, int threads)
+{
+	pthread_t producers[threads], consumers[threads];
+	double start, elapsed;
+	int total;
+
+	bench = queue;
+	per_producer = ITEMS / threads;
+	total = per_producer * threads;
+	consumed = 0;
+
+	start = now_ns();
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_create(&consumers[i], NULL, consumer, &total);
+		pthread_create(&producers[i], NULL, producer, NULL);
+	}
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i], NULL);
+	}
+	elapsed = now_ns() - start;
+	printf("%-10s %2d producers %2d consumers %8.2f Mitems/s\n", queue->name,
+	       threads, threads, total / elapsed * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	int max = 4;
+
+	if (argc > 1)
+		max = atoi(argv[1]);
+	run_fill();
+
+	mpmc = mpmc_queue_create(CAPACITY);
+	ring = queue_create();
+
+	for (unsigned int q = 0; q < sizeof(queues) / sizeof(queues[0]); q++)
+	{
+		run_single(&queues[q]);
+		for (int threads = 1; threads <= max; threads *= 2)
+			run_threads(&queues[q], threads);
+	}
+
+	mpmc_queue_destroy(mpmc);
+	queue_destroy(ring);
+	return 0;
+}
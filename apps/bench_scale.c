@@ -0,0 +1,80 @@
+/*
+ * M:N scaling benchmark
+ *
+ * Runs the same CPU-bound job, split between many threads that yield now and
+ * then, with 1 to N workers. The job time should go down with the number of
+ * workers, as long as there are enough cores to run them.
+ *
+ * Usage: bench_scale.x [max workers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <uthread.h>
+
+#define NUM_THREADS 256
+#define CHUNKS 16
+#define CHUNK_ITERATIONS 200000
+
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int thread(void)
+{
+	volatile unsigned int x = uthread_self();
+	int i, j;
+
+	for (i = 0; i < CHUNKS; i++)
+	{
+		for (j = 0; j < CHUNK_ITERATIONS; j++)
+			x = x * 1664525 + 1013904223;
+		uthread_yield();
+	}
+	return x & 1;
+}
+
+double run(unsigned int workers)
+{
+	struct uthread_config config;
+	uthread_t tids[NUM_THREADS];
+	double start;
+	int i;
+
+	uthread_config_init(&config);
+	config.workers = workers;
+	uthread_start_config(&config);
+
+	start = now_ms();
+	for (i = 0; i < NUM_THREADS; i++)
+		tids[i] = uthread_create(thread);
+	for (i = 0; i < NUM_THREADS; i++)
+		uthread_join(tids[i], NULL);
+	start = now_ms() - start;
+
+	uthread_stop();
+	return start;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int max = sysconf(_SC_NPROCESSORS_ONLN), n;
+	double base = 0, ms;
+
+	if (argc > 1)
+		max = atoi(argv[1]);
+	for (n = 1; n <= max; n++)
+	{
+		ms = run(n);
+		if (n == 1)
+			base = ms;
+		printf("%3u workers %9.1f ms %6.2fx\n", n, ms, base / ms);
+	}
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Shared stack benchmark
+ *
+ * Compares dedicated stacks with shared stack mode on:
+ * - the memory cost of a parked thread, measured as the growth of the resident
+ *   set size while many threads sit in the ready queue, each having used a
+ *   small amount of stack;
+ * - the latency of a context switch between threads having used that same
+ *   amount of stack.
+ *
+ * Each mode runs in its own process so that resident set sizes don't mix.
+ *
+ * Usage: bench_shared_stack.x [threads] [stack bytes used per thread]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <uthread.h>
+
+#define SWITCH_THREADS 2
+#define SWITCH_ROUNDS 200000
+
+int num_threads = 10000;
+int stack_used = 1024;
+int rounds;
+volatile int stop;
+
+// Resident set size of the process, in KiB.
+long rss_kib(void)
+{
+	long pages, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f == NULL || fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		exit(1);
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Touch @stack_used bytes of stack, then yield @rounds times (or until stop).
+int parked(void)
+{
+	char *buf = alloca(stack_used);
+	int i;
+
+	memset(buf, 1, stack_used);
+	for (i = 0; !stop && (rounds == 0 || i < rounds); i++)
+		uthread_yield();
+	return buf[0];
+}
+
+void run(const char *mode, size_t shared)
+{
+	struct uthread_config config;
+	uthread_t *tids = malloc(num_threads * sizeof(uthread_t));
+	long before, after;
+	double start, elapsed;
+	int i;
+
+	uthread_config_init(&config);
+	config.shared_stack_size = shared;
+	if (uthread_start_config(&config)) {
+		fprintf(stderr, "%s: cannot start\n", mode);
+		exit(1);
+	}
+
+	// Memory per parked thread.
+	rounds = 0;
+	before = rss_kib();
+	for (i = 0; i < num_threads; i++)
+		tids[i] = uthread_create(parked);
+	uthread_yield();
+	after = rss_kib();
+	stop = 1;
+	for (i = 0; i < num_threads; i++)
+		uthread_join(tids[i], NULL);
+	stop = 0;
+
+	// Switch latency.
+	rounds = SWITCH_ROUNDS;
+	for (i = 0; i < SWITCH_THREADS; i++)
+		tids[i] = uthread_create(parked);
+	start = now_ns();
+	for (i = 0; i < SWITCH_THREADS; i++)
+		uthread_join(tids[i], NULL);
+	elapsed = now_ns() - start;
+
+	printf("%-10s %8.2f KiB/parked thread %8.1f ns/switch\n", mode,
+	       (double) (after - before) / num_threads,
+	       elapsed / (SWITCH_THREADS * SWITCH_ROUNDS));
+	uthread_stop();
+	free(tids);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		num_threads = atoi(argv[1]);
+	if (argc > 2)
+		stack_used = atoi(argv[2]);
+
+	printf("%d threads using %d bytes of stack each\n", num_threads,
+	       stack_used);
+	fflush(stdout);
+	if (fork() == 0) {
+		run("dedicated", 0);
+		return 0;
+	}
+	wait(NULL);
+	if (fork() == 0) {
+		run("shared", 1024 * 1024);
+		return 0;
+	}
+	wait(NULL);
+	return 0;
+}
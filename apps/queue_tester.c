@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <malloc.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -226,6 +228,263 @@ void test_queue_iterate(void)
 }
 
 
+// Grow while the items wrap around the end of the buffer, keeping FIFO order.
+void test_queue_grow(void)
+{
+	int data[1000], *ptr;
+	int i, ok = 1;
+	queue_t q;
+
+	fprintf(stderr, "*** TEST queue grows and keeps order ***\n");
+
+	q = queue_create();
+	for (i = 0; i < 1000; i++)
+	{
+		queue_enqueue(q, &data[i]);
+		// Shift the oldest item along the buffer.
+		if (i % 3 == 0)
+		{
+			queue_dequeue(q, (void**)&ptr);
+			if (ptr != &data[i / 3]) ok = 0;
+		}
+	}
+	TEST_ASSERT(queue_length(q) == 1000 - 334);
+	for (i = 334; i < 1000; i++)
+	{
+		queue_dequeue(q, (void**)&ptr);
+		if (ptr != &data[i]) ok = 0;
+	}
+	TEST_ASSERT(ok);
+	TEST_ASSERT(queue_destroy(q) == 0);
+}
+
+// Batches come out in order, and partially when the queue runs out.
+void test_queue_batch(void)
+{
+	int data[20];
+	void *in[20], *out[20];
+	int i, ok = 1;
+	queue_t q;
+
+	fprintf(stderr, "*** TEST batch enqueue/dequeue ***\n");
+
+	for (i = 0; i < 20; i++)
+		in[i] = &data[i];
+	q = queue_create();
+	TEST_ASSERT(queue_enqueue_batch(q, in, -1) == -1);
+	TEST_ASSERT(queue_dequeue_batch(NULL, out, 1) == -1);
+	queue_enqueue(q, &data[0]);
+	TEST_ASSERT(queue_enqueue_batch(q, in + 1, 19) == 0);
+	TEST_ASSERT(queue_length(q) == 20);
+	TEST_ASSERT(queue_dequeue_batch(q, out, 5) == 5);
+	TEST_ASSERT(queue_enqueue_batch(q, in, 5) == 0);
+	TEST_ASSERT(queue_dequeue_batch(q, out + 5, 20) == 20);
+	for (i = 0; i < 20; i++)
+		if (out[i] != in[i]) ok = 0;
+	TEST_ASSERT(ok);
+	TEST_ASSERT(queue_dequeue_batch(q, out, 5) == 0);
+	TEST_ASSERT(queue_destroy(q) == 0);
+}
+
+// Enqueues another item until there are 20.
+int call_back_enqueue(queue_t queue, void *data, void *extra)
+{
+	(void) data;
+	if (queue_length(queue) < 20)
+		queue_enqueue(queue, extra);
+	return 0;
+}
+
+// Count the items seen.
+int call_back_count(queue_t queue, void *data, void *count)
+{
+	(void) queue;
+	(void) data;
+	(*(int*)count)++;
+	return 0;
+}
+
+// Items enqueued while iterating are iterated too, even if the queue grows.
+void test_queue_iterate_enqueue(void)
+{
+	int data = 1, count = 0;
+	queue_t q;
+
+	fprintf(stderr, "*** TEST iterate, when items are enqueued ***\n");
+
+	q = queue_create();
+	queue_enqueue(q, &data);
+	queue_iterate(q, call_back_enqueue, &data, NULL);
+	TEST_ASSERT(queue_length(q) == 20);
+	queue_iterate(q, call_back_count, &count, NULL);
+	TEST_ASSERT(count == 20);
+}
+
+// Delete items by handle, then check handles of gone items are refused.
+void test_queue_delete_handle(void)
+{
+	int data[5], *ptr;
+	queue_handle_t handles[5];
+	void *out[5];
+	int i;
+	queue_t q;
+
+	fprintf(stderr, "*** TEST delete by handle ***\n");
+
+	q = queue_create();
+	for (i = 0; i < 5; i++)
+		queue_enqueue_handle(q, &data[i], &handles[i]);
+	TEST_ASSERT(queue_enqueue_handle(q, &data[0], NULL) == -1);
+	TEST_ASSERT(queue_delete_handle(q, handles[2]) == 0);
+	TEST_ASSERT(queue_delete_handle(q, handles[0]) == 0);
+	TEST_ASSERT(queue_length(q) == 3);
+
+	fprintf(stderr, "*** TEST delete by handle when item is gone ***\n");
+	TEST_ASSERT(queue_delete_handle(q, handles[2]) == -1);
+	TEST_ASSERT(queue_delete_handle(q, handles[0]) == -1);
+	queue_dequeue(q, (void**)&ptr);
+	TEST_ASSERT(ptr == &data[1]);
+	TEST_ASSERT(queue_delete_handle(q, handles[1]) == -1);
+
+	fprintf(stderr, "*** TEST handles of other items still valid ***\n");
+	TEST_ASSERT(queue_delete(q, &data[3]) == 0);
+	TEST_ASSERT(queue_dequeue_batch(q, out, 5) == 1);
+	TEST_ASSERT(out[0] == &data[4]);
+	TEST_ASSERT(queue_destroy(q) == 0);
+}
+
+#define CHURN 1000000
+
+// Heap in use, which the size of the queue's buffers shows in.
+static size_t heap_used(void)
+{
+	return mallinfo2().uordblks;
+}
+
+// Enqueue and delete an item behind the oldest one, by handle or not, many
+// times over, and check the queue didn't grow past its first few rounds.
+static void churn(queue_t q, int *data, int by_handle)
+{
+	queue_handle_t handle;
+	size_t used = 0;
+	int i;
+
+	for (i = 0; i < CHURN; i++)
+	{
+		if (i == 1000) used = heap_used();
+		if (by_handle)
+		{
+			queue_enqueue_handle(q, data, &handle);
+			queue_delete_handle(q, handle);
+		} else {
+			queue_enqueue(q, data);
+			queue_delete(q, data);
+		}
+	}
+	TEST_ASSERT(heap_used() == used);
+}
+
+// Deleted items are squeezed out instead of growing the queue, and handles
+// follow the items they refer to.
+void test_queue_churn(void)
+{
+	int head, middle, data, *ptr;
+	queue_handle_t head_handle, middle_handle, handle;
+	queue_t q;
+
+	fprintf(stderr, "*** TEST churn behind the oldest item ***\n");
+
+	q = queue_create();
+	queue_enqueue(q, &head);
+	churn(q, &data, 1);
+	churn(q, &data, 0);
+	TEST_ASSERT(queue_length(q) == 1);
+	queue_dequeue(q, (void**)&ptr);
+	TEST_ASSERT(ptr == &head);
+
+	fprintf(stderr, "*** TEST churn behind items with handles ***\n");
+	queue_enqueue_handle(q, &head, &head_handle);
+	queue_enqueue_handle(q, &data, &handle);
+	queue_enqueue_handle(q, &middle, &middle_handle);
+	TEST_ASSERT(queue_delete_handle(q, handle) == 0);
+	churn(q, &data, 1);
+	TEST_ASSERT(queue_delete_handle(q, handle) == -1);
+
+	fprintf(stderr, "*** TEST handles still valid after squeezing ***\n");
+	queue_enqueue(q, &data);
+	TEST_ASSERT(queue_delete_handle(q, middle_handle) == 0);
+	TEST_ASSERT(queue_delete_handle(q, middle_handle) == -1);
+	TEST_ASSERT(queue_length(q) == 2);
+	TEST_ASSERT(queue_delete_handle(q, head_handle) == 0);
+	queue_dequeue(q, (void**)&ptr);
+	TEST_ASSERT(ptr == &data);
+	TEST_ASSERT(queue_destroy(q) == 0);
+}
+
+// Item linked in intrusive queues.
+struct item {
+	int value;
+	struct queue_node node;
+};
+
+// Intrusive queue keeps FIFO order.
+void test_iqueue_simple(void)
+{
+	struct item items[3] = { { .value = 1 }, { .value = 2 }, { .value = 3 } };
+	struct queue_node *node;
+	struct iqueue q;
+	int i;
+
+	fprintf(stderr, "*** TEST intrusive queue FIFO order ***\n");
+
+	iqueue_init(&q);
+	for (i = 0; i < 3; i++)
+		iqueue_enqueue(&q, &items[i].node);
+	TEST_ASSERT(iqueue_length(&q) == 3);
+
+	for (i = 0; i < 3; i++)
+	{
+		iqueue_dequeue(&q, &node);
+		TEST_ASSERT(queue_entry(node, struct item, node) == &items[i]);
+	}
+	TEST_ASSERT(iqueue_length(&q) == 0);
+	TEST_ASSERT(iqueue_dequeue(&q, &node) == -1);
+}
+
+// Delete items from the middle and both ends of an intrusive queue.
+void test_iqueue_delete(void)
+{
+	struct item items[5];
+	struct queue_node *node;
+	struct iqueue q;
+	int i;
+
+	iqueue_init(&q);
+	for (i = 0; i < 5; i++)
+	{
+		items[i].value = i;
+		iqueue_enqueue(&q, &items[i].node);
+	}
+
+	fprintf(stderr, "*** TEST intrusive queue delete ***\n");
+	TEST_ASSERT(iqueue_delete(&q, &items[2].node) == 0);
+	TEST_ASSERT(iqueue_delete(&q, &items[0].node) == 0);
+	TEST_ASSERT(iqueue_delete(&q, &items[4].node) == 0);
+	TEST_ASSERT(iqueue_length(&q) == 2);
+
+	fprintf(stderr, "*** TEST intrusive queue delete when node is not in queue ***\n");
+	TEST_ASSERT(iqueue_delete(&q, &items[2].node) == -1);
+
+	iqueue_dequeue(&q, &node);
+	TEST_ASSERT(queue_entry(node, struct item, node)->value == 1);
+	iqueue_dequeue(&q, &node);
+	TEST_ASSERT(queue_entry(node, struct item, node)->value == 3);
+
+	fprintf(stderr, "*** TEST intrusive queue reuse of dequeued node ***\n");
+	TEST_ASSERT(iqueue_enqueue(&q, &items[2].node) == 0);
+	TEST_ASSERT(iqueue_length(&q) == 1);
+}
+
 int main(void)
 {
 	test_create();
@@ -237,6 +496,13 @@ int main(void)
 	test_delete();
 	test_queue_iterate_simple();
 	test_queue_iterate();
+	test_queue_grow();
+	test_queue_batch();
+	test_queue_iterate_enqueue();
+	test_queue_delete_handle();
+	test_queue_churn();
+	test_iqueue_simple();
+	test_iqueue_delete();
 
 	return 0;
 }
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthread.h>
+
+/*
+Channel test. Unbuffered sends switch to the waiting receiver, buffered sends
+only block when the buffer is full, closing fails waiters and drains the
+buffer, and select picks whichever operation can proceed. Then producers and
+consumers pass values through channels on several workers, with preemption,
+and blocked threads get their values on the shared stack too.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define PRODUCERS 4
+#define ITEMS 5000
+
+uthread_chan_t chan, other;
+long received;
+int step;
+
+int receiver(void)
+{
+	long value;
+
+	while (uthread_chan_recv(chan, &value) == 0)
+	{
+		received = value;
+		step++;
+	}
+	return 0;
+}
+
+// Unbuffered channels: values go straight to the receiver, which runs first.
+void test_unbuffered(void)
+{
+	long value = 42;
+	uthread_t tid;
+
+	fprintf(stderr, "*** TEST unbuffered channel ***\n");
+	chan = uthread_chan_create(sizeof(long), 0);
+	tid = uthread_create(receiver);
+	// Let it block receiving.
+	uthread_yield();
+	TEST_ASSERT(uthread_chan_send(chan, &value) == 0);
+	// The receiver ran before send returned.
+	TEST_ASSERT(received == 42 && step == 1);
+	value = 43;
+	TEST_ASSERT(uthread_chan_send(chan, &value) == 0);
+	TEST_ASSERT(received == 43 && step == 2);
+
+	fprintf(stderr, "*** TEST close wakes receivers ***\n");
+	TEST_ASSERT(uthread_chan_destroy(chan) == -1);
+	TEST_ASSERT(uthread_chan_close(chan) == 0);
+	TEST_ASSERT(uthread_chan_close(chan) == -1);
+	TEST_ASSERT(uthread_join(tid, NULL) == 0);
+	TEST_ASSERT(uthread_chan_send(chan, &value) == -1);
+	TEST_ASSERT(uthread_chan_destroy(chan) == 0);
+}
+
+int sender(void)
+{
+	int value = 7;
+
+	// Blocks, the buffer is full.
+	uthread_chan_send(chan, &value);
+	step++;
+	return 0;
+}
+
+// Buffered channels: FIFO, and senders only block when the buffer is full.
+void test_buffered(void)
+{
+	int values[3] = { 1, 2, 3 }, value;
+	uthread_t tid;
+
+	fprintf(stderr, "*** TEST buffered channel ***\n");
+	chan = uthread_chan_create(sizeof(int), 3);
+	for (int i = 0; i < 3; i++)
+		TEST_ASSERT(uthread_chan_send(chan, &values[i]) == 0);
+	step = 0;
+	tid = uthread_create(sender);
+	uthread_yield();
+	TEST_ASSERT(step == 0);
+	uthread_chan_recv(chan, &value);
+	TEST_ASSERT(value == 1);
+	uthread_join(tid, NULL);
+	TEST_ASSERT(step == 1);
+
+	fprintf(stderr, "*** TEST closed channel is drained ***\n");
+	uthread_chan_close(chan);
+	uthread_chan_recv(chan, &value);
+	TEST_ASSERT(value == 2);
+	uthread_chan_recv(chan, &value);
+	TEST_ASSERT(value == 3);
+	uthread_chan_recv(chan, &value);
+	TEST_ASSERT(value == 7);
+	TEST_ASSERT(uthread_chan_recv(chan, &value) == -1);
+	TEST_ASSERT(uthread_chan_destroy(chan) == 0);
+}
+
+int other_sender(void)
+{
+	int value = 9;
+
+	uthread_chan_send(other, &value);
+	return 0;
+}
+
+// Select proceeds with the operation that can, or waits for one.
+void test_select(void)
+{
+	struct uthread_chan_case cases[2];
+	int a = 0, b = 0, one = 1;
+	uthread_t tid;
+
+	fprintf(stderr, "*** TEST select ***\n");
+	chan = uthread_chan_create(sizeof(int), 1);
+	other = uthread_chan_create(sizeof(int), 0);
+	cases[0] = (struct uthread_chan_case) { chan, UTHREAD_CHAN_RECV, &a, 0 };
+	cases[1] = (struct uthread_chan_case) { other, UTHREAD_CHAN_RECV, &b, 0 };
+	TEST_ASSERT(uthread_chan_select(cases, 2, 0) == 2);
+	TEST_ASSERT(uthread_chan_select(cases, 0, 1) == -1);
+
+	uthread_chan_send(chan, &one);
+	TEST_ASSERT(uthread_chan_select(cases, 2, 1) == 0);
+	TEST_ASSERT(a == 1);
+
+	fprintf(stderr, "*** TEST select waits on every channel ***\n");
+	tid = uthread_create(other_sender);
+	TEST_ASSERT(uthread_chan_select(cases, 2, 1) == 1);
+	TEST_ASSERT(b == 9);
+	uthread_join(tid, NULL);
+
+	fprintf(stderr, "*** TEST select on a closed channel ***\n");
+	uthread_chan_close(other);
+	TEST_ASSERT(uthread_chan_select(cases, 2, 1) == 1);
+	TEST_ASSERT(cases[1].closed);
+
+	fprintf(stderr, "*** TEST select send ***\n");
+	cases[0].op = UTHREAD_CHAN_SEND;
+	cases[0].elem = &one;
+	TEST_ASSERT(uthread_chan_select(cases, 1, 0) == 0);
+	TEST_ASSERT(uthread_chan_select(cases, 1, 0) == 1);
+	TEST_ASSERT(uthread_chan_destroy(chan) == 0);
+	TEST_ASSERT(uthread_chan_destroy(other) == 0);
+}
+
+// Threads blocked on channels while others run on the shared stack.
+void test_shared_stack(void)
+{
+	struct uthread_config config;
+	struct uthread_chan_case c;
+	long value = 42;
+	int nine = 0;
+	uthread_t tid;
+
+	fprintf(stderr, "*** TEST channels on the shared stack ***\n");
+	uthread_config_init(&config);
+	config.shared_stack_size = 65536;
+	// Not available with the ucontext backend.
+	if (uthread_start_config(&config))
+		return;
+	chan = uthread_chan_create(sizeof(long), 0);
+	other = uthread_chan_create(sizeof(int), 0);
+	received = 0;
+	step = 0;
+	tid = uthread_create(receiver);
+	uthread_yield();
+	TEST_ASSERT(uthread_chan_send(chan, &value) == 0);
+	TEST_ASSERT(received == 42 && step == 1);
+
+	// Blocked sending.
+	uthread_t sender_tid = uthread_create(other_sender);
+	uthread_yield();
+	TEST_ASSERT(uthread_chan_recv(other, &nine) == 0 && nine == 9);
+	uthread_join(sender_tid, NULL);
+
+	c = (struct uthread_chan_case) { other, UTHREAD_CHAN_RECV, &nine, 0 };
+	TEST_ASSERT(uthread_chan_select_timeout(&c, 1, 1000000) == 1);
+
+	uthread_chan_close(chan);
+	TEST_ASSERT(uthread_join(tid, NULL) == 0);
+	TEST_ASSERT(uthread_chan_destroy(chan) == 0);
+	TEST_ASSERT(uthread_chan_destroy(other) == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+}
+
+uthread_chan_t work[2], done;
+
+// Send ITEMS values, alternating between two channels.
+int producer(void)
+{
+	for (long i = 1; i <= ITEMS; i++)
+		uthread_chan_send(work[i % 2], &i);
+	return 0;
+}
+
+// Sum values from either channel until both are closed.
+int consumer(void)
+{
+	struct uthread_chan_case cases[2];
+	long value, sum = 0;
+	int open = 2;
+
+	for (int i = 0; i < 2; i++)
+		cases[i] = (struct uthread_chan_case) { work[i], UTHREAD_CHAN_RECV, &value, 0 };
+	while (open)
+	{
+		int index = uthread_chan_select(cases, 2, 1);
+		if (cases[index].closed)
+		{
+			// Stop selecting it, by duplicating the other.
+			cases[index] = cases[1 - index];
+			open--;
+			continue;
+		}
+		sum += value;
+	}
+	uthread_chan_send(done, &sum);
+	return 0;
+}
+
+// Fan values out to consumers through select, on several workers.
+void test_workers(void)
+{
+	struct uthread_config config;
+	uthread_t tids[PRODUCERS], consumers[PRODUCERS];
+	long sum, total = 0;
+
+	fprintf(stderr, "*** TEST producers and consumers on 4 workers ***\n");
+	uthread_config_init(&config);
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	config.workers = 4;
+	uthread_start_config(&config);
+
+	work[0] = uthread_chan_create(sizeof(long), 0);
+	work[1] = uthread_chan_create(sizeof(long), 16);
+	done = uthread_chan_create(sizeof(long), PRODUCERS);
+	for (int i = 0; i < PRODUCERS; i++)
+	{
+		consumers[i] = uthread_create(consumer);
+		tids[i] = uthread_create(producer);
+	}
+	for (int i = 0; i < PRODUCERS; i++)
+		uthread_join(tids[i], NULL);
+	uthread_chan_close(work[0]);
+	uthread_chan_close(work[1]);
+	for (int i = 0; i < PRODUCERS; i++)
+	{
+		uthread_chan_recv(done, &sum);
+		total += sum;
+	}
+	TEST_ASSERT(total == (long) PRODUCERS * ITEMS * (ITEMS + 1) / 2);
+	// Consumers are done, collect them.
+	for (int i = 0; i < PRODUCERS; i++)
+		uthread_join(consumers[i], NULL);
+	uthread_chan_destroy(work[0]);
+	uthread_chan_destroy(work[1]);
+	uthread_chan_destroy(done);
+	TEST_ASSERT(uthread_stop() == 0);
+}
+
+int main(void)
+{
+	uthread_start(0);
+	test_unbuffered();
+	test_buffered();
+	test_select();
+	uthread_stop();
+
+	test_workers();
+	test_shared_stack();
+
+	return 0;
+}
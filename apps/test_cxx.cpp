@@ -0,0 +1,218 @@
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <uthread.hpp>
+
+/*
+C++ interface test. Threads run lambdas capturing by reference and by value,
+small and large, trivially copyable or not, and join() returns their results
+whatever the type. Small trivially copyable lambdas returning an int cost no
+allocation, handles join on destruction and move around, and uthread_create_data()
+gives threads their own copy of the data, also in shared stack mode.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+// Allocations made through operator new.
+static int allocations;
+
+void *operator new(std::size_t size)
+{
+	allocations++;
+	if (void *p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+struct pair
+{
+	int a, b;
+};
+
+int sum_pair(void *data)
+{
+	pair *p = static_cast<pair *>(data);
+	// Changing the copy leaves the original alone.
+	p->a = 0;
+	return p->b;
+}
+
+void test_c_api(bool own_stack)
+{
+	pair p = { 1, 2 };
+	struct uthread_attr attr;
+	int tid, retval;
+
+	tid = uthread_create_data(sum_pair, &p, sizeof(p), NULL);
+	TEST_ASSERT(tid > 0);
+	uthread_join(tid, &retval);
+	TEST_ASSERT(retval == 2 && p.a == 1);
+
+	// Data must leave room on the stack for the thread's frames.
+	if (own_stack)
+	{
+		static char big[16384];
+		uthread_attr_init(&attr);
+		attr.stack_size = 16384;
+		TEST_ASSERT(uthread_create_data(sum_pair, big, sizeof(big), &attr) == -1);
+	}
+	TEST_ASSERT(uthread_create_data(nullptr, &p, sizeof(p), NULL) == -1);
+}
+
+void test_results(void)
+{
+	int a = 20, b = 22;
+
+	// Capturing by reference, and by value, with no allocation.
+	auto add = [&] { return a + b; };
+	static_assert(sizeof(uthread::detail::payload<decltype(add), int>) == sizeof(add),
+		      "a small closure is passed as is");
+	int before = allocations;
+	{
+		uthread::thread t(add);
+		uthread::thread u([a, b] { return a * b; });
+		TEST_ASSERT(t.join() == 42);
+		TEST_ASSERT(u.join() == 440);
+	}
+	TEST_ASSERT(allocations == before);
+
+	uthread::thread s([] { return std::string(100, 'x'); });
+	uthread::thread d([] { return 0.5; });
+	uthread::thread l([] { return 1LL << 40; });
+	uthread::thread<unsigned char> c([] { return 200; });
+	TEST_ASSERT(s.join() == std::string(100, 'x'));
+	TEST_ASSERT(d.join() == 0.5);
+	TEST_ASSERT(l.join() == 1LL << 40);
+	TEST_ASSERT(c.join() == 200);
+}
+
+void test_closures(void)
+{
+	// Not trivially copyable: on the heap, and destroyed once run.
+	auto shared = std::make_shared<int>(7);
+	std::string name = "uthread";
+	uthread::thread t([shared, name] { return *shared + (int) name.size(); });
+	TEST_ASSERT(t.join() == 14);
+	TEST_ASSERT(shared.use_count() == 1);
+
+	// Too large to copy on the stack.
+	int values[64];
+	for (int i = 0; i < 64; i++)
+		values[i] = i;
+	uthread::thread big([values] {
+		int total = 0;
+		for (int v : values)
+			total += v;
+		return total;
+	});
+	TEST_ASSERT(big.join() == 64 * 63 / 2);
+
+	// Mutable state of its own.
+	int counter = 5;
+	uthread::thread m([counter]() mutable {
+		for (int i = 0; i < 3; i++) {
+			counter++;
+			uthread_yield();
+		}
+		return counter;
+	});
+	TEST_ASSERT(m.join() == 8 && counter == 5);
+}
+
+void test_handles(void)
+{
+	int done = 0;
+
+	// Joined on destruction.
+	{
+		uthread::thread t([&] { uthread_yield(); done = 1; });
+	}
+	TEST_ASSERT(done == 1);
+
+	// Moved around, and joined by whoever holds them.
+	std::vector<uthread::thread<int>> threads;
+	for (int i = 0; i < 10; i++)
+		threads.emplace_back([i] { uthread_yield(); return i * i; });
+	uthread::thread<int> moved = std::move(threads[9]);
+	TEST_ASSERT(!threads[9].joinable() && moved.joinable());
+	int total = moved.join();
+	for (int i = 0; i < 9; i++)
+		total += threads[i].join();
+	TEST_ASSERT(total == 285);
+	TEST_ASSERT(!moved.joinable());
+
+	bool thrown = false;
+	try {
+		moved.join();
+	} catch (const std::logic_error &) {
+		thrown = true;
+	}
+	TEST_ASSERT(thrown);
+
+	// Assigning over a running thread joins it first.
+	done = 0;
+	uthread::thread<void> t([&] { uthread_yield(); done = 1; });
+	t = uthread::thread<void>([] {});
+	TEST_ASSERT(done == 1);
+}
+
+int main(void)
+{
+	{
+		uthread::scheduler scheduler;
+		test_c_api(true);
+		test_results();
+		test_closures();
+		test_handles();
+	}
+
+	// Data is copied off the stack when threads share theirs. The ucontext
+	// backend has no shared stack, and refuses to start.
+	uthread_config config = uthread::scheduler::default_config();
+	config.shared_stack_size = 65536;
+	std::optional<uthread::scheduler> shared;
+	try {
+		shared.emplace(config);
+	} catch (const std::runtime_error &) {
+	}
+	if (shared)
+	{
+		std::string text = "shared";
+		int a = 1, b = 2;
+		uthread::thread t([&] { return a + b; });
+		uthread::thread u([text] { return text + " stack"; });
+		TEST_ASSERT(t.join() == 3);
+		TEST_ASSERT(u.join() == "shared stack");
+		test_c_api(false);
+	}
+	shared.reset();
+
+	// Back to a stopped library.
+	TEST_ASSERT(uthread_start(0) == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+	return 0;
+}
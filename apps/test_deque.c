@@ -0,0 +1,153 @@
+/*
+ * Work-stealing deque tester
+ *
+ * Checks the orders in which items come out of a deque, its growth, and that
+ * with an owner pushing and popping while thieves steal concurrently, every
+ * item is taken exactly once.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <deque.h>
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define ITEMS 200000
+#define THIEVES 3
+
+/* Items are 1..ITEMS, cast to pointers since NULL means empty */
+#define ITEM(i) ((void*) (uintptr_t) (i))
+
+/* Pop is LIFO, steal is FIFO */
+void test_order(void)
+{
+	struct deque d;
+
+	fprintf(stderr, "*** TEST order ***\n");
+
+	TEST_ASSERT(deque_init(&d, 4) == 0);
+	TEST_ASSERT(deque_pop(&d) == NULL);
+	TEST_ASSERT(deque_steal(&d) == NULL);
+	deque_push(&d, ITEM(1));
+	deque_push(&d, ITEM(2));
+	deque_push(&d, ITEM(3));
+	TEST_ASSERT(deque_length(&d) == 3);
+	TEST_ASSERT(deque_pop(&d) == ITEM(3));
+	TEST_ASSERT(deque_steal(&d) == ITEM(1));
+	TEST_ASSERT(deque_pop(&d) == ITEM(2));
+	TEST_ASSERT(deque_pop(&d) == NULL);
+	TEST_ASSERT(deque_length(&d) == 0);
+	deque_destroy(&d);
+}
+
+/* Growing keeps the items in order */
+void test_grow(void)
+{
+	struct deque d;
+	int ok = 1;
+
+	fprintf(stderr, "*** TEST grow ***\n");
+
+	deque_init(&d, 2);
+	for (int i = 1; i <= 1000; i++)
+	{
+		// Shift the indices as well.
+		deque_push(&d, ITEM(i));
+		if (i % 3 == 0 && deque_steal(&d) != ITEM(i / 3))
+			ok = 0;
+	}
+	TEST_ASSERT(ok);
+	TEST_ASSERT(deque_length(&d) == 1000 - 333);
+	for (int i = 334; i <= 1000; i++)
+	{
+		if (deque_steal(&d) != ITEM(i))
+			ok = 0;
+	}
+	TEST_ASSERT(ok);
+	TEST_ASSERT(deque_steal(&d) == NULL);
+	deque_destroy(&d);
+}
+
+struct deque shared;
+unsigned char taken[ITEMS + 1];
+volatile int done;
+
+void take(void *item)
+{
+	__atomic_add_fetch(&taken[(uintptr_t) item], 1, __ATOMIC_RELAXED);
+}
+
+void *thief(void *arg)
+{
+	void *item;
+
+	(void) arg;
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+	{
+		if ((item = deque_steal(&shared)) != NULL)
+			take(item);
+	}
+	while ((item = deque_steal(&shared)) != NULL)
+		take(item);
+	return NULL;
+}
+
+/* Every item is taken exactly once, by the owner or a thief */
+void test_concurrent(void)
+{
+	pthread_t thieves[THIEVES];
+	void *item;
+	int once = 1;
+
+	fprintf(stderr, "*** TEST concurrent ***\n");
+
+	deque_init(&shared, 16);
+	for (int i = 0; i < THIEVES; i++)
+		pthread_create(&thieves[i], NULL, thief, NULL);
+	for (int i = 1; i <= ITEMS; i++)
+	{
+		deque_push(&shared, ITEM(i));
+		// Pop now and then, racing with thieves for the last items.
+		if (i % 4 == 0)
+		{
+			for (int j = 0; j < 3; j++)
+				if ((item = deque_pop(&shared)) != NULL)
+					take(item);
+		}
+	}
+	while ((item = deque_pop(&shared)) != NULL)
+		take(item);
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < THIEVES; i++)
+		pthread_join(thieves[i], NULL);
+
+	for (int i = 1; i <= ITEMS; i++)
+	{
+		if (taken[i] != 1)
+			once = 0;
+	}
+	TEST_ASSERT(once);
+	TEST_ASSERT(deque_length(&shared) == 0);
+	deque_destroy(&shared);
+}
+
+int main(void)
+{
+	test_order();
+	test_grow();
+	test_concurrent();
+
+	return 0;
+}
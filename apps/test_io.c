@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <uthread.h>
+
+/*
+I/O test. A thread reading an empty pipe blocks without blocking the others,
+and runs again once data is written, or fails once the pipe is closed. A
+writer blocks on a full socket until its peer reads. Then clients talk to an
+echo server over loopback TCP, on one and several workers.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define CLIENTS 8
+#define MESSAGES 100
+#define BULK_SIZE (1 << 20)
+
+int fds[2];
+int step;
+int error;
+
+int reader(void)
+{
+	char c;
+	ssize_t ret = uthread_read(fds[0], &c, 1);
+
+	error = ret < 0 ? errno : 0;
+	step++;
+	return ret == 1 ? c : -1;
+}
+
+// A reader blocks until a writer shows up, while other threads keep running.
+void test_pipe(void)
+{
+	uthread_t tid;
+	int retval;
+
+	fprintf(stderr, "*** TEST read blocks the thread only ***\n");
+	pipe(fds);
+	step = 0;
+	tid = uthread_create(reader);
+	uthread_yield();
+	// The reader is blocked, main still runs.
+	TEST_ASSERT(step == 0);
+	uthread_yield();
+	TEST_ASSERT(step == 0);
+	TEST_ASSERT(uthread_write(fds[1], "x", 1) == 1);
+	uthread_join(tid, &retval);
+	TEST_ASSERT(step == 1 && retval == 'x');
+
+	fprintf(stderr, "*** TEST close fails readers ***\n");
+	tid = uthread_create(reader);
+	uthread_yield();
+	TEST_ASSERT(step == 1);
+	TEST_ASSERT(uthread_close(fds[0]) == 0);
+	uthread_join(tid, &retval);
+	TEST_ASSERT(step == 2 && retval == -1 && error == EBADF);
+	uthread_close(fds[1]);
+}
+
+int bulk_writer(void)
+{
+	static char buf[BULK_SIZE];
+	size_t done = 0;
+
+	memset(buf, 'b', sizeof(buf));
+	while (done < sizeof(buf))
+	{
+		ssize_t ret = uthread_write(fds[1], buf + done, sizeof(buf) - done);
+		if (ret <= 0) return -1;
+		done += ret;
+	}
+	step++;
+	uthread_close(fds[1]);
+	return 0;
+}
+
+// A writer blocks on a full socket until its peer reads.
+void test_bulk(void)
+{
+	char buf[4096];
+	size_t total = 0;
+	ssize_t ret;
+	uthread_t tid;
+	int retval;
+
+	fprintf(stderr, "*** TEST write blocks on a full socket ***\n");
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	step = 0;
+	tid = uthread_create(bulk_writer);
+	uthread_yield();
+	// Far more than a socket buffer holds, the writer waits for us.
+	TEST_ASSERT(step == 0);
+	while ((ret = uthread_read(fds[0], buf, sizeof(buf))) > 0)
+	{
+		for (ssize_t i = 0; i < ret; i++)
+			if (buf[i] != 'b') ret = -1;
+		if (ret < 0) break;
+		total += ret;
+	}
+	TEST_ASSERT(ret == 0 && total == BULK_SIZE);
+	uthread_join(tid, &retval);
+	TEST_ASSERT(step == 1 && retval == 0);
+	uthread_close(fds[0]);
+}
+
+struct sockaddr_in server_addr;
+int listener;
+// Accepted connections, and the next one to serve.
+int conns[CLIENTS];
+int next_conn;
+
+int echo(void)
+{
+	int fd = conns[__atomic_fetch_add(&next_conn, 1, __ATOMIC_SEQ_CST)];
+	char buf[256];
+	ssize_t ret;
+
+	while ((ret = uthread_read(fd, buf, sizeof(buf))) > 0)
+	{
+		if (uthread_write(fd, buf, ret) != ret)
+			break;
+	}
+	uthread_close(fd);
+	return ret == 0 ? 0 : -1;
+}
+
+int acceptor(void)
+{
+	uthread_t tids[CLIENTS];
+	int failed = 0;
+
+	for (int i = 0; i < CLIENTS; i++)
+	{
+		conns[i] = uthread_accept(listener, NULL, NULL);
+		if (conns[i] < 0) return -1;
+		tids[i] = uthread_create(echo);
+	}
+	for (int i = 0; i < CLIENTS; i++)
+	{
+		int retval;
+		uthread_join(tids[i], &retval);
+		failed |= retval;
+	}
+	return failed;
+}
+
+int client(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	char out[32], in[32];
+
+	if (uthread_connect(fd, (struct sockaddr*) &server_addr, sizeof(server_addr)))
+		return -1;
+	for (int i = 0; i < MESSAGES; i++)
+	{
+		size_t len = snprintf(out, sizeof(out), "%d/%d", fd, i);
+		size_t got = 0;
+		if (uthread_write(fd, out, len) != (ssize_t) len)
+			return -1;
+		while (got < len)
+		{
+			ssize_t ret = uthread_read(fd, in + got, len - got);
+			if (ret <= 0) return -1;
+			got += ret;
+		}
+		if (memcmp(in, out, len)) return -1;
+	}
+	uthread_close(fd);
+	__atomic_add_fetch(&step, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+// Clients and an echo server, all threads of this process.
+void test_echo(int workers)
+{
+	struct uthread_config config;
+	socklen_t len = sizeof(server_addr);
+	uthread_t server, tids[CLIENTS];
+	int retval, failed = 0;
+
+	fprintf(stderr, "*** TEST echo server on %d worker(s) ***\n", workers);
+	uthread_config_init(&config);
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	config.workers = workers;
+	uthread_start_config(&config);
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server_addr.sin_port = 0;
+	bind(listener, (struct sockaddr*) &server_addr, sizeof(server_addr));
+	listen(listener, CLIENTS);
+	getsockname(listener, (struct sockaddr*) &server_addr, &len);
+
+	step = 0;
+	next_conn = 0;
+	server = uthread_create(acceptor);
+	for (int i = 0; i < CLIENTS; i++)
+		tids[i] = uthread_create(client);
+	for (int i = 0; i < CLIENTS; i++)
+	{
+		uthread_join(tids[i], &retval);
+		failed |= retval;
+	}
+	TEST_ASSERT(failed == 0 && step == CLIENTS);
+	uthread_join(server, &retval);
+	TEST_ASSERT(retval == 0);
+	uthread_close(listener);
+	TEST_ASSERT(uthread_stop() == 0);
+}
+
+int main(void)
+{
+	uthread_start(0);
+	test_pipe();
+	test_bulk();
+	uthread_stop();
+
+	test_echo(1);
+	test_echo(2);
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthread.h>
+
+/*
+Join test. A thread blocked joining another one can itself be joined, and
+join fails for main, for the calling thread, for unknown TIDs and for threads
+that are already joined or collected. The TIDs of collected threads are handed
+out again, so that any number of threads can be created over time.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+uthread_t leaf_tid;
+int self_join;
+int double_join;
+
+int leaf(void)
+{
+	// Let middle() block on us, then try to join ourselves.
+	uthread_yield();
+	self_join = uthread_join(uthread_self(), NULL);
+	return 1;
+}
+
+int middle(void)
+{
+	int retval;
+
+	leaf_tid = uthread_create(leaf);
+	uthread_join(leaf_tid, &retval);
+	return retval + 1;
+}
+
+int nothing(void)
+{
+	return 3;
+}
+
+int main(void)
+{
+	struct uthread_attr attr;
+	uthread_t middle_tid;
+	int retval = 0, created = 0;
+
+	uthread_start(0);
+
+	fprintf(stderr, "*** TEST join a blocked thread ***\n");
+	middle_tid = uthread_create(middle);
+	// Run middle() until it blocks joining leaf().
+	uthread_yield();
+	TEST_ASSERT(uthread_join(middle_tid, &retval) == 0);
+	TEST_ASSERT(retval == 2);
+
+	fprintf(stderr, "*** TEST invalid joins ***\n");
+	TEST_ASSERT(self_join == -1);
+	TEST_ASSERT(uthread_join(0, NULL) == -1);
+	TEST_ASSERT(uthread_join(1000, NULL) == -1);
+	TEST_ASSERT(uthread_join(middle_tid, NULL) == -1);
+	TEST_ASSERT(uthread_join(leaf_tid, NULL) == -1);
+
+	fprintf(stderr, "*** TEST TIDs are recycled ***\n");
+	for (int i = 0; i < USHRT_MAX + 1000; i++)
+	{
+		int tid = uthread_create(nothing);
+		if (tid > 0 && tid <= 2 && uthread_join(tid, &retval) == 0 && retval == 3)
+			created++;
+	}
+	TEST_ASSERT(created == USHRT_MAX + 1000);
+	// A thread that couldn't be created gives its TID back too.
+	uthread_attr_init(&attr);
+	attr.stack_size = 16;
+	TEST_ASSERT(uthread_create_attr(nothing, &attr) == -1);
+	middle_tid = uthread_create(nothing);
+	TEST_ASSERT(middle_tid <= 2);
+	TEST_ASSERT(uthread_join(middle_tid, NULL) == 0);
+
+	TEST_ASSERT(uthread_stop() == 0);
+	return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * MPMC queue tester
+ *
+ * Checks the semantics of the lock-free queue on a single thread, then
+ * stresses it with several producers and consumers on kernel threads: every
+ * item must come out exactly once, and the items of each producer in the
+ * order it enqueued them. Finally, enqueues from a signal handler while the
+ * interrupted thread keeps enqueueing and dequeueing.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <mpmc.h>
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define PER_PRODUCER 100000
+
+/* Items encode their producer and rank, plus one since NULL is invalid */
+#define ITEM(producer, i) ((void*) (uintptr_t) ((producer) * PER_PRODUCER + (i) + 1))
+#define ITEM_PRODUCER(item) (((uintptr_t) (item) - 1) / PER_PRODUCER)
+#define ITEM_RANK(item) (((uintptr_t) (item) - 1) % PER_PRODUCER)
+
+/* Same semantics as queue_t, bounded */
+void test_simple(void)
+{
+	int a = 1, b = 2, c = 3, *ptr;
+	mpmc_queue_t q;
+
+	fprintf(stderr, "*** TEST simple ***\n");
+
+	TEST_ASSERT(mpmc_queue_create(0) == NULL);
+	q = mpmc_queue_create(3);
+	TEST_ASSERT(q != NULL);
+	TEST_ASSERT(mpmc_queue_enqueue(q, NULL) == -1);
+	TEST_ASSERT(mpmc_queue_dequeue(q, (void**)&ptr) == -1);
+	TEST_ASSERT(mpmc_queue_enqueue(q, &a) == 0);
+	TEST_ASSERT(mpmc_queue_enqueue(q, &b) == 0);
+	TEST_ASSERT(mpmc_queue_enqueue(q, &c) == 0);
+	TEST_ASSERT(mpmc_queue_length(q) == 3);
+	TEST_ASSERT(mpmc_queue_destroy(q) == -1);
+	mpmc_queue_dequeue(q, (void**)&ptr);
+	TEST_ASSERT(ptr == &a);
+	mpmc_queue_dequeue(q, (void**)&ptr);
+	TEST_ASSERT(ptr == &b);
+	mpmc_queue_dequeue(q, (void**)&ptr);
+	TEST_ASSERT(ptr == &c);
+	TEST_ASSERT(mpmc_queue_length(q) == 0);
+	TEST_ASSERT(mpmc_queue_destroy(q) == 0);
+	TEST_ASSERT(mpmc_queue_length(NULL) == -1);
+}
+
+/* Full at capacity, rounded up to a power of two, and usable lap after lap */
+void test_full(void)
+{
+	int data = 3, *ptr;
+	int ok = 1;
+	mpmc_queue_t q;
+
+	fprintf(stderr, "*** TEST full ***\n");
+
+	q = mpmc_queue_create(3);
+	for (int i = 0; i < 4; i++)
+		mpmc_queue_enqueue(q, &data);
+	TEST_ASSERT(mpmc_queue_enqueue(q, &data) == -1);
+	TEST_ASSERT(mpmc_queue_length(q) == 4);
+	for (int lap = 0; lap < 100; lap++)
+	{
+		if (mpmc_queue_dequeue(q, (void**)&ptr) || mpmc_queue_enqueue(q, &data))
+			ok = 0;
+	}
+	TEST_ASSERT(ok);
+	while (mpmc_queue_dequeue(q, (void**)&ptr) == 0);
+	TEST_ASSERT(mpmc_queue_destroy(q) == 0);
+}
+
+mpmc_queue_t shared;
+unsigned char taken[PRODUCERS * PER_PRODUCER];
+int in_order = 1;
+int consumed;
+
+void *producer(void *arg)
+{
+	uintptr_t p = (uintptr_t) arg;
+
+	for (int i = 0; i < PER_PRODUCER; i++)
+	{
+		// Full, let consumers run.
+		while (mpmc_queue_enqueue(shared, ITEM(p, i)))
+			sched_yield();
+	}
+	return NULL;
+}
+
+void *consumer(void *arg)
+{
+	long last[PRODUCERS];
+	void *item;
+
+	(void) arg;
+	memset(last, -1, sizeof(last));
+	while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < PRODUCERS * PER_PRODUCER)
+	{
+		if (mpmc_queue_dequeue(shared, &item))
+		{
+			sched_yield();
+			continue;
+		}
+		__atomic_add_fetch(&consumed, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&taken[(uintptr_t) item - 1], 1, __ATOMIC_RELAXED);
+		// A consumer sees each producer's items in increasing order.
+		if ((long) ITEM_RANK(item) <= last[ITEM_PRODUCER(item)])
+			in_order = 0;
+		last[ITEM_PRODUCER(item)] = ITEM_RANK(item);
+	}
+	return NULL;
+}
+
+/* Every item comes out once, in order per producer */
+void test_concurrent(void)
+{
+	pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+	int once = 1;
+
+	fprintf(stderr, "*** TEST concurrent ***\n");
+
+	// Small enough to be full and empty often.
+	shared = mpmc_queue_create(64);
+	for (uintptr_t i = 0; i < CONSUMERS; i++)
+		pthread_create(&consumers[i], NULL, consumer, NULL);
+	for (uintptr_t i = 0; i < PRODUCERS; i++)
+		pthread_create(&producers[i], NULL, producer, (void*) i);
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(producers[i], NULL);
+	for (int i = 0; i < CONSUMERS; i++)
+		pthread_join(consumers[i], NULL);
+
+	for (int i = 0; i < PRODUCERS * PER_PRODUCER; i++)
+	{
+		if (taken[i] != 1)
+			once = 0;
+	}
+	TEST_ASSERT(once);
+	TEST_ASSERT(in_order);
+	TEST_ASSERT(mpmc_queue_destroy(shared) == 0);
+}
+
+volatile sig_atomic_t signaled;
+int signal_data;
+
+void handler(int signum)
+{
+	(void) signum;
+	if (mpmc_queue_enqueue(shared, &signal_data) == 0)
+		signaled++;
+}
+
+/* Enqueueing from a signal handler never deadlocks nor loses items */
+void test_signal(void)
+{
+	struct itimerval timer = { { 0, 100 }, { 0, 100 } };
+	struct itimerval off = { { 0, 0 }, { 0, 0 } };
+	int data = 3, *ptr;
+	long from_signal = 0;
+
+	fprintf(stderr, "*** TEST signal ***\n");
+
+	shared = mpmc_queue_create(1024);
+	signal(SIGALRM, handler);
+	setitimer(ITIMER_REAL, &timer, NULL);
+	while (signaled < 200)
+	{
+		mpmc_queue_enqueue(shared, &data);
+		if (mpmc_queue_dequeue(shared, (void**)&ptr) == 0 && ptr == &signal_data)
+			from_signal++;
+	}
+	setitimer(ITIMER_REAL, &off, NULL);
+	while (mpmc_queue_dequeue(shared, (void**)&ptr) == 0)
+	{
+		if (ptr == &signal_data)
+			from_signal++;
+	}
+	TEST_ASSERT(from_signal == signaled);
+	TEST_ASSERT(mpmc_queue_destroy(shared) == 0);
+}
+
+int main(void)
+{
+	test_simple();
+	test_full();
+	test_concurrent();
+	test_signal();
+
+	return 0;
+}
@@ -5,7 +5,7 @@
 
 uthread_t one_tid;
 uthread_t two_tid;
-int x = 1;
+volatile int x = 1;
 
 /*
 Preemption test. Main creates thread1 and thread2, then joins to thread1 and gets blocked.
@@ -23,10 +23,11 @@ int thread2(void)
 }
 
 // First thread, runs an infinite loop unless it is preempted, which yields to thread2.
-// The loop prints a zero width space as to not fill up the terminal.
+// The loop must not call into stdio: being preempted while holding the stdout
+// lock would deadlock thread2's printf. x is volatile so that it's re-read.
 int thread1(void)
 {
-	while (x) printf("​");
+	while (x);
 	printf("There!\n");
 	return 1000;
 }
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthread.h>
+
+/*
+Priority scheduling test. With the default FIFO policy, threads run in the
+order they were created whatever their priority. With the MLFQ policy, the
+highest priority ready thread always runs first, even when it yields. A
+thread spinning at the highest priority gets demoted each time it is
+preempted, until a lower priority thread gets to run and stops it; without
+demotion the test hangs.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+int order[8];
+int ran;
+volatile int flag = 1;
+
+int runner(void)
+{
+	order[ran++] = uthread_self();
+	uthread_yield();
+	order[ran++] = uthread_self();
+	return 0;
+}
+
+int spinner(void)
+{
+	while (flag);
+	return 0;
+}
+
+int stopper(void)
+{
+	flag = 0;
+	return 0;
+}
+
+// Create a low then a high priority thread running runner(), and join them.
+void run_two(uthread_t *low, uthread_t *high)
+{
+	struct uthread_attr attr;
+
+	ran = 0;
+	uthread_attr_init(&attr);
+	attr.priority = 20;
+	*low = uthread_create_attr(runner, &attr);
+	attr.priority = 2;
+	*high = uthread_create_attr(runner, &attr);
+	uthread_join(*low, NULL);
+	uthread_join(*high, NULL);
+}
+
+int main(void)
+{
+	struct uthread_config config;
+	struct uthread_attr attr;
+	uthread_t low, high, spin, stop;
+
+	fprintf(stderr, "*** TEST invalid priority ***\n");
+	uthread_start(0);
+	uthread_attr_init(&attr);
+	attr.priority = UTHREAD_PRIO_LEVELS;
+	TEST_ASSERT(uthread_create_attr(runner, &attr) == -1);
+	attr.priority = -1;
+	TEST_ASSERT(uthread_create_attr(runner, &attr) == -1);
+
+	fprintf(stderr, "*** TEST FIFO ignores priorities ***\n");
+	run_two(&low, &high);
+	TEST_ASSERT(ran == 4);
+	TEST_ASSERT(order[0] == low && order[1] == high);
+	TEST_ASSERT(order[2] == low && order[3] == high);
+	uthread_stop();
+
+	fprintf(stderr, "*** TEST MLFQ runs higher priority first ***\n");
+	uthread_config_init(&config);
+	config.sched_policy = UTHREAD_SCHED_MLFQ;
+	TEST_ASSERT(uthread_start_config(&config) == 0);
+	run_two(&low, &high);
+	TEST_ASSERT(ran == 4);
+	// Yielding keeps the priority, so high finishes before low resumes.
+	TEST_ASSERT(order[0] == high && order[1] == high);
+	TEST_ASSERT(order[2] == low && order[3] == low);
+	uthread_stop();
+
+	fprintf(stderr, "*** TEST MLFQ demotes preempted threads ***\n");
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	config.boost_ticks = 0;
+	TEST_ASSERT(uthread_start_config(&config) == 0);
+	attr.priority = 0;
+	spin = uthread_create_attr(spinner, &attr);
+	attr.priority = 4;
+	stop = uthread_create_attr(stopper, &attr);
+	uthread_join(spin, NULL);
+	uthread_join(stop, NULL);
+	TEST_ASSERT(flag == 0);
+	uthread_stop();
+
+	return 0;
+}
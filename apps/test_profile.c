@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uthread.h>
+
+/*
+Profiling test. One thread burns three times the CPU of another, and the folded
+stacks show each thread's stack down to the loop it spins in, with about three
+times the samples for the first. Nothing is sampled while profiling is
+disabled, and profiling requires preemption.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define PROFILE_PATH "/tmp/test_profile.folded"
+
+#define WORK 20000000L
+
+__attribute__((noinline)) void spin(long iterations)
+{
+	for (volatile long i = 0; i < iterations; i++);
+}
+
+__attribute__((noinline)) void hot_loop(void)
+{
+	spin(3 * WORK);
+}
+
+__attribute__((noinline)) void cold_loop(void)
+{
+	spin(WORK);
+}
+
+__attribute__((noinline)) void ignored_loop(void)
+{
+	spin(WORK);
+}
+
+int hot_thread(void)
+{
+	hot_loop();
+	return 0;
+}
+
+int cold_thread(void)
+{
+	cold_loop();
+	return 0;
+}
+
+int ignored_thread(void)
+{
+	ignored_loop();
+	return 0;
+}
+
+// Samples of the stacks containing all of @frames, in that order.
+long samples(const char *frames)
+{
+	FILE *file = fopen(PROFILE_PATH, "r");
+	char line[4096];
+	long total = 0;
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char *count = strrchr(line, ' ');
+		*count = '\0';
+		if (strstr(line, frames) != NULL)
+			total += atol(count + 1);
+	}
+	fclose(file);
+	return total;
+}
+
+int main(void)
+{
+	struct uthread_config config;
+	uthread_t hot, cold, ignored;
+	char frames[32];
+
+	uthread_config_init(&config);
+	config.profile_samples = 4096;
+	TEST_ASSERT(uthread_start_config(&config) == -1);
+
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	TEST_ASSERT(uthread_start_config(&config) == 0);
+
+	ignored = uthread_create(ignored_thread);
+	uthread_join(ignored, NULL);
+
+	TEST_ASSERT(uthread_profile_enable(1) == 0);
+	hot = uthread_create(hot_thread);
+	cold = uthread_create(cold_thread);
+	uthread_join(hot, NULL);
+	uthread_join(cold, NULL);
+	TEST_ASSERT(uthread_profile_enable(0) == 0);
+	TEST_ASSERT(uthread_profile_dump(PROFILE_PATH) == 0);
+
+	long hot_samples = samples("hot_thread;hot_loop;spin");
+	long cold_samples = samples("cold_thread;cold_loop;spin");
+	printf("hot %ld, cold %ld\n", hot_samples, cold_samples);
+	TEST_ASSERT(samples("ignored") == 0);
+	TEST_ASSERT(cold_samples > 0);
+	TEST_ASSERT(hot_samples > 2 * cold_samples);
+	snprintf(frames, sizeof(frames), "uthread %d;", hot);
+	TEST_ASSERT(samples(frames) >= hot_samples);
+	snprintf(frames, sizeof(frames), "uthread %d;", cold);
+	TEST_ASSERT(samples(frames) >= cold_samples);
+
+	TEST_ASSERT(uthread_stop() == 0);
+	TEST_ASSERT(uthread_profile_enable(1) == -1);
+	TEST_ASSERT(uthread_profile_dump(PROFILE_PATH) == -1);
+	remove(PROFILE_PATH);
+	return 0;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <uthread.h>
+
+/*
+Preemption timer test. With a 1 ms wall-clock quantum, two spinning threads
+must take turns many times in 100 ms. In tickless mode, the timer stops while
+main spins alone, and must come back as soon as a second thread is ready,
+otherwise spinner() never lets flipper() run and the test hangs.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+volatile int turn;
+volatile int turns;
+volatile int flag = 1;
+
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Spin for 100 ms, counting how many times the other thread ran meanwhile.
+int taker(void)
+{
+	double end = now_ms() + 100;
+
+	while (now_ms() < end)
+	{
+		if (turn != uthread_self())
+		{
+			turn = uthread_self();
+			turns++;
+		}
+	}
+	return 0;
+}
+
+int spinner(void)
+{
+	while (flag);
+	return 0;
+}
+
+int flipper(void)
+{
+	flag = 0;
+	return 0;
+}
+
+int main(void)
+{
+	struct uthread_config config;
+	uthread_t one, two;
+	double end;
+
+	uthread_config_init(&config);
+	config.preempt = 1;
+
+	fprintf(stderr, "*** TEST invalid quantum ***\n");
+	config.quantum_us = 0;
+	TEST_ASSERT(uthread_start_config(&config) == -1);
+
+	fprintf(stderr, "*** TEST 1 ms wall-clock quantum ***\n");
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	TEST_ASSERT(uthread_start_config(&config) == 0);
+	one = uthread_create(taker);
+	two = uthread_create(taker);
+	uthread_join(one, NULL);
+	uthread_join(two, NULL);
+	// About 100 turns expected, leave room for a loaded machine.
+	TEST_ASSERT(turns >= 20);
+	TEST_ASSERT(uthread_stop() == 0);
+
+	fprintf(stderr, "*** TEST tickless timer is restarted ***\n");
+	config.preempt_clock = UTHREAD_CLOCK_CPU;
+	config.tickless = 1;
+	TEST_ASSERT(uthread_start_config(&config) == 0);
+	// Spin alone for a while, the timer gets stopped.
+	end = now_ms() + 20;
+	while (now_ms() < end);
+	one = uthread_create(spinner);
+	two = uthread_create(flipper);
+	uthread_join(one, NULL);
+	uthread_join(two, NULL);
+	TEST_ASSERT(flag == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+	return 0;
+}
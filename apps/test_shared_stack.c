@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uthread.h>
+
+/*
+Shared stack test. Every thread fills a buffer on its stack, then yields from
+inside a recursion so that other threads overwrite the shared stack in the
+meantime. When resumed, each thread must find its own stack contents intact.
+The test is run both without and with preemption, and skipped with the
+ucontext backend, which has no shared stack.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define NUM_THREADS 16
+#define DEPTH 8
+#define ROUNDS 50
+
+// Number of stack corruptions detected by the threads.
+int corrupted;
+
+int check(int depth)
+{
+	char buf[256];
+	int i, round, sum = 0;
+
+	memset(buf, uthread_self() + depth, sizeof(buf));
+	if (depth > 0)
+		sum = check(depth - 1);
+
+	for (round = 0; round < ROUNDS; round++) {
+		uthread_yield();
+		for (i = 0; i < (int) sizeof(buf); i++)
+			if (buf[i] != (char) (uthread_self() + depth))
+				corrupted++;
+	}
+	return sum + buf[0];
+}
+
+int thread(void)
+{
+	return check(DEPTH);
+}
+
+// Return: -1 if shared stacks aren't available. 0 otherwise.
+int run(int preempt)
+{
+	struct uthread_config config;
+	uthread_t tids[NUM_THREADS];
+	int i, retval, expected, ok = 1;
+
+	uthread_config_init(&config);
+	config.preempt = preempt;
+	config.shared_stack_size = 256 * 1024;
+	if (uthread_start_config(&config))
+		return -1;
+
+	for (i = 0; i < NUM_THREADS; i++)
+		tids[i] = uthread_create(thread);
+	for (i = 0; i < NUM_THREADS; i++) {
+		uthread_join(tids[i], &retval);
+		expected = (DEPTH + 1) * tids[i] + DEPTH * (DEPTH + 1) / 2;
+		if (retval != expected)
+			ok = 0;
+	}
+	TEST_ASSERT(ok);
+	TEST_ASSERT(corrupted == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+	return 0;
+}
+
+int main(void)
+{
+	fprintf(stderr, "*** TEST shared stack, cooperative ***\n");
+	if (run(0))
+	{
+		fprintf(stderr, "*** shared stack not available, skipped ***\n");
+		return 0;
+	}
+	fprintf(stderr, "*** TEST shared stack, preemptive ***\n");
+	run(1);
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthread.h>
+
+/*
+Stack cache test. With a cache pre-warmed with two stacks, creating two threads
+only takes cached stacks. Joining them gives the stacks back to the cache, so a
+third thread is served from the cache as well, while a cache limited to a
+single stack releases the extra one.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+int thread(void)
+{
+	return 0;
+}
+
+int main(void)
+{
+	struct uthread_config config;
+	struct uthread_stack_cache_stats stats;
+
+	fprintf(stderr, "*** TEST pre-warmed cache ***\n");
+	uthread_config_init(&config);
+	config.stack_cache_max = 2;
+	config.stack_cache_prewarm = 2;
+	uthread_start_config(&config);
+	uthread_stack_cache_stats(&stats);
+	TEST_ASSERT(stats.cached == 2);
+
+	uthread_join(uthread_create(thread), NULL);
+	uthread_join(uthread_create(thread), NULL);
+	uthread_stack_cache_stats(&stats);
+	TEST_ASSERT(stats.hits == 2 && stats.misses == 0);
+	TEST_ASSERT(stats.cached == 2);
+
+	fprintf(stderr, "*** TEST cache miss when cache is empty ***\n");
+	uthread_t one = uthread_create(thread);
+	uthread_t two = uthread_create(thread);
+	uthread_t three = uthread_create(thread);
+	uthread_stack_cache_stats(&stats);
+	TEST_ASSERT(stats.hits == 4 && stats.misses == 1);
+
+	fprintf(stderr, "*** TEST release above high-water mark ***\n");
+	uthread_join(one, NULL);
+	uthread_join(two, NULL);
+	uthread_join(three, NULL);
+	uthread_stack_cache_stats(&stats);
+	TEST_ASSERT(stats.released == 1 && stats.cached == 2);
+
+	TEST_ASSERT(uthread_stop() == 0);
+	uthread_stack_cache_stats(&stats);
+	TEST_ASSERT(stats.cached == 0);
+	return 0;
+}
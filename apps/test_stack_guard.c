@@ -0,0 +1,114 @@
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <uthread.h>
+
+/*
+Per-thread stack test. A thread created with a 1 MiB stack can recurse deep
+enough to use most of it, while a thousand of those idle threads only cost the
+few pages they touched. Stacks too small for a thread are refused. A thread overflowing its stack hits the guard page and
+dies from SIGSEGV (in a child process, so that the test itself survives).
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define BIG_STACK (1024 * 1024)
+#define NUM_IDLE 1000
+
+// Uses about 1 KiB of stack per level.
+int recurse(int depth)
+{
+	volatile char frame[1000];
+
+	frame[0] = 1;
+	if (depth == 0)
+		return 0;
+	return recurse(depth - 1) + frame[0];
+}
+
+int deep(void)
+{
+	return recurse(768);
+}
+
+int idle(void)
+{
+	return 0;
+}
+
+// Resident set size of the process, in KiB.
+long rss_kib(void)
+{
+	long pages, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f == NULL || fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		exit(1);
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(void)
+{
+	struct uthread_config config;
+	struct uthread_attr attr;
+	uthread_t tids[NUM_IDLE];
+	int retval, status, i;
+	long before;
+	pid_t pid;
+
+	fprintf(stderr, "*** TEST stacks too small are refused ***\n");
+	uthread_config_init(&config);
+	config.stack_size = 16;
+	TEST_ASSERT(uthread_start_config(&config) == -1);
+
+	uthread_start(0);
+	uthread_attr_init(&attr);
+	attr.stack_size = 16;
+	TEST_ASSERT(uthread_create_attr(idle, &attr) == -1);
+	attr.stack_size = PTHREAD_STACK_MIN - 1;
+	TEST_ASSERT(uthread_create_attr(idle, &attr) == -1);
+	attr.stack_size = PTHREAD_STACK_MIN;
+	TEST_ASSERT(uthread_join(uthread_create_attr(idle, &attr), NULL) == 0);
+	attr.stack_size = BIG_STACK;
+
+	fprintf(stderr, "*** TEST deep recursion on a large stack ***\n");
+	uthread_join(uthread_create_attr(deep, &attr), &retval);
+	TEST_ASSERT(retval == 768);
+
+	fprintf(stderr, "*** TEST large stacks are committed lazily ***\n");
+	before = rss_kib();
+	for (i = 0; i < NUM_IDLE; i++)
+		tids[i] = uthread_create_attr(idle, &attr);
+	uthread_yield();
+	// A thousand 1 MiB stacks, of which only a few pages each are touched.
+	TEST_ASSERT(rss_kib() - before < NUM_IDLE * 64);
+	for (i = 0; i < NUM_IDLE; i++)
+		uthread_join(tids[i], NULL);
+
+	fprintf(stderr, "*** TEST stack overflow hits the guard page ***\n");
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		attr.stack_size = 64 * 1024;
+		uthread_join(uthread_create_attr(deep, &attr), NULL);
+		exit(0);
+	}
+	waitpid(pid, &status, 0);
+	TEST_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+
+	TEST_ASSERT(uthread_stop() == 0);
+	return 0;
+}
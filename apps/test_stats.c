@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <uthread.h>
+
+/*
+Statistics test. Threads yield, spin through preemptions and get joined, and
+their counters and times add up to what they did, and a thread blocking its
+worker in the kernel uses little CPU time. The scheduler counts ready,
+live and zombie threads, switches, and waits in the ready queue.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define MS 1000000ull
+
+uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+struct uthread_thread_stats child_stats;
+
+int yielder(void)
+{
+	for (int i = 0; i < 5; i++)
+		uthread_yield();
+	uthread_thread_stats(uthread_self(), &child_stats);
+	return 0;
+}
+
+// Spin for a while, through preemptions.
+int spinner(void)
+{
+	uint64_t start = now_ns();
+
+	while (now_ns() - start < 30 * MS);
+	return 0;
+}
+
+int sleeper(void)
+{
+	uthread_sleep_ns(20 * MS);
+	return 0;
+}
+
+struct uthread_thread_stats blocked;
+
+// Block the worker in the kernel for a while, without switching out.
+int blocker(void)
+{
+	uint64_t start = now_ns();
+
+	while (now_ns() - start < 20 * MS)
+		usleep(1000);
+	uthread_thread_stats(uthread_self(), &blocked);
+	return 0;
+}
+
+int nothing(void)
+{
+	return 0;
+}
+
+unsigned long histogram_total(struct uthread_stats *stats)
+{
+	unsigned long total = 0;
+
+	for (int i = 0; i < UTHREAD_STATS_BUCKETS; i++)
+		total += stats->ready_latency[i];
+	return total;
+}
+
+void test_counters(void)
+{
+	struct uthread_stats stats;
+	uthread_t tids[3];
+
+	fprintf(stderr, "*** TEST counters without timing ***\n");
+	TEST_ASSERT(uthread_stats(&stats) == -1);
+	uthread_start(0);
+	uthread_join(uthread_create(yielder), NULL);
+	TEST_ASSERT(child_stats.yields == 5 && child_stats.preemptions == 0);
+	TEST_ASSERT(child_stats.cpu_ns == 0 && child_stats.ready_ns == 0);
+	TEST_ASSERT(uthread_thread_stats(42, &child_stats) == -1);
+
+	fprintf(stderr, "*** TEST ready, live and zombie threads ***\n");
+	for (int i = 0; i < 3; i++)
+		tids[i] = uthread_create(nothing);
+	TEST_ASSERT(uthread_stats(&stats) == 0);
+	TEST_ASSERT(stats.ready == 3 && stats.live == 3 && stats.zombies == 0);
+	uthread_yield();
+	TEST_ASSERT(uthread_stats(&stats) == 0);
+	TEST_ASSERT(stats.ready == 0 && stats.live == 0 && stats.zombies == 3);
+	TEST_ASSERT(uthread_thread_stats(tids[0], &child_stats) == 0);
+	for (int i = 0; i < 3; i++)
+		uthread_join(tids[i], NULL);
+	TEST_ASSERT(uthread_stats(&stats) == 0);
+	TEST_ASSERT(stats.zombies == 0 && stats.switches >= 4);
+	TEST_ASSERT(histogram_total(&stats) == 0);
+	uthread_stop();
+}
+
+void test_times(unsigned int workers)
+{
+	struct uthread_config config;
+	struct uthread_stats before, after;
+	struct uthread_thread_stats main_stats;
+	uthread_t tids[2];
+
+	fprintf(stderr, "*** TEST scheduler on %u worker(s) ***\n", workers);
+	uthread_config_init(&config);
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	config.workers = workers;
+	config.stats = 1;
+	uthread_start_config(&config);
+	uthread_stats(&before);
+
+	// Taking turns on one worker, or each on its own.
+	tids[0] = uthread_create(spinner);
+	tids[1] = uthread_create(spinner);
+	uthread_join(tids[0], NULL);
+	uthread_join(tids[1], NULL);
+	uthread_thread_stats(0, &main_stats);
+	TEST_ASSERT(main_stats.join_ns >= 30 * MS);
+	uthread_stats(&after);
+	TEST_ASSERT(after.switches >= before.switches + 2);
+	TEST_ASSERT(histogram_total(&after) >= histogram_total(&before) + 2);
+	TEST_ASSERT(after.uptime_ns >= before.uptime_ns + 30 * MS);
+	TEST_ASSERT(after.live == 0 && after.zombies == 0 && after.ready == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+}
+
+struct uthread_thread_stats spun;
+
+int spinner_stats(void)
+{
+	spinner();
+	uthread_thread_stats(uthread_self(), &spun);
+	return 0;
+}
+
+void test_spin(void)
+{
+	struct uthread_config config;
+	struct uthread_thread_stats main_stats;
+	uint64_t start;
+	uthread_t tid;
+
+	fprintf(stderr, "*** TEST running and ready time ***\n");
+	uthread_config_init(&config);
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	config.stats = 1;
+	uthread_start_config(&config);
+
+	// Main spins alongside, so that both are preempted and wait their turn.
+	start = now_ns();
+	tid = uthread_create(spinner_stats);
+	spinner();
+	uthread_join(tid, NULL);
+	// Never blocked, it was either running, at most using the CPU all along,
+	// or ready.
+	TEST_ASSERT(spun.cpu_ns + spun.ready_ns <= now_ns() - start);
+	TEST_ASSERT(spun.cpu_ns > 0 && spun.ready_ns > 0 && spun.preemptions > 0);
+	uthread_thread_stats(0, &main_stats);
+	TEST_ASSERT(main_stats.cpu_ns > 0 && main_stats.ready_ns > 0);
+	TEST_ASSERT(main_stats.preemptions > 0);
+
+	fprintf(stderr, "*** TEST join time ***\n");
+	main_stats.join_ns = 0;
+	uthread_thread_stats(0, &main_stats);
+	uint64_t joined = main_stats.join_ns;
+	uthread_join(uthread_create(sleeper), NULL);
+	uthread_thread_stats(0, &main_stats);
+	TEST_ASSERT(main_stats.join_ns - joined >= 20 * MS);
+
+	fprintf(stderr, "*** TEST time blocked in the kernel is not CPU time ***\n");
+	uthread_join(uthread_create(blocker), NULL);
+	TEST_ASSERT(blocked.cpu_ns < 10 * MS);
+	uthread_stop();
+}
+
+int main(void)
+{
+	test_counters();
+	test_spin();
+	test_times(1);
+	test_times(2);
+
+	return 0;
+}
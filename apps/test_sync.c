@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthread.h>
+
+/*
+Synchronization test. Mutexes are handed over to waiters directly, and
+running there right away or not is up to the unlocker. Mutexes, semaphores and
+condition variables then protect shared state under contention, on one worker
+and on several, with preemption.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define THREADS 8
+#define ROUNDS 500
+#define ITEMS 2000
+#define SLOTS 4
+
+uthread_mutex_t mutex;
+int got_mutex;
+
+int waiter(void)
+{
+	uthread_mutex_lock(mutex);
+	got_mutex = 1;
+	uthread_mutex_unlock(mutex, 0);
+	return 0;
+}
+
+// Unlocking hands the mutex over, with or without switching to the waiter.
+void test_handoff(void)
+{
+	uthread_t tid;
+
+	uthread_start(0);
+	mutex = uthread_mutex_create();
+
+	fprintf(stderr, "*** TEST mutex errors ***\n");
+	TEST_ASSERT(uthread_mutex_unlock(mutex, 0) == -1);
+	TEST_ASSERT(uthread_mutex_trylock(mutex) == 0);
+	TEST_ASSERT(uthread_mutex_trylock(mutex) == -1);
+	TEST_ASSERT(uthread_mutex_destroy(mutex) == -1);
+	TEST_ASSERT(uthread_mutex_unlock(mutex, 0) == 0);
+	TEST_ASSERT(uthread_mutex_lock(NULL) == -1);
+	TEST_ASSERT(uthread_sem_create(-1) == NULL);
+
+	fprintf(stderr, "*** TEST handoff without switching ***\n");
+	uthread_mutex_lock(mutex);
+	tid = uthread_create(waiter);
+	// Let it block.
+	uthread_yield();
+	got_mutex = 0;
+	uthread_mutex_unlock(mutex, 0);
+	TEST_ASSERT(got_mutex == 0);
+	// Already the waiter's, even though it hasn't run.
+	TEST_ASSERT(uthread_mutex_trylock(mutex) == -1);
+	uthread_join(tid, NULL);
+	TEST_ASSERT(got_mutex == 1);
+
+	fprintf(stderr, "*** TEST handoff switching to the waiter ***\n");
+	uthread_mutex_lock(mutex);
+	tid = uthread_create(waiter);
+	uthread_yield();
+	got_mutex = 0;
+	uthread_mutex_unlock(mutex, 1);
+	TEST_ASSERT(got_mutex == 1);
+	uthread_join(tid, NULL);
+	TEST_ASSERT(uthread_mutex_destroy(mutex) == 0);
+
+	uthread_stop();
+}
+
+int counter;
+
+// Increment the counter, yielding in the middle of the critical section.
+int incrementer(void)
+{
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		uthread_mutex_lock(mutex);
+		int value = counter;
+		uthread_yield();
+		counter = value + 1;
+		uthread_mutex_unlock(mutex, i % 2);
+	}
+	return 0;
+}
+
+uthread_sem_t empty, full;
+uthread_mutex_t buffer_lock;
+int buffer[SLOTS], head, tail;
+long produced_sum, consumed_sum;
+
+int producer(void)
+{
+	for (int i = 1; i <= ITEMS; i++)
+	{
+		uthread_sem_down(empty);
+		uthread_mutex_lock(buffer_lock);
+		buffer[tail++ % SLOTS] = i;
+		produced_sum += i;
+		uthread_mutex_unlock(buffer_lock, 0);
+		uthread_sem_up(full, i % 2);
+	}
+	return 0;
+}
+
+int consumer(void)
+{
+	for (int i = 1; i <= ITEMS; i++)
+	{
+		uthread_sem_down(full);
+		uthread_mutex_lock(buffer_lock);
+		consumed_sum += buffer[head++ % SLOTS];
+		uthread_mutex_unlock(buffer_lock, 0);
+		uthread_sem_up(empty, 0);
+	}
+	return 0;
+}
+
+uthread_cond_t changed;
+int arrived, generation;
+int passed;
+
+// Meet the other threads at a barrier, ROUNDS times.
+int barrier(void)
+{
+	for (int i = 0; i < ROUNDS / 10; i++)
+	{
+		uthread_mutex_lock(mutex);
+		int mine = generation;
+		if (++arrived == THREADS)
+		{
+			arrived = 0;
+			generation++;
+			uthread_cond_broadcast(changed);
+		}
+		while (generation == mine)
+			uthread_cond_wait(changed, mutex);
+		passed++;
+		uthread_mutex_unlock(mutex, 0);
+	}
+	return 0;
+}
+
+void run_threads(uthread_func_t func, int count)
+{
+	uthread_t tids[THREADS];
+
+	for (int i = 0; i < count; i++)
+		tids[i] = uthread_create(func);
+	for (int i = 0; i < count; i++)
+		uthread_join(tids[i], NULL);
+}
+
+// Contended mutex, semaphores and condition variable.
+void test_contention(unsigned int workers)
+{
+	struct uthread_config config;
+
+	uthread_config_init(&config);
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	config.workers = workers;
+	uthread_start_config(&config);
+	mutex = uthread_mutex_create();
+
+	fprintf(stderr, "*** TEST mutex, %u worker(s) ***\n", workers);
+	counter = 0;
+	run_threads(incrementer, THREADS);
+	TEST_ASSERT(counter == THREADS * ROUNDS);
+
+	fprintf(stderr, "*** TEST semaphores, %u worker(s) ***\n", workers);
+	empty = uthread_sem_create(SLOTS);
+	full = uthread_sem_create(0);
+	buffer_lock = uthread_mutex_create();
+	produced_sum = consumed_sum = 0;
+	head = tail = 0;
+	{
+		uthread_t tids[4];
+		tids[0] = uthread_create(producer);
+		tids[1] = uthread_create(consumer);
+		tids[2] = uthread_create(producer);
+		tids[3] = uthread_create(consumer);
+		for (int i = 0; i < 4; i++)
+			uthread_join(tids[i], NULL);
+	}
+	TEST_ASSERT(produced_sum == 2L * ITEMS * (ITEMS + 1) / 2);
+	TEST_ASSERT(consumed_sum == produced_sum);
+	TEST_ASSERT(uthread_sem_destroy(empty) == 0);
+	TEST_ASSERT(uthread_sem_destroy(full) == 0);
+	TEST_ASSERT(uthread_mutex_destroy(buffer_lock) == 0);
+
+	fprintf(stderr, "*** TEST condition variable, %u worker(s) ***\n", workers);
+	changed = uthread_cond_create();
+	arrived = generation = passed = 0;
+	run_threads(barrier, THREADS);
+	TEST_ASSERT(passed == THREADS * (ROUNDS / 10));
+	TEST_ASSERT(generation == ROUNDS / 10);
+	TEST_ASSERT(uthread_cond_destroy(changed) == 0);
+
+	TEST_ASSERT(uthread_mutex_destroy(mutex) == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+}
+
+int main(void)
+{
+	test_handoff();
+	test_contention(1);
+	test_contention(4);
+
+	return 0;
+}
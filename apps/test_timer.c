@@ -0,0 +1,310 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <uthread.h>
+
+#include <timer.h>
+
+/*
+Timer test. The wheel expires every timer it holds, none of them early nor
+twice, cancelled ones not at all, however far off they are. Then threads sleep
+in order, joins, locks and selects give up once their timeout expires, and
+don't when what they wait for comes first, also under contention on several
+preempted workers.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define TIMERS 10000
+#define MS 1000000ull
+
+uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+struct timer timers[TIMERS];
+int fired[TIMERS];
+
+// Advance a wheel by irregular steps, checking every expired timer is due.
+int wheel_run(struct timer_wheel *wheel, uint64_t start, uint64_t end, uint64_t step)
+{
+	for (uint64_t now = start; now <= end + step; now += step + now % 7)
+	{
+		if (timer_wheel_next(wheel) > now && timer_wheel_expire(wheel, now) != NULL)
+			return -1;
+		for (struct timer *t = timer_wheel_expire(wheel, now); t != NULL; t = t->next)
+		{
+			if (t->expires > now) return -1;
+			fired[t - timers]++;
+		}
+	}
+	return 0;
+}
+
+void test_wheel(void)
+{
+	struct timer_wheel wheel;
+	uint64_t start = 123456789, end = start;
+	int ok = 1;
+
+	fprintf(stderr, "*** TEST wheel ***\n");
+	timer_wheel_init(&wheel, start);
+	TEST_ASSERT(timer_wheel_next(&wheel) == UINT64_MAX);
+	TEST_ASSERT(timer_wheel_expire(&wheel, start + 1000 * MS) == NULL);
+
+	// Spread over every level, some in the past.
+	srand(1);
+	start += 1000 * MS;
+	for (int i = 0; i < TIMERS; i++)
+	{
+		uint64_t delta = (uint64_t) rand() << (rand() % 24);
+		timers[i].expires = i % 100 ? start + delta : start - delta % start;
+		if (timers[i].expires > end) end = timers[i].expires;
+		fired[i] = 0;
+		timer_wheel_add(&wheel, &timers[i]);
+	}
+	for (int i = 0; i < TIMERS; i += 3)
+		timer_wheel_del(&wheel, &timers[i]);
+	TEST_ASSERT(wheel.count == TIMERS - (TIMERS + 2) / 3);
+	TEST_ASSERT(wheel_run(&wheel, start, end, (end - start) / 100000) == 0);
+	for (int i = 0; i < TIMERS; i++)
+		if (fired[i] != (i % 3 != 0)) ok = 0;
+	TEST_ASSERT(ok && wheel.count == 0);
+
+	fprintf(stderr, "*** TEST wheel far expiry ***\n");
+	timers[0].expires = UINT64_MAX;
+	timer_wheel_add(&wheel, &timers[0]);
+	TEST_ASSERT(timer_wheel_next(&wheel) > end);
+	TEST_ASSERT(timer_wheel_expire(&wheel, end + 3600 * 1000 * MS) == NULL);
+	timer_wheel_del(&wheel, &timers[0]);
+	TEST_ASSERT(wheel.count == 0 && timer_wheel_next(&wheel) == UINT64_MAX);
+}
+
+int order[4];
+int order_next;
+
+int sleeper(void)
+{
+	int i = __atomic_fetch_add(&order_next, 1, __ATOMIC_SEQ_CST);
+
+	uthread_sleep_ns((4 - i) * 20 * MS);
+	order[__atomic_fetch_add(&order_next, 1, __ATOMIC_SEQ_CST) - 4] = i;
+	return 0;
+}
+
+int slow_child(void)
+{
+	uthread_sleep_ns(100 * MS);
+	return 42;
+}
+
+uthread_mutex_t mutex;
+uthread_sem_t sem;
+uthread_cond_t cond;
+uthread_chan_t chan;
+
+int mutex_holder(void)
+{
+	uthread_mutex_lock(mutex);
+	uthread_sleep_ns(50 * MS);
+	uthread_mutex_unlock(mutex, 0);
+	return 0;
+}
+
+int sem_poster(void)
+{
+	uthread_sleep_ns(10 * MS);
+	uthread_sem_up(sem, 0);
+	return 0;
+}
+
+int cond_signaler(void)
+{
+	uthread_sleep_ns(10 * MS);
+	uthread_mutex_lock(mutex);
+	uthread_cond_signal(cond);
+	uthread_mutex_unlock(mutex, 0);
+	return 0;
+}
+
+int chan_sender(void)
+{
+	int x = 7;
+
+	uthread_sleep_ns(10 * MS);
+	return uthread_chan_send(chan, &x);
+}
+
+void test_blocking(unsigned int workers)
+{
+	struct uthread_config config;
+	struct uthread_chan_case cases[2];
+	uthread_t tids[4], tid;
+	uint64_t start;
+	int retval, x;
+
+	fprintf(stderr, "*** TEST sleep on %u worker(s) ***\n", workers);
+	uthread_config_init(&config);
+	config.workers = workers;
+	config.preempt = workers > 1;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	uthread_start_config(&config);
+
+	start = now_ns();
+	TEST_ASSERT(uthread_sleep_ns(20 * MS) == 0);
+	TEST_ASSERT(now_ns() - start >= 20 * MS);
+	TEST_ASSERT(uthread_sleep_ns(0) == 0);
+	order_next = 0;
+	for (int i = 0; i < 4; i++)
+		tids[i] = uthread_create(sleeper);
+	for (int i = 0; i < 4; i++)
+		uthread_join(tids[i], NULL);
+	TEST_ASSERT(order[0] == 3 && order[1] == 2 && order[2] == 1 && order[3] == 0);
+
+	fprintf(stderr, "*** TEST join timeout ***\n");
+	tid = uthread_create(slow_child);
+	start = now_ns();
+	TEST_ASSERT(uthread_join_timeout(tid, &retval, 10 * MS) == 1);
+	TEST_ASSERT(now_ns() - start >= 10 * MS);
+	TEST_ASSERT(uthread_join_timeout(tid, &retval, 1000 * MS) == 0 && retval == 42);
+
+	fprintf(stderr, "*** TEST mutex timeout ***\n");
+	mutex = uthread_mutex_create();
+	tid = uthread_create(mutex_holder);
+	uthread_sleep_ns(5 * MS);
+	TEST_ASSERT(uthread_mutex_lock_timeout(mutex, 5 * MS) == 1);
+	TEST_ASSERT(uthread_mutex_lock_timeout(mutex, 1000 * MS) == 0);
+	uthread_mutex_unlock(mutex, 0);
+	uthread_join(tid, NULL);
+
+	fprintf(stderr, "*** TEST semaphore timeout ***\n");
+	sem = uthread_sem_create(0);
+	TEST_ASSERT(uthread_sem_down_timeout(sem, 5 * MS) == 1);
+	tid = uthread_create(sem_poster);
+	TEST_ASSERT(uthread_sem_down_timeout(sem, 1000 * MS) == 0);
+	uthread_join(tid, NULL);
+	TEST_ASSERT(uthread_sem_destroy(sem) == 0);
+
+	fprintf(stderr, "*** TEST condition variable timeout ***\n");
+	cond = uthread_cond_create();
+	uthread_mutex_lock(mutex);
+	TEST_ASSERT(uthread_cond_wait_timeout(cond, mutex, 5 * MS) == 1);
+	tid = uthread_create(cond_signaler);
+	TEST_ASSERT(uthread_cond_wait_timeout(cond, mutex, 1000 * MS) == 0);
+	uthread_mutex_unlock(mutex, 0);
+	uthread_join(tid, NULL);
+	TEST_ASSERT(uthread_cond_destroy(cond) == 0);
+
+	fprintf(stderr, "*** TEST select timeout ***\n");
+	chan = uthread_chan_create(sizeof(int), 0);
+	cases[0] = (struct uthread_chan_case) { chan, UTHREAD_CHAN_RECV, &x, 0 };
+	cases[1] = (struct uthread_chan_case) { chan, UTHREAD_CHAN_RECV, &x, 0 };
+	TEST_ASSERT(uthread_chan_select_timeout(cases, 1, 5 * MS) == 1);
+	TEST_ASSERT(uthread_chan_select_timeout(cases, 2, 5 * MS) == 2);
+	tid = uthread_create(chan_sender);
+	TEST_ASSERT(uthread_chan_select_timeout(cases, 1, 1000 * MS) == 0 && x == 7);
+	uthread_join(tid, &retval);
+	TEST_ASSERT(retval == 0);
+	TEST_ASSERT(uthread_chan_destroy(chan) == 0);
+
+	TEST_ASSERT(uthread_mutex_destroy(mutex) == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+}
+
+#define CONTENDERS 16
+#define ROUNDS 200
+
+int counter;
+int acquired, gave_up;
+
+// Lock with timeouts short enough to expire about as often as not.
+int contender(void)
+{
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		if (uthread_mutex_lock_timeout(mutex, (i % 5) * 20000) == 0)
+		{
+			int c = counter;
+			if (i % 3 == 0) uthread_yield();
+			counter = c + 1;
+			__atomic_add_fetch(&acquired, 1, __ATOMIC_SEQ_CST);
+			uthread_mutex_unlock(mutex, i % 2);
+		} else {
+			__atomic_add_fetch(&gave_up, 1, __ATOMIC_SEQ_CST);
+		}
+		if (uthread_sem_down_timeout(sem, (i % 4) * 10000) == 0)
+			uthread_sem_up(sem, 0);
+	}
+	return 0;
+}
+
+void test_contention(void)
+{
+	struct uthread_config config;
+	uthread_t tids[CONTENDERS];
+
+	fprintf(stderr, "*** TEST timeouts under contention ***\n");
+	uthread_config_init(&config);
+	config.workers = 4;
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	uthread_start_config(&config);
+
+	mutex = uthread_mutex_create();
+	sem = uthread_sem_create(2);
+	counter = acquired = gave_up = 0;
+	for (int i = 0; i < CONTENDERS; i++)
+		tids[i] = uthread_create(contender);
+	for (int i = 0; i < CONTENDERS; i++)
+		uthread_join(tids[i], NULL);
+	TEST_ASSERT(acquired + gave_up == CONTENDERS * ROUNDS);
+	TEST_ASSERT(counter == acquired);
+	// Nothing left behind: both are free again.
+	TEST_ASSERT(uthread_mutex_trylock(mutex) == 0);
+	uthread_mutex_unlock(mutex, 0);
+	TEST_ASSERT(uthread_sem_down_timeout(sem, 0) == 0);
+	TEST_ASSERT(uthread_sem_down_timeout(sem, 0) == 0);
+	TEST_ASSERT(uthread_sem_down_timeout(sem, 0) == 1);
+	uthread_sem_up(sem, 0);
+	uthread_sem_up(sem, 0);
+	TEST_ASSERT(uthread_sem_destroy(sem) == 0);
+	TEST_ASSERT(uthread_mutex_destroy(mutex) == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+}
+
+int main(void)
+{
+	struct timespec cpu_start, cpu_end;
+
+	test_wheel();
+
+	// Sleeping, the idle worker sleeps too rather than spinning.
+	uthread_start(0);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+	uthread_sleep_ns(200 * MS);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+	TEST_ASSERT((cpu_end.tv_sec - cpu_start.tv_sec) * 1000000000ll +
+		    cpu_end.tv_nsec - cpu_start.tv_nsec < 100 * (long long) MS);
+	uthread_stop();
+
+	test_blocking(1);
+	test_blocking(2);
+	test_contention();
+
+	return 0;
+}
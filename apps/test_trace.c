@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uthread.h>
+
+/*
+Tracing test. Threads block, get preempted, exit and yield with tracing
+enabled, and the dump shows each of those as the reason a thread stopped
+running, along with creations and wake-ups. Nothing is recorded while tracing
+is disabled, and a full buffer keeps the latest events only.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define TRACE_PATH "/tmp/test_trace.json"
+
+char dump[1 << 22];
+
+// Read the dump back, NULL if it's not well-formed as far as brackets go.
+char *read_dump(void)
+{
+	FILE *file = fopen(TRACE_PATH, "r");
+	size_t len = fread(dump, 1, sizeof(dump) - 1, file);
+	int depth = 0, string = 0;
+
+	fclose(file);
+	dump[len] = '\0';
+	for (size_t i = 0; i < len; i++)
+	{
+		if (dump[i] == '"') string = !string;
+		if (string) continue;
+		if (dump[i] == '{' || dump[i] == '[') depth++;
+		if (dump[i] == '}' || dump[i] == ']') depth--;
+		if (depth < 0) return NULL;
+	}
+	return depth == 0 && !string ? dump : NULL;
+}
+
+int count(const char *text, const char *pattern)
+{
+	int n = 0;
+
+	while ((text = strstr(text, pattern)) != NULL)
+	{
+		n++;
+		text++;
+	}
+	return n;
+}
+
+uthread_sem_t sem;
+volatile int stop;
+
+int yielder(void)
+{
+	for (int i = 0; i < 10; i++)
+		uthread_yield();
+	return 0;
+}
+
+int blocker(void)
+{
+	uthread_sem_down(sem);
+	return 0;
+}
+
+int spinner(void)
+{
+	while (!stop);
+	return 0;
+}
+
+int main(void)
+{
+	struct uthread_config config;
+	uthread_t tids[5];
+	char *text;
+
+	fprintf(stderr, "*** TEST no trace buffers ***\n");
+	uthread_start(0);
+	TEST_ASSERT(uthread_trace_enable(1) == -1);
+	TEST_ASSERT(uthread_trace_dump(TRACE_PATH) == -1);
+	uthread_stop();
+
+	fprintf(stderr, "*** TEST disabled ***\n");
+	uthread_config_init(&config);
+	config.workers = 2;
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	config.trace_events = 100000;
+	uthread_start_config(&config);
+	uthread_join(uthread_create(yielder), NULL);
+	TEST_ASSERT(uthread_trace_dump(TRACE_PATH) == 0);
+	TEST_ASSERT((text = read_dump()) != NULL);
+	TEST_ASSERT(count(text, "\"ph\":\"X\"") == 0 && count(text, "\"ph\":\"i\"") == 0);
+
+	fprintf(stderr, "*** TEST reasons ***\n");
+	TEST_ASSERT(uthread_trace_enable(1) == 0);
+	sem = uthread_sem_create(0);
+	stop = 0;
+	tids[0] = uthread_create(yielder);
+	tids[1] = uthread_create(blocker);
+	tids[2] = uthread_create(spinner);
+	tids[3] = uthread_create(spinner);
+	tids[4] = uthread_create(spinner);
+	uthread_sleep_ns(20000000);
+	stop = 1;
+	uthread_sem_up(sem, 0);
+	for (int i = 0; i < 5; i++)
+		uthread_join(tids[i], NULL);
+	TEST_ASSERT(uthread_trace_enable(0) == 0);
+	TEST_ASSERT(uthread_trace_dump(TRACE_PATH) == 0);
+	TEST_ASSERT((text = read_dump()) != NULL);
+	TEST_ASSERT(count(text, "\"name\":\"create\"") == 5);
+	TEST_ASSERT(count(text, "\"name\":\"wake\"") > 0);
+	TEST_ASSERT(count(text, "\"out\":\"block\"") > 0);
+	TEST_ASSERT(count(text, "\"out\":\"preempt\"") > 0);
+	TEST_ASSERT(count(text, "\"out\":\"exit\"") == 2 * 5);
+	TEST_ASSERT(count(text, "\"name\":\"uthread 2\"") > 0);
+	TEST_ASSERT(count(text, "\"name\":\"worker 1\"") == 1);
+	uthread_sem_destroy(sem);
+	TEST_ASSERT(uthread_stop() == 0);
+
+	fprintf(stderr, "*** TEST full buffer ***\n");
+	config.workers = 1;
+	config.preempt = 0;
+	config.trace_events = 50;
+	uthread_start_config(&config);
+	uthread_trace_enable(1);
+	for (int i = 0; i < 4; i++)
+		tids[i] = uthread_create(yielder);
+	for (int i = 0; i < 4; i++)
+		uthread_join(tids[i], NULL);
+	TEST_ASSERT(uthread_trace_dump(TRACE_PATH) == 0);
+	TEST_ASSERT((text = read_dump()) != NULL);
+	// 64 events, at most one run slice each, on both tracks.
+	TEST_ASSERT(count(text, "\"out\":\"yield\"") > 0);
+	TEST_ASSERT(count(text, "\"ph\":\"X\"") + count(text, "\"ph\":\"i\"") <= 2 * 64);
+	TEST_ASSERT(count(text, "\"name\":\"create\"") == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+	remove(TRACE_PATH);
+
+	return 0;
+}
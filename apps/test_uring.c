@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <uthread.h>
+
+/*
+io_uring test. Threads read and write a file at offsets concurrently, through
+fixed files and buffers too, and a socket from its current position, which
+blocks the reader only. Everything is run with the ring on one and several
+workers, then without it, which must behave the same.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define THREADS 32
+#define BLOCK 4096
+
+int file;
+int next_block;
+char fixed[THREADS * BLOCK];
+
+// Write a block then read it back, at an offset of its own.
+int block_rw(void)
+{
+	int i = __atomic_fetch_add(&next_block, 1, __ATOMIC_SEQ_CST);
+	char out[BLOCK], in[BLOCK];
+
+	memset(out, 'a' + i % 26, sizeof(out));
+	if (uthread_pwrite(file, out, BLOCK, (off_t) i * BLOCK) != BLOCK)
+		return -1;
+	uthread_yield();
+	if (uthread_pread(file, in, BLOCK, (off_t) i * BLOCK) != BLOCK)
+		return -1;
+	return memcmp(in, out, BLOCK) ? -1 : 0;
+}
+
+// Same, through the registered file and buffer.
+int block_rw_fixed(void)
+{
+	int i = __atomic_fetch_add(&next_block, 1, __ATOMIC_SEQ_CST);
+	char *buf = fixed + i * BLOCK;
+
+	memset(buf, 'A' + i % 26, BLOCK);
+	if (uthread_pwrite_fixed(0, buf, BLOCK, (off_t) i * BLOCK, 0) != BLOCK)
+		return -1;
+	memset(buf, 0, BLOCK);
+	uthread_yield();
+	if (uthread_pread_fixed(0, buf, BLOCK, (off_t) i * BLOCK, 0) != BLOCK)
+		return -1;
+	for (int j = 0; j < BLOCK; j++)
+		if (buf[j] != 'A' + i % 26) return -1;
+	return 0;
+}
+
+int run_all(uthread_func_t func)
+{
+	uthread_t tids[THREADS];
+	int retval, failed = 0;
+
+	next_block = 0;
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(func);
+	for (int i = 0; i < THREADS; i++)
+	{
+		uthread_join(tids[i], &retval);
+		failed |= retval;
+	}
+	return failed;
+}
+
+int fds[2];
+int step;
+
+int socket_reader(void)
+{
+	char buf[8];
+	ssize_t ret = uthread_pread(fds[0], buf, sizeof(buf), -1);
+
+	step++;
+	return ret == 5 && memcmp(buf, "hello", 5) == 0 ? 0 : -1;
+}
+
+void test_uring(unsigned int entries, unsigned int workers)
+{
+	struct uthread_config config;
+	char path[] = "/tmp/test_uring.XXXXXX";
+	struct iovec iov = { fixed, sizeof(fixed) };
+	char buf[BLOCK];
+	uthread_t tid;
+	int retval;
+
+	fprintf(stderr, "*** TEST %u ring entries on %u worker(s) ***\n",
+		entries, workers);
+	uthread_config_init(&config);
+	config.preempt = workers > 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	config.workers = workers;
+	config.io_uring_entries = entries;
+	uthread_start_config(&config);
+	TEST_ASSERT(uthread_io_uring() == (entries != 0));
+
+	file = mkstemp(path);
+	unlink(path);
+	TEST_ASSERT(run_all(block_rw) == 0);
+	// Past the end.
+	TEST_ASSERT(uthread_pread(file, buf, BLOCK, (off_t) THREADS * BLOCK) == 0);
+	TEST_ASSERT(uthread_pread(-1, buf, BLOCK, 0) == -1 && errno == EBADF);
+
+	fprintf(stderr, "*** TEST fixed files and buffers ***\n");
+	TEST_ASSERT(uthread_io_register_files(&file, 1) == 0);
+	TEST_ASSERT(uthread_io_register_buffers(&iov, 1) == 0);
+	TEST_ASSERT(run_all(block_rw_fixed) == 0);
+	TEST_ASSERT(uthread_pread_fixed(1, fixed, BLOCK, 0, 0) == -1 && errno == EBADF);
+	TEST_ASSERT(uthread_pread_fixed(0, buf, BLOCK, 0, 0) == -1 && errno == EFAULT);
+	TEST_ASSERT(uthread_pread_fixed(0, fixed, BLOCK, 0, 1) == -1 && errno == EFAULT);
+	TEST_ASSERT(uthread_io_register_buffers(NULL, 0) == 0);
+	TEST_ASSERT(uthread_io_register_files(NULL, 0) == 0);
+	close(file);
+
+	fprintf(stderr, "*** TEST socket read blocks the thread only ***\n");
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	step = 0;
+	tid = uthread_create(socket_reader);
+	uthread_yield();
+	uthread_yield();
+	TEST_ASSERT(step == 0);
+	TEST_ASSERT(uthread_pwrite(fds[1], "hello", 5, -1) == 5);
+	uthread_join(tid, &retval);
+	TEST_ASSERT(step == 1 && retval == 0);
+	uthread_close(fds[0]);
+	uthread_close(fds[1]);
+
+	TEST_ASSERT(uthread_stop() == 0);
+}
+
+int main(void)
+{
+	test_uring(64, 1);
+	test_uring(8, 2);
+	test_uring(0, 1);
+
+	return 0;
+}
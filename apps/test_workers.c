@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <uthread.h>
+
+/*
+M:N test. Threads spread over four workers yield, create and join threads of
+their own, and must all be collected with the right return value. Each of them
+also blocks its kernel thread for a bit, so that other workers get to steal
+threads even with a single CPU. With two
+workers and preemption, two spinning threads take a worker each and a third
+thread still gets to run and stop them, otherwise the test hangs.
+*/
+
+#define TEST_ASSERT(assert)				\
+do {									\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {						\
+		printf("PASS\n");				\
+	} else	{							\
+		printf("FAIL\n");				\
+		exit(1);						\
+	}									\
+} while(0)
+
+#define NUM_THREADS 200
+#define MAX_KTHREADS 64
+
+int counter;
+int kthreads[MAX_KTHREADS];
+int num_kthreads;
+volatile int flag = 1;
+
+// Remember which kernel threads ran user threads.
+void record_kthread(void)
+{
+	int tid = syscall(SYS_gettid);
+	int i;
+
+	for (i = 0; i < __atomic_load_n(&num_kthreads, __ATOMIC_ACQUIRE); i++)
+	{
+		if (kthreads[i] == tid)
+			return;
+	}
+	i = __atomic_fetch_add(&num_kthreads, 1, __ATOMIC_ACQ_REL);
+	if (i < MAX_KTHREADS)
+		kthreads[i] = tid;
+}
+
+int grandchild(void)
+{
+	__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+	return 7;
+}
+
+int child(void)
+{
+	int retval, i;
+	uthread_t tid;
+
+	usleep(100);
+	for (i = 0; i < 10; i++)
+	{
+		record_kthread();
+		__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+		uthread_yield();
+	}
+	tid = uthread_create(grandchild);
+	if (uthread_join(tid, &retval) || retval != 7)
+		return -1;
+	return uthread_self();
+}
+
+int spinner(void)
+{
+	while (flag);
+	return 0;
+}
+
+int stopper(void)
+{
+	flag = 0;
+	return 0;
+}
+
+int main(void)
+{
+	struct uthread_config config;
+	uthread_t tids[NUM_THREADS], spin1, spin2, stop;
+	int i, retval, ok = 1;
+
+	uthread_config_init(&config);
+
+	fprintf(stderr, "*** TEST invalid configurations ***\n");
+	config.workers = 0;
+	TEST_ASSERT(uthread_start_config(&config) == -1);
+	config.workers = 2;
+	config.shared_stack_size = 65536;
+	TEST_ASSERT(uthread_start_config(&config) == -1);
+
+	fprintf(stderr, "*** TEST four workers ***\n");
+	config.workers = 4;
+	config.shared_stack_size = 0;
+	TEST_ASSERT(uthread_start_config(&config) == 0);
+	for (i = 0; i < NUM_THREADS; i++)
+		tids[i] = uthread_create(child);
+	for (i = 0; i < NUM_THREADS; i++)
+	{
+		if (uthread_join(tids[i], &retval) || retval != tids[i])
+			ok = 0;
+	}
+	TEST_ASSERT(ok);
+	TEST_ASSERT(counter == NUM_THREADS * 11);
+	TEST_ASSERT(uthread_self() == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+	TEST_ASSERT(num_kthreads > 1);
+
+	fprintf(stderr, "*** TEST preemption with two workers ***\n");
+	config.workers = 2;
+	config.preempt = 1;
+	config.quantum_us = 1000;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	TEST_ASSERT(uthread_start_config(&config) == 0);
+	spin1 = uthread_create(spinner);
+	spin2 = uthread_create(spinner);
+	stop = uthread_create(stopper);
+	uthread_join(spin1, NULL);
+	uthread_join(spin2, NULL);
+	uthread_join(stop, NULL);
+	TEST_ASSERT(flag == 0);
+	TEST_ASSERT(uthread_stop() == 0);
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+int bench_reps;
+
+static int bench_json;
+static int bench_header = 1;
+
+void bench_init(int argc, char **argv, int reps)
+{
+	int opt;
+
+	bench_reps = reps;
+	while ((opt = getopt(argc, argv, "f:nr:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			if (strcmp(optarg, "json") == 0)
+				bench_json = 1;
+			else if (strcmp(optarg, "csv") != 0)
+				goto usage;
+			break;
+		case 'n':
+			bench_header = 0;
+			break;
+		case 'r':
+			bench_reps = atoi(optarg);
+			if (bench_reps <= 0)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	return;
+
+usage:
+	fprintf(stderr, "Usage: %s [-f csv|json] [-n] [-r reps]\n", argv[0]);
+	exit(1);
+}
+
+double bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void bench_pin(void)
+{
+	cpu_set_t set;
+	int cpu = sched_getcpu();
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu < 0 ? 0 : cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		perror("sched_setaffinity");
+}
+
+void bench_add(struct bench_samples *samples, double value)
+{
+	if (samples->count == samples->capacity)
+	{
+		samples->capacity = samples->capacity ? 2 * samples->capacity : 64;
+		samples->values = realloc(samples->values,
+					  samples->capacity * sizeof(double));
+		if (samples->values == NULL)
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+	samples->values[samples->count++] = value;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+static double bench_percentile(struct bench_samples *samples, double p)
+{
+	size_t rank = (size_t) (p / 100 * samples->count + 0.5);
+
+	if (rank < 1) rank = 1;
+	if (rank > samples->count) rank = samples->count;
+	return samples->values[rank - 1];
+}
+
+void bench_report(const char *benchmark, const char *impl, const char *param,
+		  const char *unit, struct bench_samples *samples)
+{
+	double sum = 0, p50, p90, p99;
+
+	if (samples->count == 0)
+		return;
+	qsort(samples->values, samples->count, sizeof(double), bench_compare);
+	for (size_t i = 0; i < samples->count; i++)
+		sum += samples->values[i];
+	p50 = bench_percentile(samples, 50);
+	p90 = bench_percentile(samples, 90);
+	p99 = bench_percentile(samples, 99);
+
+	if (bench_json)
+	{
+		printf("{\"benchmark\":\"%s\",\"impl\":\"%s\",\"param\":\"%s\","
+		       "\"samples\":%zu,\"unit\":\"%s\",\"mean\":%.3f,\"min\":%.3f,"
+		       "\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}\n",
+		       benchmark, impl, param, samples->count, unit,
+		       sum / samples->count, samples->values[0], p50, p90, p99,
+		       samples->values[samples->count - 1]);
+	} else {
+		if (bench_header)
+			printf("benchmark,impl,param,samples,unit,mean,min,p50,p90,p99,max\n");
+		printf("%s,%s,%s,%zu,%s,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+		       benchmark, impl, param, samples->count, unit,
+		       sum / samples->count, samples->values[0], p50, p90, p99,
+		       samples->values[samples->count - 1]);
+	}
+	bench_header = 0;
+	fflush(stdout);
+	samples->count = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stddef.h>
+
+/*
+ * Benchmark harness
+ *
+ * A benchmark takes samples of a measure, repeating it, then reports their
+ * distribution as one result row: the benchmark's name, the implementation
+ * measured (uthread, or the pthread baseline), the parameter it was measured
+ * at, the unit, and the mean, minimum, percentiles and maximum of the samples.
+ *
+ * Rows are printed on stdout as CSV, with a header, or as JSON objects, one
+ * per line, so that the output of several benchmarks can be concatenated.
+ * Every benchmark takes the same options:
+ *	-f csv|json	Output format (csv by default)
+ *	-n		No CSV header
+ *	-r reps		Number of samples per result (default set by the benchmark)
+ */
+
+/*
+ * struct bench_samples - Samples of a measure
+ */
+struct bench_samples {
+	double *values;
+	size_t count;
+	size_t capacity;
+};
+
+/* Number of samples to take per result, from -r */
+extern int bench_reps;
+
+/*
+ * bench_init - Parse the command line
+ * @argc: Argument count of main()
+ * @argv: Arguments of main()
+ * @reps: Default number of samples per result
+ *
+ * Exits with a usage message on an invalid option.
+ */
+void bench_init(int argc, char **argv, int reps);
+
+/*
+ * bench_now_ns - Read the monotonic clock
+ *
+ * Return: Current time (in nanoseconds)
+ */
+double bench_now_ns(void);
+
+/*
+ * bench_pin - Run the calling process on a single CPU
+ *
+ * For the pthread baselines of benchmarks measuring a single worker, so that
+ * kernel threads take turns as user threads do rather than run in parallel.
+ */
+void bench_pin(void);
+
+/*
+ * bench_add - Add a sample
+ * @samples: Samples to add to, zero-initialized the first time
+ * @value: Value of the sample
+ */
+void bench_add(struct bench_samples *samples, double value);
+
+/*
+ * bench_report - Print the result row of samples and clear them
+ * @benchmark: Name of the benchmark
+ * @impl: Implementation measured
+ * @param: Parameter the samples were taken at
+ * @unit: Unit of the samples
+ * @samples: Samples, cleared afterwards
+ */
+void bench_report(const char *benchmark, const char *impl, const char *param,
+		  const char *unit, struct bench_samples *samples);
+
+#endif /* _BENCH_H */
@@ -0,0 +1,112 @@
+/*
+ * Create and join benchmark
+ *
+ * Creates N threads that return right away, then joins them all, for N of 1,
+ * 1000 and 60000 threads alive at once. Each sample is the mean time per
+ * thread of one such round (repeated to take at least a thousand threads for
+ * small N). Kernel threads get the same small stack as user threads; if the
+ * system won't run that many of them, the row is left out.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthread.h>
+
+#include "bench.h"
+
+#define STACK_SIZE 16384
+#define MIN_THREADS 1000
+
+static const int counts[] = { 1, 1000, 60000 };
+
+static int uthread_func(void)
+{
+	return 0;
+}
+
+static void *pthread_func(void *arg)
+{
+	return arg;
+}
+
+static void bench_uthread(int n)
+{
+	struct uthread_config config;
+	struct bench_samples samples = { 0 };
+	uthread_t *tids = malloc(n * sizeof(uthread_t));
+	int rounds = n < MIN_THREADS ? MIN_THREADS / n : 1;
+	char param[32];
+
+	// Tens of thousands of guard pages would exceed the mapping limit.
+	uthread_config_init(&config);
+	config.stack_size = STACK_SIZE;
+	config.stack_guard = 0;
+	for (int r = 0; r < bench_reps; r++)
+	{
+		// TIDs aren't reused, start afresh for every sample.
+		uthread_start_config(&config);
+		double start = bench_now_ns();
+		for (int k = 0; k < rounds; k++)
+		{
+			for (int i = 0; i < n; i++)
+				tids[i] = uthread_create(uthread_func);
+			for (int i = 0; i < n; i++)
+				uthread_join(tids[i], NULL);
+		}
+		bench_add(&samples, (bench_now_ns() - start) / ((double) n * rounds));
+		uthread_stop();
+	}
+	free(tids);
+	snprintf(param, sizeof(param), "threads=%d", n);
+	bench_report("create_join", "uthread", param, "ns/thread", &samples);
+}
+
+static void bench_pthread(int n)
+{
+	struct bench_samples samples = { 0 };
+	pthread_t *threads = malloc(n * sizeof(pthread_t));
+	int rounds = n < MIN_THREADS ? MIN_THREADS / n : 1;
+	pthread_attr_t attr;
+	char param[32];
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+	for (int r = 0; r < bench_reps; r++)
+	{
+		double start = bench_now_ns();
+		for (int k = 0; k < rounds; k++)
+		{
+			int created = 0;
+			while (created < n &&
+			       pthread_create(&threads[created], &attr, pthread_func, NULL) == 0)
+				created++;
+			for (int i = 0; i < created; i++)
+				pthread_join(threads[i], NULL);
+			if (created < n)
+			{
+				fprintf(stderr, "create_join: only %d pthreads could be created\n",
+					created);
+				goto out;
+			}
+		}
+		bench_add(&samples, (bench_now_ns() - start) / ((double) n * rounds));
+	}
+	snprintf(param, sizeof(param), "threads=%d", n);
+	bench_report("create_join", "pthread", param, "ns/thread", &samples);
+out:
+	pthread_attr_destroy(&attr);
+	free(threads);
+	free(samples.values);
+}
+
+int main(int argc, char **argv)
+{
+	bench_init(argc, argv, 10);
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+	{
+		bench_uthread(counts[i]);
+		bench_pthread(counts[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Preemption overhead benchmark
+ *
+ * Threads share a fixed amount of CPU-bound work on one worker, run to
+ * completion without preemption as the baseline, then preempted at several
+ * time slices, then as kernel threads on one CPU, which the kernel preempts.
+ * Each sample is the time a run takes, and its overhead relative to the mean
+ * of the baseline.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthread.h>
+
+#include "bench.h"
+
+#define THREADS 4
+#define WORK 20000000
+
+static const long quanta_us[] = { 100, 1000, 10000 };
+
+static double baseline_ms;
+
+static void work(void)
+{
+	volatile unsigned long counter = 0;
+
+	for (long i = 0; i < WORK / THREADS; i++)
+		counter += i;
+}
+
+static int uthread_func(void)
+{
+	work();
+	return 0;
+}
+
+static void *pthread_func(void *arg)
+{
+	work();
+	return arg;
+}
+
+static void report(const char *impl, const char *param, struct bench_samples *times)
+{
+	struct bench_samples overheads = { 0 };
+
+	for (size_t i = 0; i < times->count; i++)
+		bench_add(&overheads, (times->values[i] / baseline_ms - 1) * 100);
+	bench_report("preempt", impl, param, "ms", times);
+	bench_report("preempt_overhead", impl, param, "%", &overheads);
+	free(overheads.values);
+}
+
+static void bench_uthread(long quantum_us)
+{
+	struct uthread_config config;
+	struct bench_samples times = { 0 };
+	uthread_t tids[THREADS];
+	char param[32];
+	double sum = 0;
+
+	uthread_config_init(&config);
+	config.preempt = quantum_us != 0;
+	config.quantum_us = quantum_us;
+	config.preempt_clock = UTHREAD_CLOCK_WALL;
+	for (int r = 0; r < bench_reps; r++)
+	{
+		uthread_start_config(&config);
+		double start = bench_now_ns();
+		for (int i = 0; i < THREADS; i++)
+			tids[i] = uthread_create(uthread_func);
+		for (int i = 0; i < THREADS; i++)
+			uthread_join(tids[i], NULL);
+		double elapsed = bench_now_ns() - start;
+		uthread_stop();
+		bench_add(&times, elapsed / 1e6);
+		sum += elapsed;
+	}
+	if (quantum_us == 0)
+	{
+		baseline_ms = sum / bench_reps / 1e6;
+		snprintf(param, sizeof(param), "quantum_us=none");
+	} else {
+		snprintf(param, sizeof(param), "quantum_us=%ld", quantum_us);
+	}
+	report("uthread", param, &times);
+}
+
+static void bench_pthread(void)
+{
+	struct bench_samples times = { 0 };
+	pthread_t threads[THREADS];
+
+	for (int r = 0; r < bench_reps; r++)
+	{
+		double start = bench_now_ns();
+		for (int i = 0; i < THREADS; i++)
+			pthread_create(&threads[i], NULL, pthread_func, NULL);
+		for (int i = 0; i < THREADS; i++)
+			pthread_join(threads[i], NULL);
+		bench_add(&times, (bench_now_ns() - start) / 1e6);
+	}
+	report("pthread", "quantum_us=kernel", &times);
+}
+
+int main(int argc, char **argv)
+{
+	bench_init(argc, argv, 10);
+	bench_pin();
+	bench_uthread(0);
+	for (size_t i = 0; i < sizeof(quanta_us) / sizeof(quanta_us[0]); i++)
+		bench_uthread(quanta_us[i]);
+	bench_pthread();
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Queue operations benchmark
+ *
+ * Measures queue_enqueue() and queue_dequeue() filling and draining a queue of
+ * a given length, and queue_delete() and queue_delete_handle() deleting items
+ * at random positions from a queue of that length. Each sample is the mean
+ * time per operation over one round.
+ *
+ * The pthread baseline performs the same operations, each under a pthread
+ * mutex, as kernel threads sharing a queue would have to.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <queue.h>
+
+#include "bench.h"
+
+// Number of items deleted per round, at most.
+#define DELETES 256
+
+static const int lengths[] = { 16, 1024, 65536 };
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int locking;
+
+static void lock(void)
+{
+	if (locking) pthread_mutex_lock(&mutex);
+}
+
+static void unlock(void)
+{
+	if (locking) pthread_mutex_unlock(&mutex);
+}
+
+static void *item(int i)
+{
+	return (void *) (uintptr_t) (i + 1);
+}
+
+static void bench_fill_drain(int length, const char *impl, const char *param)
+{
+	struct bench_samples enqueues = { 0 }, dequeues = { 0 };
+	queue_t queue = queue_create();
+	void *data;
+
+	for (int r = 0; r < bench_reps; r++)
+	{
+		double start = bench_now_ns();
+		for (int i = 0; i < length; i++)
+		{
+			lock();
+			queue_enqueue(queue, item(i));
+			unlock();
+		}
+		double middle = bench_now_ns();
+		for (int i = 0; i < length; i++)
+		{
+			lock();
+			queue_dequeue(queue, &data);
+			unlock();
+		}
+		double end = bench_now_ns();
+		bench_add(&enqueues, (middle - start) / length);
+		bench_add(&dequeues, (end - middle) / length);
+	}
+	queue_destroy(queue);
+	bench_report("queue_enqueue", impl, param, "ns/op", &enqueues);
+	bench_report("queue_dequeue", impl, param, "ns/op", &dequeues);
+}
+
+static void bench_delete(int length, const char *impl, const char *param)
+{
+	struct bench_samples deletes = { 0 }, handle_deletes = { 0 };
+	queue_handle_t *handles = malloc(length * sizeof(queue_handle_t));
+	int *victims = malloc(DELETES * sizeof(int));
+	char *picked = malloc(length);
+	int count = length < DELETES ? length : DELETES;
+	queue_t queue = queue_create();
+	void *data;
+
+	srand(1);
+	for (int r = 0; r < bench_reps; r++)
+	{
+		// Distinct random items.
+		memset(picked, 0, length);
+		for (int i = 0; i < count; i++)
+		{
+			int j;
+			do j = rand() % length; while (picked[j]);
+			picked[j] = 1;
+			victims[i] = j;
+		}
+
+		for (int i = 0; i < length; i++)
+			queue_enqueue(queue, item(i));
+		double start = bench_now_ns();
+		for (int i = 0; i < count; i++)
+		{
+			lock();
+			queue_delete(queue, item(victims[i]));
+			unlock();
+		}
+		bench_add(&deletes, (bench_now_ns() - start) / count);
+		while (queue_dequeue(queue, &data) == 0);
+
+		for (int i = 0; i < length; i++)
+			queue_enqueue_handle(queue, item(i), &handles[i]);
+		start = bench_now_ns();
+		for (int i = 0; i < count; i++)
+		{
+			lock();
+			queue_delete_handle(queue, handles[victims[i]]);
+			unlock();
+		}
+		bench_add(&handle_deletes, (bench_now_ns() - start) / count);
+		while (queue_dequeue(queue, &data) == 0);
+	}
+	queue_destroy(queue);
+	free(picked);
+	free(victims);
+	free(handles);
+	bench_report("queue_delete", impl, param, "ns/op", &deletes);
+	bench_report("queue_delete_handle", impl, param, "ns/op", &handle_deletes);
+}
+
+int main(int argc, char **argv)
+{
+	char param[32];
+
+	bench_init(argc, argv, 100);
+	for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+	{
+		snprintf(param, sizeof(param), "length=%d", lengths[i]);
+		for (locking = 0; locking < 2; locking++)
+		{
+			const char *impl = locking ? "pthread_mutex" : "uthread";
+			bench_fill_drain(lengths[i], impl, param);
+			bench_delete(lengths[i], impl, param);
+		}
+	}
+	return 0;
+}
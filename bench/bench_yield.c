@@ -0,0 +1,119 @@
+/*
+ * Yield ping-pong benchmark
+ *
+ * Two threads hand the CPU back and forth: user threads by yielding, kernel
+ * threads by yielding on a single CPU, or by waking each other through a pair
+ * of semaphores, which is how kernel threads usually hand work over. Each
+ * sample is the mean time of a round trip over a batch of them.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <uthread.h>
+
+#include "bench.h"
+
+#define BATCH 10000
+
+static volatile int stop;
+
+static int uthread_partner(void)
+{
+	while (!stop)
+		uthread_yield();
+	return 0;
+}
+
+static void bench_uthread(void)
+{
+	struct bench_samples samples = { 0 };
+	uthread_t tid;
+
+	uthread_start(0);
+	stop = 0;
+	tid = uthread_create(uthread_partner);
+	for (int r = 0; r < bench_reps; r++)
+	{
+		double start = bench_now_ns();
+		for (int i = 0; i < BATCH; i++)
+			uthread_yield();
+		bench_add(&samples, (bench_now_ns() - start) / BATCH);
+	}
+	stop = 1;
+	uthread_join(tid, NULL);
+	uthread_stop();
+	bench_report("yield_pingpong", "uthread", "yield", "ns", &samples);
+}
+
+static void *pthread_yield_partner(void *arg)
+{
+	(void) arg;
+	while (!stop)
+		sched_yield();
+	return NULL;
+}
+
+static sem_t ping, pong;
+
+static void *pthread_sem_partner(void *arg)
+{
+	(void) arg;
+	for (;;)
+	{
+		sem_wait(&ping);
+		if (stop) break;
+		sem_post(&pong);
+	}
+	return NULL;
+}
+
+static void bench_pthread(void)
+{
+	struct bench_samples samples = { 0 };
+	pthread_t thread;
+
+	stop = 0;
+	pthread_create(&thread, NULL, pthread_yield_partner, NULL);
+	for (int r = 0; r < bench_reps; r++)
+	{
+		double start = bench_now_ns();
+		for (int i = 0; i < BATCH; i++)
+			sched_yield();
+		bench_add(&samples, (bench_now_ns() - start) / BATCH);
+	}
+	stop = 1;
+	pthread_join(thread, NULL);
+	bench_report("yield_pingpong", "pthread", "sched_yield", "ns", &samples);
+
+	stop = 0;
+	sem_init(&ping, 0, 0);
+	sem_init(&pong, 0, 0);
+	pthread_create(&thread, NULL, pthread_sem_partner, NULL);
+	for (int r = 0; r < bench_reps; r++)
+	{
+		double start = bench_now_ns();
+		for (int i = 0; i < BATCH; i++)
+		{
+			sem_post(&ping);
+			sem_wait(&pong);
+		}
+		bench_add(&samples, (bench_now_ns() - start) / BATCH);
+	}
+	stop = 1;
+	sem_post(&ping);
+	pthread_join(thread, NULL);
+	sem_destroy(&ping);
+	sem_destroy(&pong);
+	bench_report("yield_pingpong", "pthread", "semaphore", "ns", &samples);
+}
+
+int main(int argc, char **argv)
+{
+	bench_init(argc, argv, 50);
+	bench_pin();
+	bench_uthread();
+	bench_pthread();
+	return 0;
+}
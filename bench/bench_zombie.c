@@ -0,0 +1,114 @@
+/*
+ * Zombie join benchmark
+ *
+ * Creates N threads and lets them all exit before joining any, so that the
+ * joins find deep piles of zombies, then joins them oldest first and newest
+ * first. Each sample is the mean time per join of one round. With a join whose
+ * cost doesn't depend on the number of zombies, it stays flat as N grows.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthread.h>
+
+#include "bench.h"
+
+#define STACK_SIZE 16384
+
+static const int counts[] = { 1000, 10000, 60000 };
+
+static int exited;
+
+static int uthread_func(void)
+{
+	return 0;
+}
+
+static void *pthread_func(void *arg)
+{
+	__atomic_add_fetch(&exited, 1, __ATOMIC_RELEASE);
+	return arg;
+}
+
+static void bench_uthread(int n, int newest_first)
+{
+	struct uthread_config config;
+	struct bench_samples samples = { 0 };
+	uthread_t *tids = malloc(n * sizeof(uthread_t));
+	char param[48];
+
+	uthread_config_init(&config);
+	config.stack_size = STACK_SIZE;
+	config.stack_guard = 0;
+	for (int r = 0; r < bench_reps; r++)
+	{
+		uthread_start_config(&config);
+		for (int i = 0; i < n; i++)
+			tids[i] = uthread_create(uthread_func);
+		// Everyone runs and exits.
+		uthread_yield();
+		double start = bench_now_ns();
+		for (int i = 0; i < n; i++)
+			uthread_join(tids[newest_first ? n - 1 - i : i], NULL);
+		bench_add(&samples, (bench_now_ns() - start) / n);
+		uthread_stop();
+	}
+	free(tids);
+	snprintf(param, sizeof(param), "zombies=%d,%s", n, newest_first ? "newest" : "oldest");
+	bench_report("zombie_join", "uthread", param, "ns/join", &samples);
+}
+
+static void bench_pthread(int n, int newest_first)
+{
+	struct bench_samples samples = { 0 };
+	pthread_t *threads = malloc(n * sizeof(pthread_t));
+	pthread_attr_t attr;
+	char param[48];
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+	for (int r = 0; r < bench_reps; r++)
+	{
+		int created = 0;
+		exited = 0;
+		while (created < n &&
+		       pthread_create(&threads[created], &attr, pthread_func, NULL) == 0)
+			created++;
+		if (created < n)
+		{
+			for (int i = 0; i < created; i++)
+				pthread_join(threads[i], NULL);
+			fprintf(stderr, "zombie_join: only %d pthreads could be created\n",
+				created);
+			goto out;
+		}
+		while (__atomic_load_n(&exited, __ATOMIC_ACQUIRE) < n)
+			sched_yield();
+		double start = bench_now_ns();
+		for (int i = 0; i < n; i++)
+			pthread_join(threads[newest_first ? n - 1 - i : i], NULL);
+		bench_add(&samples, (bench_now_ns() - start) / n);
+	}
+	snprintf(param, sizeof(param), "zombies=%d,%s", n, newest_first ? "newest" : "oldest");
+	bench_report("zombie_join", "pthread", param, "ns/join", &samples);
+out:
+	pthread_attr_destroy(&attr);
+	free(threads);
+	free(samples.values);
+}
+
+int main(int argc, char **argv)
+{
+	bench_init(argc, argv, 10);
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+	{
+		for (int newest_first = 0; newest_first < 2; newest_first++)
+		{
+			bench_uthread(counts[i], newest_first);
+			bench_pthread(counts[i], newest_first);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,438 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "private.h"
+#include "queue.h"
+#include "uthread.h"
+
+// Channel, protected by lock.
+struct uthread_chan
+{
+	int lock;
+	int closed;
+	size_t elem_size;
+	// Circular buffer of values sent and not received yet.
+	char *buffer;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	// Threads blocked sending and receiving, as struct chan_waiter.
+	struct iqueue senders;
+	struct iqueue receivers;
+};
+
+// Blocked select, shared by its waiters in the queues of the channels.
+// The first thread to proceed with one of its operations claims it by setting
+// fired, the others then leave it alone. Its timeout claims it by setting
+// fired to the number of operations.
+struct chan_select
+{
+	// Held from before the channels are unlocked until switched out.
+	int lock;
+	int fired;
+	int closed;
+	int count;
+	struct queue_node *thread;
+};
+
+// Operation of a blocked select, queued in its channel.
+struct chan_waiter
+{
+	struct queue_node link;
+	struct chan_select *select;
+	void *elem;
+	int index;
+};
+
+// Allocate a blocked select with its waiters, for threads on the shared stack,
+// whose stack other threads can't reach while they're switched out. The values
+// of the operations, sent or received, are kept after the waiters.
+static struct chan_select *chan_select_alloc(struct uthread_chan_case *cases, int count)
+{
+	size_t size = sizeof(struct chan_select) + count * sizeof(struct chan_waiter);
+	struct chan_select *select;
+	struct chan_waiter *waiters;
+	char *values;
+
+	for (int i = 0; i < count; i++)
+		size += cases[i].chan->elem_size;
+	select = malloc(size);
+	if (select == NULL) return NULL;
+
+	waiters = (struct chan_waiter *) (select + 1);
+	values = (char *) (waiters + count);
+	for (int i = 0; i < count; i++)
+	{
+		waiters[i].elem = values;
+		if (cases[i].op == UTHREAD_CHAN_SEND && cases[i].elem != NULL)
+			memcpy(values, cases[i].elem, cases[i].chan->elem_size);
+		values += cases[i].chan->elem_size;
+	}
+	return select;
+}
+
+// Outcome of trying an operation.
+enum
+{
+	CHAN_WOULD_BLOCK,
+	CHAN_DONE,
+	CHAN_CLOSED,
+};
+
+uthread_chan_t uthread_chan_create(size_t elem_size, size_t capacity)
+{
+	uthread_chan_t chan = malloc(sizeof(struct uthread_chan));
+	if (chan == NULL) return NULL;
+
+	chan->buffer = NULL;
+	if (capacity && elem_size)
+	{
+		if (capacity > SIZE_MAX / elem_size) goto fail;
+		chan->buffer = malloc(capacity * elem_size);
+		if (chan->buffer == NULL) goto fail;
+	}
+	chan->lock = 0;
+	chan->closed = 0;
+	chan->elem_size = elem_size;
+	chan->capacity = capacity;
+	chan->head = 0;
+	chan->count = 0;
+	iqueue_init(&chan->senders);
+	iqueue_init(&chan->receivers);
+	return chan;
+
+fail:
+	free(chan);
+	return NULL;
+}
+
+int uthread_chan_destroy(uthread_chan_t chan)
+{
+	if (chan == NULL || iqueue_length(&chan->senders) ||
+	    iqueue_length(&chan->receivers))
+		return -1;
+	free(chan->buffer);
+	free(chan);
+	return 0;
+}
+
+static void chan_copy(uthread_chan_t chan, void *dst, const void *src)
+{
+	if (dst != NULL && chan->elem_size)
+		memcpy(dst, src, chan->elem_size);
+}
+
+static void *chan_slot(uthread_chan_t chan, size_t i)
+{
+	return chan->buffer + (i % chan->capacity) * chan->elem_size;
+}
+
+// Take the oldest waiter of a queue whose select nobody claimed yet, and claim
+// it. NULL if none.
+static struct chan_waiter *chan_claim(struct iqueue *queue)
+{
+	struct queue_node *node;
+
+	while (iqueue_dequeue(queue, &node) == 0)
+	{
+		struct chan_waiter *waiter = queue_entry(node, struct chan_waiter, link);
+		int waiting = -1;
+		if (__atomic_compare_exchange_n(&waiter->select->fired, &waiting,
+						waiter->index, 0, __ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			return waiter;
+		// Proceeding on another channel, it dequeues itself from the others.
+	}
+	return NULL;
+}
+
+// Make the thread of a claimed waiter ready, or run it if @yield.
+// Called without the channel lock. The waiter's memory belongs to its thread
+// again as soon as it's woken.
+static void chan_wake(struct chan_waiter *waiter, int yield)
+{
+	struct chan_select *select = waiter->select;
+	struct queue_node *thread = select->thread;
+
+	// Wait for it to be switched out.
+	spin_lock(&select->lock);
+	spin_unlock(&select->lock);
+	uthread_wake(thread, yield);
+}
+
+// Send, if possible without waiting. The locked channel's waiter to wake is
+// returned in @wake.
+static int chan_try_send(uthread_chan_t chan, const void *elem,
+			 struct chan_waiter **wake)
+{
+	if (chan->closed)
+		return CHAN_CLOSED;
+	// A receiver is waiting, so the buffer is empty: hand it the value.
+	*wake = chan_claim(&chan->receivers);
+	if (*wake != NULL)
+	{
+		chan_copy(chan, (*wake)->elem, elem);
+		return CHAN_DONE;
+	}
+	if (chan->count < chan->capacity)
+	{
+		chan_copy(chan, chan_slot(chan, chan->head + chan->count), elem);
+		chan->count++;
+		return CHAN_DONE;
+	}
+	return CHAN_WOULD_BLOCK;
+}
+
+// Receive, if possible without waiting. The locked channel's waiter to wake is
+// returned in @wake.
+static int chan_try_recv(uthread_chan_t chan, void *elem, struct chan_waiter **wake)
+{
+	*wake = chan_claim(&chan->senders);
+	if (chan->count)
+	{
+		chan_copy(chan, elem, chan_slot(chan, chan->head));
+		chan->head = (chan->head + 1) % chan->capacity;
+		chan->count--;
+		// A sender is waiting, so the buffer was full: its value takes the
+		// slot just freed.
+		if (*wake != NULL)
+		{
+			chan_copy(chan, chan_slot(chan, chan->head + chan->count),
+				  (*wake)->elem);
+			chan->count++;
+		}
+		return CHAN_DONE;
+	}
+	if (*wake != NULL)
+	{
+		// Unbuffered, take the value straight from the sender.
+		chan_copy(chan, elem, (*wake)->elem);
+		return CHAN_DONE;
+	}
+	return chan->closed ? CHAN_CLOSED : CHAN_WOULD_BLOCK;
+}
+
+int uthread_chan_close(uthread_chan_t chan)
+{
+	struct chan_waiter *waiter;
+	struct queue_node *node;
+	struct iqueue woken;
+
+	if (chan == NULL) return -1;
+	preempt_disable();
+	spin_lock(&chan->lock);
+	if (chan->closed)
+	{
+		spin_unlock(&chan->lock);
+		preempt_enable();
+		return -1;
+	}
+	chan->closed = 1;
+	// Every waiter fails, wake them once the channel is unlocked.
+	iqueue_init(&woken);
+	while ((waiter = chan_claim(&chan->senders)) != NULL ||
+	       (waiter = chan_claim(&chan->receivers)) != NULL)
+	{
+		waiter->select->closed = 1;
+		iqueue_enqueue(&woken, &waiter->link);
+	}
+	spin_unlock(&chan->lock);
+	while (iqueue_dequeue(&woken, &node) == 0)
+		chan_wake(queue_entry(node, struct chan_waiter, link), 0);
+	preempt_enable();
+	return 0;
+}
+
+// Lock the channels of a select in address order, each once, so that
+// concurrent selects can't deadlock. @chans receives them as locked.
+static int chan_lock_all(struct uthread_chan_case *cases, int count,
+			 uthread_chan_t *chans)
+{
+	int locked = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		int j = locked;
+		while (j > 0 && chans[j - 1] > cases[i].chan)
+		{
+			chans[j] = chans[j - 1];
+			j--;
+		}
+		if (j > 0 && chans[j - 1] == cases[i].chan)
+		{
+			// Already there, undo the shift.
+			memmove(&chans[j], &chans[j + 1], (locked - j) * sizeof(uthread_chan_t));
+			continue;
+		}
+		chans[j] = cases[i].chan;
+		locked++;
+	}
+	for (int i = 0; i < locked; i++)
+		spin_lock(&chans[i]->lock);
+	return locked;
+}
+
+static void chan_unlock_all(uthread_chan_t *chans, int locked)
+{
+	for (int i = locked - 1; i >= 0; i--)
+		spin_unlock(&chans[i]->lock);
+}
+
+// A blocked select's timeout, unless one of its operations was performed.
+static int chan_expired(struct queue_node *thread, void *arg)
+{
+	struct chan_select *select = arg;
+	int waiting = -1;
+
+	if (!__atomic_compare_exchange_n(&select->fired, &waiting, select->count, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return 0;
+	spin_lock(&select->lock);
+	spin_unlock(&select->lock);
+	uthread_wake(thread, 0);
+	return 1;
+}
+
+// Select, blocking if @block, and giving up after @timeout_ns if @timed too.
+static int chan_select(struct uthread_chan_case *cases, int count, int block,
+		       int timed, uint64_t timeout_ns)
+{
+	static unsigned int rotation;
+	struct chan_select *heap_select = NULL;
+	struct chan_waiter *wake = NULL;
+	int result = CHAN_WOULD_BLOCK;
+	int index = 0;
+
+	if (cases == NULL || count <= 0) return -1;
+	for (int i = 0; i < count; i++)
+	{
+		if (cases[i].chan == NULL) return -1;
+		cases[i].closed = 0;
+	}
+
+	uthread_chan_t chans[count];
+	struct chan_waiter stack_waiters[count];
+	struct chan_select stack_select;
+	struct chan_waiter *waiters = stack_waiters;
+	struct chan_select *select = &stack_select;
+
+	// Allocated beforehand, not to hold the channels' locks meanwhile.
+	if (block && use_shared_stack)
+	{
+		heap_select = chan_select_alloc(cases, count);
+		if (heap_select == NULL) return -1;
+		select = heap_select;
+		waiters = (struct chan_waiter *) (heap_select + 1);
+	}
+
+	preempt_disable();
+	int locked = chan_lock_all(cases, count, chans);
+
+	// Try the operations starting from a different one every time, so that
+	// the first ones don't get all the luck.
+	unsigned int start = count > 1 ? __atomic_fetch_add(&rotation, 1, __ATOMIC_RELAXED) : 0;
+	for (int i = 0; i < count && result == CHAN_WOULD_BLOCK; i++)
+	{
+		index = (start + i) % count;
+		struct uthread_chan_case *c = &cases[index];
+		if (c->op == UTHREAD_CHAN_SEND)
+		{
+			result = chan_try_send(c->chan, c->elem, &wake);
+		} else {
+			result = chan_try_recv(c->chan, c->elem, &wake);
+		}
+	}
+	if (result != CHAN_WOULD_BLOCK || !block)
+	{
+		// Run an unbuffered channel's receiver right away, rather than
+		// leave the value it's been handed for later.
+		int yield = cases[index].op == UTHREAD_CHAN_SEND &&
+			cases[index].chan->capacity == 0;
+		chan_unlock_all(chans, locked);
+		if (wake != NULL) chan_wake(wake, yield);
+		preempt_enable();
+		free(heap_select);
+		if (result == CHAN_WOULD_BLOCK) return count;
+		cases[index].closed = result == CHAN_CLOSED;
+		return index;
+	}
+
+	// Wait on every channel. Whoever proceeds with one of our operations
+	// performs it for us, then wakes us up.
+	select->lock = 0;
+	select->fired = -1;
+	select->closed = 0;
+	select->count = count;
+	select->thread = uthread_waiter();
+	for (int i = 0; i < count; i++)
+	{
+		waiters[i].select = select;
+		if (heap_select == NULL)
+			waiters[i].elem = cases[i].elem;
+		waiters[i].index = i;
+		iqueue_enqueue(cases[i].op == UTHREAD_CHAN_SEND ? &cases[i].chan->senders :
+			       &cases[i].chan->receivers, &waiters[i].link);
+	}
+	spin_lock(&select->lock);
+	chan_unlock_all(chans, locked);
+	if (timed)
+		uthread_timeout_start(timeout_ns, chan_expired, select);
+	uthread_block(&select->lock);
+	if (timed)
+		uthread_timeout_cancel();
+
+	// Proceeded on one of the channels, get out of the others' queues.
+	// The waiter of the operation performed was dequeued already, none was
+	// if timed out.
+	index = select->fired;
+	if (count > 1 || index == count)
+	{
+		locked = chan_lock_all(cases, count, chans);
+		for (int i = 0; i < count; i++)
+		{
+			if (i != index)
+				iqueue_delete(cases[i].op == UTHREAD_CHAN_SEND ?
+					      &cases[i].chan->senders :
+					      &cases[i].chan->receivers, &waiters[i].link);
+		}
+		chan_unlock_all(chans, locked);
+	}
+	preempt_enable();
+	if (index < count)
+	{
+		cases[index].closed = select->closed;
+		if (heap_select != NULL && cases[index].op == UTHREAD_CHAN_RECV &&
+		    !select->closed)
+			chan_copy(cases[index].chan, cases[index].elem, waiters[index].elem);
+	}
+	free(heap_select);
+	return index;
+}
+
+int uthread_chan_select(struct uthread_chan_case *cases, int count, int block)
+{
+	return chan_select(cases, count, block, 0, 0);
+}
+
+int uthread_chan_select_timeout(struct uthread_chan_case *cases, int count,
+				uint64_t timeout_ns)
+{
+	return chan_select(cases, count, 1, 1, timeout_ns);
+}
+
+int uthread_chan_send(uthread_chan_t chan, const void *elem)
+{
+	struct uthread_chan_case c = { chan, UTHREAD_CHAN_SEND, (void*) elem, 0 };
+
+	if (uthread_chan_select(&c, 1, 1) < 0 || c.closed) return -1;
+	return 0;
+}
+
+int uthread_chan_recv(uthread_chan_t chan, void *elem)
+{
+	struct uthread_chan_case c = { chan, UTHREAD_CHAN_RECV, elem, 0 };
+
+	if (uthread_chan_select(&c, 1, 1) < 0 || c.closed) return -1;
+	return 0;
+}
@@ -1,14 +1,230 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "private.h"
 #include "uthread.h"
 
-/* Size of the stack for a thread (in bytes) */
-#define UTHREAD_STACK_SIZE 32768
+/*
+ * Stacks
+ *
+ * Stacks are anonymous mappings reserved without swap accounting, so that only
+ * the pages a thread actually touches cost memory. Unless disabled, the lowest
+ * page of each mapping is made inaccessible so that overflowing the stack
+ * faults instead of silently corrupting a neighbor.
+ *
+ * Free stacks are kept in per size class lists, classes being powers of two
+ * from 4 KiB to 16 MiB. A free stack is chained to the next one through its
+ * last word, which is the first one a thread touches anyway.
+ */
+#define STACK_CLASS_MIN_SHIFT 12
+#define STACK_CLASS_MAX_SHIFT 24
+#define STACK_CLASSES (STACK_CLASS_MAX_SHIFT - STACK_CLASS_MIN_SHIFT + 1)
+
+struct stack_class {
+	void *free;
+	unsigned int count;
+};
+
+static struct stack_class stack_cache[STACK_CLASSES];
+static unsigned int stack_cache_max;
+static struct uthread_stack_cache_stats stack_stats;
+static size_t stack_page_size;
+static size_t stack_guard_size;
+/* Protects the stack cache when there are several workers */
+static int stack_lock;
+static int stack_locking;
+
+#ifdef UTHREAD_CTX_ASM
+/*
+ * uthread_ctx_swap - Save callee-saved registers on the current stack, store
+ * the resulting stack pointer in @save_sp, then load @next_sp and pop the
+ * registers of the context saved there.
+ *
+ * Only what the calling convention requires the callee to preserve is saved:
+ * the caller already spilled everything else before calling us. In particular
+ * no syscall is made, so the signal mask is left untouched (see preempt.c).
+ */
+void uthread_ctx_swap(void **save_sp, void *next_sp);
+
+/*
+ * uthread_ctx_trampoline - First return address of a new context. Moves the
+ * thread function, stashed in a callee-saved register by uthread_ctx_init(),
+ * into the first argument register and calls the bootstrap function.
+ */
+void uthread_ctx_trampoline(void);
+
+#if defined(__x86_64__)
+/*
+ * Frame layout, from the saved stack pointer upwards:
+ * mxcsr/x87 control word, r15, r14, r13, r12, rbx, rbp, return address.
+ */
+#define CTX_FRAME_WORDS 8
+
+__asm__(
+	".text\n"
+	".globl uthread_ctx_swap\n"
+	".hidden uthread_ctx_swap\n"
+	".type uthread_ctx_swap, @function\n"
+	".p2align 4\n"
+	"uthread_ctx_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size uthread_ctx_swap, .-uthread_ctx_swap\n"
+	"\n"
+	".globl uthread_ctx_trampoline\n"
+	".hidden uthread_ctx_trampoline\n"
+	".type uthread_ctx_trampoline, @function\n"
+	".p2align 4\n"
+	"uthread_ctx_trampoline:\n"
+	"	movq %r12, %rdi\n"
+	"	callq *%r13\n"
+	"	ud2\n"
+	".size uthread_ctx_trampoline, .-uthread_ctx_trampoline\n"
+);
+
+static void ctx_frame_init(uintptr_t *frame, uthread_func_t func,
+			   void (*bootstrap)(uthread_func_t))
+{
+	/* Default MXCSR (all exceptions masked) and x87 control word */
+	frame[0] = 0x1f80 | ((uintptr_t) 0x037f << 32);
+	frame[1] = 0;				/* r15 */
+	frame[2] = 0;				/* r14 */
+	frame[3] = (uintptr_t) bootstrap;	/* r13 */
+	frame[4] = (uintptr_t) func;		/* r12 */
+	frame[5] = 0;				/* rbx */
+	frame[6] = 0;				/* rbp */
+	frame[7] = (uintptr_t) uthread_ctx_trampoline;
+}
+
+#elif defined(__aarch64__)
+/*
+ * Frame layout, from the saved stack pointer upwards:
+ * x19-x28, x29 (frame pointer), x30 (link register), d8-d15, fpcr, padding.
+ */
+#define CTX_FRAME_WORDS 22
+
+__asm__(
+	".text\n"
+	".globl uthread_ctx_swap\n"
+	".hidden uthread_ctx_swap\n"
+	".type uthread_ctx_swap, %function\n"
+	".p2align 4\n"
+	"uthread_ctx_swap:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mrs x9, fpcr\n"
+	"	str x9, [sp, #160]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	ldr x9, [sp, #160]\n"
+	"	msr fpcr, x9\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size uthread_ctx_swap, .-uthread_ctx_swap\n"
+	"\n"
+	".globl uthread_ctx_trampoline\n"
+	".hidden uthread_ctx_trampoline\n"
+	".type uthread_ctx_trampoline, %function\n"
+	".p2align 4\n"
+	"uthread_ctx_trampoline:\n"
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+	".size uthread_ctx_trampoline, .-uthread_ctx_trampoline\n"
+);
+
+static void ctx_frame_init(uintptr_t *frame, uthread_func_t func,
+			   void (*bootstrap)(uthread_func_t))
+{
+	int i;
+
+	for (i = 0; i < CTX_FRAME_WORDS; i++)
+		frame[i] = 0;
+	frame[0] = (uintptr_t) func;		/* x19 */
+	frame[1] = (uintptr_t) bootstrap;	/* x20 */
+	frame[11] = (uintptr_t) uthread_ctx_trampoline;	/* x30 */
+}
+#endif
+#endif /* UTHREAD_CTX_ASM */
+
+#ifdef UTHREAD_CTX_ASM
+/*
+ * Shared stack
+ *
+ * @occupant is the context whose frames are currently on the shared stack.
+ * Switching to another shared context goes through @relay, a context running
+ * on a small stack of its own, which saves the used part of the shared stack
+ * into the occupant's buffer and copies the incoming context's buffer back.
+ */
+#define RELAY_STACK_SIZE 16384
+
+static struct {
+	char *base;
+	size_t size;
+	uthread_ctx_t *occupant;
+	uthread_ctx_t *next;
+	void *relay_stack;
+	void *relay_sp;
+} shared_stack;
+#endif
 
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 {
+#ifdef UTHREAD_CTX_ASM
+	/*
+	 * Another context occupies the shared stack: go through the relay,
+	 * which swaps stack contents from its own stack
+	 */
+	if (next->shared && shared_stack.occupant != next) {
+		shared_stack.next = next;
+		uthread_ctx_swap(&prev->sp, shared_stack.relay_sp);
+		return;
+	}
+	uthread_ctx_swap(&prev->sp, next->sp);
+#else
 	/*
 	 * swapcontext() saves the current context in structure pointer by @prev
 	 * and actives the context pointed by @next
@@ -17,16 +233,173 @@ void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 		perror("swapcontext");
 		exit(1);
 	}
+#endif
+}
+
+static void stack_cache_lock(void)
+{
+	if (stack_locking)
+		spin_lock(&stack_lock);
+}
+
+static void stack_cache_unlock(void)
+{
+	if (stack_locking)
+		spin_unlock(&stack_lock);
+}
+
+/* Size class of a stack of @size bytes, or -1 if too large to be cached */
+static int stack_class_of(size_t size)
+{
+	int shift = STACK_CLASS_MIN_SHIFT;
+
+	while (shift <= STACK_CLASS_MAX_SHIFT && ((size_t) 1 << shift) < size)
+		shift++;
+	if (shift > STACK_CLASS_MAX_SHIFT)
+		return -1;
+	return shift - STACK_CLASS_MIN_SHIFT;
+}
+
+static size_t stack_class_size(int class)
+{
+	return (size_t) 1 << (class + STACK_CLASS_MIN_SHIFT);
+}
+
+/* Actual size of the mapping backing a stack of @size bytes */
+static size_t stack_map_size(size_t size)
+{
+	int class = stack_class_of(size);
+
+	if (class >= 0)
+		return stack_class_size(class);
+	return (size + stack_page_size - 1) & ~(stack_page_size - 1);
+}
+
+static void **stack_link(void *stack, int class)
+{
+	return (void **) ((char *) stack + stack_class_size(class)) - 1;
+}
+
+static void *stack_map(size_t size)
+{
+	char *base;
+
+	base = mmap(NULL, stack_guard_size + size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+		    -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	if (stack_guard_size && mprotect(base, stack_guard_size, PROT_NONE)) {
+		munmap(base, stack_guard_size + size);
+		return NULL;
+	}
+	return base + stack_guard_size;
+}
+
+static void stack_unmap(void *stack, size_t size)
+{
+	munmap((char *) stack - stack_guard_size, stack_guard_size + size);
+}
+
+void *uthread_ctx_alloc_stack(size_t size)
+{
+	int class = stack_class_of(size);
+	void *stack;
+
+	if (class < 0)
+		return stack_map(stack_map_size(size));
+
+	stack_cache_lock();
+	stack = stack_cache[class].free;
+	if (stack != NULL) {
+		stack_cache[class].free = *stack_link(stack, class);
+		stack_cache[class].count--;
+		stack_stats.hits++;
+		stack_stats.cached--;
+		stack_cache_unlock();
+		return stack;
+	}
+
+	stack_stats.misses++;
+	stack_cache_unlock();
+	return stack_map(stack_class_size(class));
+}
+
+void uthread_ctx_destroy_stack(void *top_of_stack, size_t size)
+{
+	int class = stack_class_of(size);
+
+	if (top_of_stack == NULL)
+		return;
+	if (class < 0) {
+		stack_unmap(top_of_stack, stack_map_size(size));
+		return;
+	}
+
+	stack_cache_lock();
+	if (stack_cache[class].count >= stack_cache_max) {
+		stack_stats.released++;
+		stack_cache_unlock();
+		stack_unmap(top_of_stack, stack_map_size(size));
+		return;
+	}
+
+	*stack_link(top_of_stack, class) = stack_cache[class].free;
+	stack_cache[class].free = top_of_stack;
+	stack_cache[class].count++;
+	stack_stats.cached++;
+	stack_cache_unlock();
+}
+
+void uthread_ctx_stack_init(const struct uthread_config *config)
+{
+	int class = stack_class_of(config->stack_size);
+	unsigned int i, prewarm = config->stack_cache_prewarm;
+	void *stack;
+
+	stack_page_size = sysconf(_SC_PAGESIZE);
+	stack_guard_size = config->stack_guard ? stack_page_size : 0;
+	stack_cache_max = config->stack_cache_max;
+	stack_locking = config->workers > 1;
+	if (prewarm > stack_cache_max)
+		prewarm = stack_cache_max;
+	if (class < 0)
+		return;
+
+	for (i = stack_cache[class].count; i < prewarm; i++) {
+		stack = stack_map(stack_class_size(class));
+		if (stack == NULL)
+			break;
+		*stack_link(stack, class) = stack_cache[class].free;
+		stack_cache[class].free = stack;
+		stack_cache[class].count++;
+		stack_stats.cached++;
+	}
 }
 
-void *uthread_ctx_alloc_stack(void)
+void uthread_ctx_stack_cache_flush(void)
 {
-	return malloc(UTHREAD_STACK_SIZE);
+	int class;
+	void *stack;
+
+	for (class = 0; class < STACK_CLASSES; class++) {
+		while ((stack = stack_cache[class].free) != NULL) {
+			stack_cache[class].free = *stack_link(stack, class);
+			stack_unmap(stack, stack_class_size(class));
+		}
+		stack_cache[class].count = 0;
+	}
+	stack_stats.cached = 0;
 }
 
-void uthread_ctx_destroy_stack(void *top_of_stack)
+void uthread_stack_cache_stats(struct uthread_stack_cache_stats *stats)
 {
-	free(top_of_stack);
+	preempt_disable();
+	stack_cache_lock();
+	*stats = stack_stats;
+	stack_cache_unlock();
+	preempt_enable();
 }
 
 /*
@@ -36,17 +409,46 @@ void uthread_ctx_destroy_stack(void *top_of_stack)
 static void uthread_ctx_bootstrap(uthread_func_t func)
 {
 	/*
-	 * Enable interrupts right after being elected to run for the first time
+	 * Wrap up the switch from the previous thread, and enable interrupts
+	 * right after being elected to run for the first time
 	 */
+	uthread_switch_finish();
 	preempt_enable();
 
 	/* Execute thread and when done, exit with the return value */
 	uthread_exit(func());
 }
 
-int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
-		     uthread_func_t func)
+/*
+ * uthread_ctx_idle_bootstrap - Scheduler context bootstrap function
+ * @func: Function to be executed by the context, never returning
+ */
+static void uthread_ctx_idle_bootstrap(uthread_func_t func)
+{
+	func();
+}
+
+static int ctx_init(uthread_ctx_t *uctx, void *top_of_stack, size_t stack_size,
+		    uthread_func_t func, void (*bootstrap)(uthread_func_t))
 {
+#ifdef UTHREAD_CTX_ASM
+	uintptr_t top;
+
+	/*
+	 * Build an initial frame at the (16-byte aligned) end of the stack, as if
+	 * the thread had called uthread_ctx_swap() itself: switching to it
+	 * "returns" into uthread_ctx_trampoline() with an aligned stack
+	 */
+	top = ((uintptr_t) top_of_stack + stack_size) & ~(uintptr_t) 15;
+	uctx->sp = (uintptr_t *) top - CTX_FRAME_WORDS;
+	ctx_frame_init(uctx->sp, func, bootstrap);
+	uctx->save_buf = NULL;
+	uctx->save_size = 0;
+	uctx->save_cap = 0;
+	uctx->shared = 0;
+
+	return 0;
+#else
 	/*
 	 * Initialize the passed context @uctx to the currently active context
 	 */
@@ -57,16 +459,152 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 	 * Change context @uctx's stack to the specified stack
 	 */
 	uctx->uc_stack.ss_sp = top_of_stack;
-	uctx->uc_stack.ss_size = UTHREAD_STACK_SIZE;
+	uctx->uc_stack.ss_size = stack_size;
 
 	/*
 	 * Finish setting up context @uctx:
-	 * - the context will jump to function uthread_ctx_bootstrap() when
-	 *   scheduled for the first time
-	 * - when called, function uthread_ctx_bootstrap() will receive @func
+	 * - the context will jump to function @bootstrap when scheduled for
+	 *   the first time
+	 * - when called, function @bootstrap will receive @func
 	 */
-	makecontext(uctx, (void (*)(void)) uthread_ctx_bootstrap, 1, func);
+	makecontext(uctx, (void (*)(void)) bootstrap, 1, func);
 
 	return 0;
+#endif
+}
+
+int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
+		     size_t stack_size, uthread_func_t func)
+{
+	return ctx_init(uctx, top_of_stack, stack_size, func,
+			uthread_ctx_bootstrap);
+}
+
+int uthread_ctx_init_idle(uthread_ctx_t *uctx, void *top_of_stack,
+			  size_t stack_size, uthread_func_t func)
+{
+	return ctx_init(uctx, top_of_stack, stack_size, func,
+			uthread_ctx_idle_bootstrap);
 }
 
+#ifdef UTHREAD_CTX_ASM
+/* Copy the used part of the shared stack into the occupant's buffer */
+static void shared_stack_save(uthread_ctx_t *uctx)
+{
+	size_t size = shared_stack.base + shared_stack.size - (char *) uctx->sp;
+	void *buf;
+
+	/* Keep the buffer tight, but don't reallocate on every small change */
+	if (size > uctx->save_cap || size < uctx->save_cap / 2) {
+		buf = realloc(uctx->save_buf, size);
+		if (buf == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		uctx->save_buf = buf;
+		uctx->save_cap = size;
+	}
+	memcpy(uctx->save_buf, uctx->sp, size);
+	uctx->save_size = size;
+}
+
+/*
+ * shared_stack_relay - Body of the relay context, resumed once per switch to
+ * a shared context that is not the occupant of the shared stack
+ */
+static void shared_stack_relay(uthread_func_t unused)
+{
+	uthread_ctx_t *next;
+
+	(void) unused;
+	for (;;) {
+		next = shared_stack.next;
+		if (shared_stack.occupant != NULL)
+			shared_stack_save(shared_stack.occupant);
+		memcpy(next->sp, next->save_buf, next->save_size);
+		shared_stack.occupant = next;
+		uthread_ctx_swap(&shared_stack.relay_sp, next->sp);
+	}
+}
+#endif
+
+int uthread_ctx_shared_start(size_t size)
+{
+#ifdef UTHREAD_CTX_ASM
+	uintptr_t top;
+
+	size = stack_map_size(size);
+	shared_stack.base = stack_map(size);
+	if (shared_stack.base == NULL)
+		return -1;
+	shared_stack.size = size;
+	shared_stack.occupant = NULL;
+
+	shared_stack.relay_stack = stack_map(RELAY_STACK_SIZE);
+	if (shared_stack.relay_stack == NULL) {
+		stack_unmap(shared_stack.base, size);
+		shared_stack.base = NULL;
+		return -1;
+	}
+	top = (uintptr_t) shared_stack.relay_stack + RELAY_STACK_SIZE;
+	shared_stack.relay_sp = (uintptr_t *) top - CTX_FRAME_WORDS;
+	ctx_frame_init(shared_stack.relay_sp, NULL, shared_stack_relay);
+	return 0;
+#else
+	(void) size;
+	return -1;
+#endif
+}
+
+void uthread_ctx_shared_stop(void)
+{
+#ifdef UTHREAD_CTX_ASM
+	if (shared_stack.base == NULL)
+		return;
+	stack_unmap(shared_stack.base, shared_stack.size);
+	stack_unmap(shared_stack.relay_stack, RELAY_STACK_SIZE);
+	shared_stack.base = NULL;
+	shared_stack.occupant = NULL;
+#endif
+}
+
+int uthread_ctx_init_shared(uthread_ctx_t *uctx, uthread_func_t func)
+{
+#ifdef UTHREAD_CTX_ASM
+	char *top = shared_stack.base + shared_stack.size;
+	size_t size = CTX_FRAME_WORDS * sizeof(uintptr_t);
+
+	/*
+	 * The initial frame is built directly in the private buffer, as it would
+	 * have been saved from the top of the shared stack
+	 */
+	uctx->save_buf = malloc(size);
+	if (uctx->save_buf == NULL)
+		return -1;
+	ctx_frame_init(uctx->save_buf, func, uthread_ctx_bootstrap);
+	uctx->save_size = size;
+	uctx->save_cap = size;
+	uctx->sp = top - size;
+	uctx->shared = 1;
+	return 0;
+#else
+	(void) uctx;
+	(void) func;
+	return -1;
+#endif
+}
+
+void uthread_ctx_release(uthread_ctx_t *uctx)
+{
+#ifdef UTHREAD_CTX_ASM
+	/* Whatever is left on the shared stack is not worth saving anymore */
+	if (shared_stack.occupant == uctx)
+		shared_stack.occupant = NULL;
+	free(uctx->save_buf);
+	uctx->save_buf = NULL;
+	uctx->save_size = 0;
+	uctx->save_cap = 0;
+#else
+	(void) uctx;
+#endif
+}
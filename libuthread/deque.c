@@ -0,0 +1,155 @@
+#include <stdlib.h>
+
+#include "deque.h"
+
+// Circular array of items, indexed by position modulo its size.
+// Item slots are accessed atomically, since a thief may read a slot while the
+// owner reuses it for a new item.
+struct deque_array
+{
+	long size;
+	// Next outgrown array.
+	struct deque_array *retired;
+	void *items[];
+};
+
+static struct deque_array *deque_array_new(long size)
+{
+	struct deque_array *array;
+
+	array = malloc(sizeof(struct deque_array) + size * sizeof(void*));
+	if (array == NULL) return NULL;
+	array->size = size;
+	return array;
+}
+
+static void *deque_array_get(struct deque_array *array, long i)
+{
+	return __atomic_load_n(&array->items[i & (array->size - 1)], __ATOMIC_RELAXED);
+}
+
+static void deque_array_put(struct deque_array *array, long i, void *item)
+{
+	__atomic_store_n(&array->items[i & (array->size - 1)], item, __ATOMIC_RELAXED);
+}
+
+int deque_init(struct deque *deque, long capacity)
+{
+	long size = 1;
+
+	while (size < capacity) size *= 2;
+	deque->array = deque_array_new(size);
+	if (deque->array == NULL) return -1;
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->retired = NULL;
+	return 0;
+}
+
+void deque_destroy(struct deque *deque)
+{
+	struct deque_array *array = deque->retired;
+
+	while (array != NULL)
+	{
+		struct deque_array *next = array->retired;
+		free(array);
+		array = next;
+	}
+	free(deque->array);
+	deque->array = NULL;
+	deque->retired = NULL;
+}
+
+// Move the items to an array twice as large.
+static struct deque_array *deque_grow(struct deque *deque, long top, long bottom)
+{
+	struct deque_array *old = deque->array;
+	struct deque_array *array = deque_array_new(2 * old->size);
+
+	if (array == NULL) return NULL;
+	for (long i = top; i < bottom; i++)
+		deque_array_put(array, i, deque_array_get(old, i));
+	__atomic_store_n(&deque->array, array, __ATOMIC_RELEASE);
+
+	// Thieves may still be reading the old array.
+	old->retired = deque->retired;
+	deque->retired = old;
+	return array;
+}
+
+int deque_push(struct deque *deque, void *item)
+{
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+	if (bottom - top > array->size - 1)
+	{
+		array = deque_grow(deque, top, bottom);
+		if (array == NULL) return -1;
+	}
+	deque_array_put(array, bottom, item);
+	// Publish the item before the new bottom.
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void *deque_pop(struct deque *deque)
+{
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+	long top;
+	void *item = NULL;
+
+	// Claim the bottom item before looking at top, thieves do the opposite.
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (top <= bottom)
+	{
+		item = deque_array_get(array, bottom);
+		if (top == bottom)
+		{
+			// Last item, race thieves for it.
+			if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+							 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				item = NULL;
+			__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		// Empty.
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+	return item;
+}
+
+void *deque_steal(struct deque *deque)
+{
+	for (;;)
+	{
+		long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+		if (top >= bottom)
+			return NULL;
+
+		struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+		void *item = deque_array_get(array, top);
+		if (__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return item;
+		// Lost the race against another thief or the owner, try again.
+	}
+}
+
+long deque_length(struct deque *deque)
+{
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	return bottom > top ? bottom - top : 0;
+}
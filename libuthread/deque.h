@@ -0,0 +1,81 @@
+#ifndef _DEQUE_H
+#define _DEQUE_H
+
+/*
+ * struct deque - Work-stealing deque
+ *
+ * A Chase-Lev deque has a single owner, which pushes and pops items at its
+ * bottom end, while any thread may steal items from its top end. None of the
+ * operations take a lock: the owner only competes with thieves, through an
+ * atomic compare-and-swap, for the very last item. Items popped by the owner
+ * come out newest first (LIFO), stolen items oldest first (FIFO), and the owner
+ * can steal from its own deque too to consume items in FIFO order.
+ *
+ * The deque grows as needed. Arrays it outgrows may still be read by thieves,
+ * so they are only freed when the deque is destroyed.
+ */
+struct deque_array;
+
+struct deque {
+	long top;
+	long bottom;
+	struct deque_array *array;
+	/* Outgrown arrays */
+	struct deque_array *retired;
+};
+
+/*
+ * deque_init - Initialize an empty deque
+ * @deque: Deque to initialize
+ * @capacity: Initial capacity, rounded up to a power of two
+ *
+ * Return: -1 in case of memory allocation failure. 0 if @deque was
+ * initialized.
+ */
+int deque_init(struct deque *deque, long capacity);
+
+/*
+ * deque_destroy - Free the memory of a deque
+ * @deque: Deque to destroy
+ */
+void deque_destroy(struct deque *deque);
+
+/*
+ * deque_push - Push an item at the bottom of a deque (owner only)
+ * @deque: Deque in which to push
+ * @item: Item to push, not NULL
+ *
+ * Return: -1 in case of memory allocation failure when growing @deque. 0 if
+ * @item was pushed.
+ */
+int deque_push(struct deque *deque, void *item);
+
+/*
+ * deque_pop - Pop the newest item of a deque (owner only)
+ * @deque: Deque from which to pop
+ *
+ * Return: The item pushed last, or NULL if @deque is empty.
+ */
+void *deque_pop(struct deque *deque);
+
+/*
+ * deque_steal - Steal the oldest item of a deque
+ * @deque: Deque from which to steal
+ *
+ * Can be called by any thread, the owner included.
+ *
+ * Return: The item pushed first, or NULL if @deque is empty.
+ */
+void *deque_steal(struct deque *deque);
+
+/*
+ * deque_length - Number of items in a deque
+ * @deque: Deque to get the length of
+ *
+ * Only a snapshot when other threads use @deque concurrently.
+ *
+ * Return: The number of items in @deque.
+ */
+long deque_length(struct deque *deque);
+
+#endif /* _DEQUE_H */
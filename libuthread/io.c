@@ -0,0 +1,373 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "private.h"
+#include "queue.h"
+#include "uthread.h"
+
+// Directions a thread waits for a descriptor to be ready in.
+enum
+{
+	IO_READ,
+	IO_WRITE,
+};
+
+// State of a file descriptor used with the I/O wrappers, protected by lock.
+struct io_fd
+{
+	int lock;
+	// Whether it was made non-blocking, and added to the epoll set.
+	int nonblocking;
+	int registered;
+	// Number of times it was reported ready in either direction, read
+	// without the lock to tell if it got ready after an attempt failed.
+	unsigned int events[2];
+	// Threads waiting for it to be ready in either direction.
+	struct iqueue waiters[2];
+};
+
+// Descriptors are kept in chunks allocated on first use, so that an entry
+// never moves and can be looked up without locking.
+#define IO_CHUNK_SIZE 1024
+#define IO_CHUNKS 1024
+
+static struct io_fd *io_chunks[IO_CHUNKS];
+
+// Epoll instance, and event counter to interrupt epoll_wait() with.
+static int io_epoll = -1;
+static int io_eventfd = -1;
+// io_uring instance, if any.
+static int io_uring = -1;
+
+// Number of threads blocked waiting for I/O.
+static int io_waiters;
+
+// Maximum number of events handled per io_poll().
+#define IO_EVENTS 64
+
+int io_start(unsigned int uring_entries)
+{
+	struct epoll_event event = { .events = EPOLLIN };
+
+	io_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (io_epoll < 0) return -1;
+	io_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (io_eventfd < 0) return -1;
+	event.data.fd = io_eventfd;
+	if (epoll_ctl(io_epoll, EPOLL_CTL_ADD, io_eventfd, &event)) return -1;
+	io_waiters = 0;
+
+	// The ring is readable while it has completions to reap. Without it,
+	// its operations fall back to the synchronous path.
+	io_uring = uring_entries ? uring_start(uring_entries) : -1;
+	if (io_uring >= 0)
+	{
+		event.data.fd = io_uring;
+		if (epoll_ctl(io_epoll, EPOLL_CTL_ADD, io_uring, &event)) return -1;
+	}
+	return 0;
+}
+
+void io_stop(void)
+{
+	uring_stop();
+	io_uring = -1;
+	close(io_eventfd);
+	close(io_epoll);
+	io_eventfd = -1;
+	io_epoll = -1;
+	for (int i = 0; i < IO_CHUNKS; i++)
+	{
+		free(io_chunks[i]);
+		io_chunks[i] = NULL;
+	}
+}
+
+int io_waiting(void)
+{
+	return __atomic_load_n(&io_waiters, __ATOMIC_RELAXED) + uring_waiting();
+}
+
+void io_interrupt(void)
+{
+	uint64_t one = 1;
+	ssize_t ret;
+
+	// Can only fail if the counter is about to overflow, still set then.
+	ret = write(io_eventfd, &one, sizeof(one));
+	(void) ret;
+}
+
+// Get the entry of a descriptor, allocating its chunk if need be. NULL if out
+// of range, or in case of memory allocation failure.
+static struct io_fd *io_entry(int fd)
+{
+	struct io_fd *chunk;
+
+	if (fd < 0 || fd >= IO_CHUNK_SIZE * IO_CHUNKS) return NULL;
+	chunk = __atomic_load_n(&io_chunks[fd / IO_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+	{
+		struct io_fd *expected = NULL;
+		chunk = calloc(IO_CHUNK_SIZE, sizeof(struct io_fd));
+		if (chunk == NULL) return NULL;
+		for (int i = 0; i < IO_CHUNK_SIZE; i++)
+		{
+			iqueue_init(&chunk[i].waiters[IO_READ]);
+			iqueue_init(&chunk[i].waiters[IO_WRITE]);
+		}
+		// Another thread may have beaten us to it.
+		if (!__atomic_compare_exchange_n(&io_chunks[fd / IO_CHUNK_SIZE], &expected,
+						 chunk, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			free(chunk);
+			chunk = expected;
+		}
+	}
+	return &chunk[fd % IO_CHUNK_SIZE];
+}
+
+// Get the entry of a descriptor about to be used, made non-blocking. NULL,
+// with errno set, in case of failure.
+static struct io_fd *io_prepare(int fd)
+{
+	struct io_fd *entry = io_entry(fd);
+
+	if (entry == NULL)
+	{
+		errno = fd < 0 ? EBADF : ENOMEM;
+		return NULL;
+	}
+	if (!__atomic_load_n(&entry->nonblocking, __ATOMIC_RELAXED))
+	{
+		int flags = fcntl(fd, F_GETFL);
+		if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+			return NULL;
+		__atomic_store_n(&entry->nonblocking, 1, __ATOMIC_RELAXED);
+	}
+	return entry;
+}
+
+// Number of times a descriptor was reported ready in a direction, to be read
+// before an attempt and passed to io_wait() if it fails.
+static unsigned int io_sequence(struct io_fd *entry, int dir)
+{
+	return __atomic_load_n(&entry->events[dir], __ATOMIC_ACQUIRE);
+}
+
+// Block until a descriptor is ready in a direction, unless it got ready since
+// @sequence was read. Registration with epoll is edge-triggered, and done on
+// the first wait, which reports the descriptor if it is ready already.
+static int io_wait(int fd, struct io_fd *entry, int dir, unsigned int sequence)
+{
+	if (io_epoll < 0)
+	{
+		// Not started, can't block a thread.
+		errno = EAGAIN;
+		return -1;
+	}
+
+	preempt_disable();
+	spin_lock(&entry->lock);
+	if (!entry->registered)
+	{
+		struct epoll_event event = {
+			.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+			.data.fd = fd,
+		};
+		if (epoll_ctl(io_epoll, EPOLL_CTL_ADD, fd, &event) && errno != EEXIST)
+		{
+			spin_unlock(&entry->lock);
+			preempt_enable();
+			return -1;
+		}
+		entry->registered = 1;
+	}
+	if (entry->events[dir] != sequence)
+	{
+		// Ready meanwhile, try again.
+		spin_unlock(&entry->lock);
+	} else {
+		iqueue_enqueue(&entry->waiters[dir], uthread_waiter());
+		__atomic_add_fetch(&io_waiters, 1, __ATOMIC_SEQ_CST);
+		uthread_block(&entry->lock);
+	}
+	preempt_enable();
+	return 0;
+}
+
+// Wake up the threads waiting for a descriptor in the given directions.
+static int io_ready(struct io_fd *entry, int read, int write)
+{
+	struct queue_node *waiter;
+	struct iqueue woken;
+	int count = 0;
+
+	iqueue_init(&woken);
+	spin_lock(&entry->lock);
+	for (int dir = IO_READ; dir <= IO_WRITE; dir++)
+	{
+		if (dir == IO_READ ? !read : !write)
+			continue;
+		__atomic_add_fetch(&entry->events[dir], 1, __ATOMIC_RELEASE);
+		while (iqueue_dequeue(&entry->waiters[dir], &waiter) == 0)
+			iqueue_enqueue(&woken, waiter);
+	}
+	spin_unlock(&entry->lock);
+	while (iqueue_dequeue(&woken, &waiter) == 0)
+	{
+		__atomic_sub_fetch(&io_waiters, 1, __ATOMIC_SEQ_CST);
+		uthread_wake(waiter, 0);
+		count++;
+	}
+	return count;
+}
+
+int io_poll(long timeout_ns)
+{
+	struct epoll_event events[IO_EVENTS];
+	struct timespec timeout = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+	int woken = 0;
+	int n;
+
+	// Operations queued in the ring get going before waiting for them.
+	uring_submit();
+	n = epoll_pwait2(io_epoll, events, IO_EVENTS, timeout_ns < 0 ? NULL : &timeout, NULL);
+	if (n < 0 && errno == ENOSYS)
+	{
+		// Before Linux 5.11, only milliseconds, rounded up not to wake
+		// up before a timeout expires.
+		long ms = timeout_ns < 0 ? -1 :
+			timeout_ns / 1000000 + (timeout_ns % 1000000 != 0);
+		n = epoll_wait(io_epoll, events, IO_EVENTS, ms > INT_MAX ? INT_MAX : ms);
+	}
+	for (int i = 0; i < n; i++)
+	{
+		int fd = events[i].data.fd;
+		if (fd == io_uring)
+		{
+			woken += uring_reap();
+			continue;
+		}
+		if (fd == io_eventfd)
+		{
+			// Interrupted, reset the counter. Failing means someone
+			// else did.
+			uint64_t count;
+			ssize_t ret = read(io_eventfd, &count, sizeof(count));
+			(void) ret;
+			continue;
+		}
+		// Errors and hang-ups wake up everyone, to find out.
+		uint32_t mask = events[i].events;
+		int error = mask & (EPOLLERR | EPOLLHUP);
+		woken += io_ready(io_entry(fd), error || (mask & (EPOLLIN | EPOLLRDHUP)),
+				  error || (mask & EPOLLOUT));
+	}
+	return woken;
+}
+
+ssize_t uthread_read(int fd, void *buf, size_t count)
+{
+	struct io_fd *entry = io_prepare(fd);
+
+	if (entry == NULL) return -1;
+	for (;;)
+	{
+		unsigned int sequence = io_sequence(entry, IO_READ);
+		ssize_t ret = read(fd, buf, count);
+		if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return ret;
+		if (io_wait(fd, entry, IO_READ, sequence))
+			return -1;
+	}
+}
+
+ssize_t uthread_write(int fd, const void *buf, size_t count)
+{
+	struct io_fd *entry = io_prepare(fd);
+
+	if (entry == NULL) return -1;
+	for (;;)
+	{
+		unsigned int sequence = io_sequence(entry, IO_WRITE);
+		ssize_t ret = write(fd, buf, count);
+		if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return ret;
+		if (io_wait(fd, entry, IO_WRITE, sequence))
+			return -1;
+	}
+}
+
+int uthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct io_fd *entry = io_prepare(fd);
+
+	if (entry == NULL) return -1;
+	for (;;)
+	{
+		unsigned int sequence = io_sequence(entry, IO_READ);
+		int ret = accept(fd, addr, addrlen);
+		if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return ret;
+		if (io_wait(fd, entry, IO_READ, sequence))
+			return -1;
+	}
+}
+
+int uthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct io_fd *entry = io_prepare(fd);
+	socklen_t len = sizeof(int);
+	int error;
+
+	if (entry == NULL) return -1;
+	unsigned int sequence = io_sequence(entry, IO_WRITE);
+	if (connect(fd, addr, addrlen) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+
+	// Connecting in the background, writable once done.
+	do {
+		if (io_wait(fd, entry, IO_WRITE, sequence))
+			return -1;
+		sequence = io_sequence(entry, IO_WRITE);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len))
+			return -1;
+	} while (error == EINPROGRESS || error == EALREADY);
+
+	if (error)
+	{
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int uthread_close(int fd)
+{
+	struct io_fd *entry = io_entry(fd);
+
+	if (entry != NULL && io_epoll >= 0)
+	{
+		preempt_disable();
+		spin_lock(&entry->lock);
+		if (entry->registered)
+			epoll_ctl(io_epoll, EPOLL_CTL_DEL, fd, NULL);
+		entry->registered = 0;
+		__atomic_store_n(&entry->nonblocking, 0, __ATOMIC_RELAXED);
+		spin_unlock(&entry->lock);
+		// Get waiters to try again, and fail.
+		io_ready(entry, 1, 1);
+		preempt_enable();
+	}
+	return close(fd);
+}
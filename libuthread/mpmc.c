@@ -0,0 +1,128 @@
+#include <stdlib.h>
+
+#include "mpmc.h"
+
+// Size of a cache line, to keep producers and consumers from false sharing.
+#define CACHE_LINE 64
+
+// Slot of the circular array. Its sequence number equals the position of the
+// enqueue it is free for, or that position plus one once it holds the item.
+// Dequeueing frees it for the enqueue one lap later, at position + size.
+struct mpmc_cell {
+	unsigned long sequence;
+	void *data;
+};
+
+struct mpmc_queue {
+	// Next positions to enqueue at and to dequeue from, each on its own line.
+	unsigned long enqueue_pos __attribute__((aligned(CACHE_LINE)));
+	unsigned long dequeue_pos __attribute__((aligned(CACHE_LINE)));
+	unsigned long mask __attribute__((aligned(CACHE_LINE)));
+	struct mpmc_cell cells[];
+};
+
+mpmc_queue_t mpmc_queue_create(int capacity)
+{
+	unsigned long size = 1;
+	mpmc_queue_t queue;
+
+	if (capacity <= 0) return NULL;
+	while (size < (unsigned long) capacity) size *= 2;
+	queue = aligned_alloc(CACHE_LINE, sizeof(struct mpmc_queue) +
+			      size * sizeof(struct mpmc_cell));
+	if (queue == NULL) return NULL;
+
+	// Every slot is free for the enqueue of the first lap.
+	for (unsigned long i = 0; i < size; i++)
+		queue->cells[i].sequence = i;
+	queue->mask = size - 1;
+	queue->enqueue_pos = 0;
+	queue->dequeue_pos = 0;
+	return queue;
+}
+
+int mpmc_queue_destroy(mpmc_queue_t queue)
+{
+	if (queue == NULL || mpmc_queue_length(queue)) return -1;
+	free(queue);
+	return 0;
+}
+
+int mpmc_queue_enqueue(mpmc_queue_t queue, void *data)
+{
+	if (queue == NULL || data == NULL) return -1;
+
+	unsigned long pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		struct mpmc_cell *cell = &queue->cells[pos & queue->mask];
+		unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		long diff = (long) (sequence - pos);
+
+		if (diff == 0)
+		{
+			// Free for this position, claim it. On failure, pos is reloaded.
+			if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				cell->data = data;
+				// Hand the slot over to the dequeue at this position.
+				__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+				return 0;
+			}
+		} else if (diff < 0) {
+			// Still holds the item from the previous lap: full.
+			return -1;
+		} else {
+			// Another producer claimed this position already.
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int mpmc_queue_dequeue(mpmc_queue_t queue, void **data)
+{
+	if (queue == NULL || data == NULL) return -1;
+
+	unsigned long pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		struct mpmc_cell *cell = &queue->cells[pos & queue->mask];
+		unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		long diff = (long) (sequence - (pos + 1));
+
+		if (diff == 0)
+		{
+			// Holds the item for this position, claim it.
+			if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*data = cell->data;
+				// Free the slot for the enqueue one lap later.
+				__atomic_store_n(&cell->sequence, pos + queue->mask + 1,
+						 __ATOMIC_RELEASE);
+				return 0;
+			}
+		} else if (diff < 0) {
+			// Not filled yet: empty, or its producer is still at work.
+			return -1;
+		} else {
+			// Another consumer claimed this position already.
+			pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int mpmc_queue_length(mpmc_queue_t queue)
+{
+	if (queue == NULL) return -1;
+
+	// Read dequeue_pos first, so that it can't have overtaken enqueue_pos.
+	unsigned long dequeue_pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_ACQUIRE);
+	unsigned long enqueue_pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_ACQUIRE);
+	long length = (long) (enqueue_pos - dequeue_pos);
+
+	if (length < 0) return 0;
+	if (length > (long) queue->mask + 1) return queue->mask + 1;
+	return length;
+}
@@ -0,0 +1,74 @@
+#ifndef _MPMC_H
+#define _MPMC_H
+
+/*
+ * mpmc_queue_t - Lock-free multi-producer multi-consumer queue type
+ *
+ * An MPMC queue has the same FIFO semantics as queue_t, but any number of
+ * kernel threads may enqueue and dequeue concurrently, without taking a lock.
+ * Items are stored in a bounded circular array allocated once at creation, so
+ * enqueueing never allocates memory, and fails instead when the queue is full.
+ *
+ * Every slot of the array carries a sequence number telling whether it is free
+ * for the enqueue at its position or holds the item for the dequeue at its
+ * position. Producers and consumers each claim positions with an atomic
+ * compare-and-swap, and only ever wait on each other for a single slot: a
+ * dequeue finding a slot whose producer has claimed it but not yet filled it
+ * reports the queue as empty rather than waiting. Neither operation can thus
+ * deadlock when called from a signal handler interrupting another one.
+ *
+ * Delete and iterate operations are not available.
+ */
+typedef struct mpmc_queue* mpmc_queue_t;
+
+/*
+ * mpmc_queue_create - Allocate an empty MPMC queue
+ * @capacity: Maximum number of items, rounded up to a power of two
+ *
+ * Return: Pointer to new empty queue. NULL if @capacity is not positive, or in
+ * case of failure when allocating the new queue.
+ */
+mpmc_queue_t mpmc_queue_create(int capacity);
+
+/*
+ * mpmc_queue_destroy - Deallocate an MPMC queue
+ * @queue: Queue to deallocate
+ *
+ * No other thread may be using @queue.
+ *
+ * Return: -1 if @queue is NULL or if @queue is not empty. 0 if @queue was
+ * successfully destroyed.
+ */
+int mpmc_queue_destroy(mpmc_queue_t queue);
+
+/*
+ * mpmc_queue_enqueue - Enqueue data item
+ * @queue: Queue in which to enqueue item
+ * @data: Address of data item to enqueue
+ *
+ * Return: -1 if @queue or @data are NULL, or if @queue is full. 0 if @data was
+ * successfully enqueued in @queue.
+ */
+int mpmc_queue_enqueue(mpmc_queue_t queue, void *data);
+
+/*
+ * mpmc_queue_dequeue - Dequeue data item
+ * @queue: Queue in which to dequeue item
+ * @data: Address of data pointer where item is received
+ *
+ * Return: -1 if @queue or @data are NULL, or if the queue is empty. 0 if @data
+ * was set with the oldest item available in @queue.
+ */
+int mpmc_queue_dequeue(mpmc_queue_t queue, void **data);
+
+/*
+ * mpmc_queue_length - MPMC queue length
+ * @queue: Queue to get the length of
+ *
+ * Only a snapshot when other threads use @queue concurrently.
+ *
+ * Return: -1 if @queue is NULL. Length of @queue otherwise.
+ */
+int mpmc_queue_length(mpmc_queue_t queue);
+
+#endif /* _MPMC_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -5,64 +6,178 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "private.h"
 #include "uthread.h"
 
+// glibc only names the target thread of SIGEV_THREAD_ID in recent versions.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 // signal action that triggers a forced yield.
 struct sigaction preempt_now;
 struct sigaction preempt_never;
-// sigset that controls blocking SIGVTALRM.
-sigset_t preemption_blocker;
-sigset_t old_blocker;
-// timer that rings SIGVTALRM 100 times per second.
-struct itimerval ringer;
-struct itimerval old_ringer;
-
-void preempt(int signum)
+
+// Timer of every worker, ringing the worker's kernel thread once per quantum.
+struct preempt_timer
+{
+	timer_t id;
+	// Whether the timer is currently ringing.
+	int armed;
+};
+static struct preempt_timer *preempt_timers;
+
+// Timer settings from the configuration.
+static int preempt_clock;
+static int preempt_signal;
+static long preempt_quantum_us;
+static int preempt_tickless;
+
+// Worker of the calling kernel thread.
+static __thread unsigned int preempt_worker;
+
+// Preemption is disabled while preempt_count is not zero, in which case a
+// timer tick only marks a forced yield as pending in preempt_pending. Both are
+// only ever changed by the kernel thread they belong to, either directly or
+// from the signal handler, so no atomics or signal masking needed.
+static __thread volatile sig_atomic_t preempt_count;
+static __thread volatile sig_atomic_t preempt_pending;
+
+// Start (@on) or stop the timer of @worker.
+static void preempt_timer_set(unsigned int worker, int on)
+{
+	long usec = on ? preempt_quantum_us : 0;
+	struct itimerspec spec;
+
+	spec.it_interval.tv_sec = usec / 1000000;
+	spec.it_interval.tv_nsec = usec % 1000000 * 1000;
+	spec.it_value = spec.it_interval;
+	__atomic_store_n(&preempt_timers[worker].armed, on, __ATOMIC_SEQ_CST);
+	timer_settime(preempt_timers[worker].id, 0, &spec, NULL);
+}
+
+void preempt(int signum, siginfo_t *info, void *ucontext)
 {
 	(void) signum;
-	uthread_yield();
+	(void) info;
+	// Sample whatever got interrupted, critical sections included.
+	if (__atomic_load_n(&profile_enabled, __ATOMIC_RELAXED))
+		profile_record(preempt_worker, ucontext);
+	// Tickless: nobody to yield to, stop ringing until someone shows up.
+	// Checking again once stopped, a thread made ready meanwhile may have
+	// seen the timer still armed and not restarted it. Ticks also expire
+	// timeouts, keep ringing for those.
+	if (preempt_tickless && uthread_ready_threads() == 0 && !uthread_timeouts_pending())
+	{
+		preempt_timer_set(preempt_worker, 0);
+		if (uthread_ready_threads() == 0 && !uthread_timeouts_pending())
+			return;
+		preempt_timer_set(preempt_worker, 1);
+	}
+	// Inside a critical section, defer the yield to preempt_enable().
+	if (preempt_count)
+	{
+		preempt_pending = 1;
+		return;
+	}
+	uthread_preempt_yield();
 }
 
-void preempt_start(void) {
-	// Prepare the blocker to toggle responses to SIGVTALRM.
-	sigemptyset(&preemption_blocker);
-	sigaddset(&preemption_blocker, SIGVTALRM);
-	// Initially starts off blocked and is enabled in ctx_bootstrap or uthread_start.
-	sigprocmask(SIG_SETMASK, &preemption_blocker, &old_blocker);
-
-	// Establish a signal handler to yield when SIGVTALRM is raised.
-	preempt_now.sa_handler = preempt;
-	sigaction(SIGVTALRM, &preempt_now, &preempt_never);
-
-	// Establish a timer that rings SIGVTARLM 100 times a second.
-	// 100 times a second -> .01 seconds = 10000 microseconds.
-	ringer.it_interval.tv_sec = 0;
-	ringer.it_interval.tv_usec = 10000;
-	ringer.it_value.tv_sec = 0;
-	ringer.it_value.tv_usec = 10000;
-	// Activate the timer based on the settings from start.
-	// Save original settings to restore in stop.
-	setitimer(ITIMER_VIRTUAL, &ringer, &old_ringer);
+int preempt_start(const struct uthread_config *config)
+{
+	if (config->quantum_us <= 0)
+		return -1;
+	preempt_clock = config->preempt_clock;
+	preempt_quantum_us = config->quantum_us;
+	// Profiling samples a thread even when it's the only one running.
+	preempt_tickless = config->tickless && !config->profile_samples;
+	preempt_signal = preempt_clock == UTHREAD_CLOCK_WALL ? SIGALRM : SIGVTALRM;
+
+	// Initially starts off disabled and is enabled in ctx_bootstrap or uthread_start.
+	preempt_count = 1;
+	preempt_pending = 0;
+
+	preempt_timers = calloc(config->workers, sizeof(struct preempt_timer));
+	if (preempt_timers == NULL)
+		return -1;
+
+	// Establish a signal handler to yield when the timer rings.
+	// The signal is not blocked while the handler runs: the handler may switch
+	// to another thread, which must remain preemptible. Reentrance is dealt
+	// with by preempt_count instead.
+	preempt_now.sa_sigaction = preempt;
+	sigemptyset(&preempt_now.sa_mask);
+	preempt_now.sa_flags = SA_SIGINFO | SA_NODEFER | SA_RESTART;
+	sigaction(preempt_signal, &preempt_now, &preempt_never);
+
+	return preempt_start_worker(0);
+}
+
+int preempt_start_worker(unsigned int worker)
+{
+	struct sigevent event = { 0 };
+	clockid_t clock;
+
+	// Ring this kernel thread only, measuring its own CPU time if need be.
+	clock = preempt_clock == UTHREAD_CLOCK_WALL ? CLOCK_MONOTONIC :
+		CLOCK_THREAD_CPUTIME_ID;
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = preempt_signal;
+	event.sigev_notify_thread_id = gettid();
+	if (timer_create(clock, &event, &preempt_timers[worker].id))
+		return -1;
+	preempt_worker = worker;
+
+	// Activate the timer, one tick per quantum.
+	preempt_timer_set(worker, 1);
+	return 0;
+}
+
+void preempt_stop_worker(void)
+{
+	timer_delete(preempt_timers[preempt_worker].id);
+	preempt_timers[preempt_worker].armed = 0;
 }
 
 void preempt_stop(void)
 {
+	// Never started.
+	if (preempt_signal == 0)
+		return;
 	// Disable preemption so no forced yields while resetting.
 	preempt_disable();
 	// Restore response system to its original state.
-	sigprocmask(SIG_SETMASK, &old_blocker, NULL);
-	sigaction(SIGVTALRM, &preempt_never, NULL);
-	setitimer(ITIMER_VIRTUAL, &old_ringer, NULL);
+	preempt_stop_worker();
+	sigaction(preempt_signal, &preempt_never, NULL);
+	free(preempt_timers);
+	preempt_timers = NULL;
+	preempt_signal = 0;
+	preempt_tickless = 0;
+	preempt_count = 0;
+	preempt_pending = 0;
+}
+
+void preempt_rearm(unsigned int worker)
+{
+	if (preempt_tickless &&
+	    !__atomic_load_n(&preempt_timers[worker].armed, __ATOMIC_SEQ_CST))
+		preempt_timer_set(worker, 1);
 }
 
 void preempt_enable(void)
 {
-	sigprocmask(SIG_UNBLOCK, &preemption_blocker, NULL);
+	// Leaving the outermost critical section, catch up on a missed tick.
+	if (--preempt_count == 0 && preempt_pending)
+	{
+		preempt_pending = 0;
+		uthread_preempt_yield();
+	}
 }
 
 void preempt_disable(void)
 {
-	sigprocmask(SIG_BLOCK, &preemption_blocker, NULL);
+	preempt_count++;
 }
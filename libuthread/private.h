@@ -10,10 +10,26 @@
 /**
  * Private context API
  */
-#include <ucontext.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "uthread.h"
 
+/*
+ * Context switch backend
+ *
+ * By default, contexts are switched by a small assembly routine that only
+ * saves callee-saved registers and the stack pointer. Building with
+ * UTHREAD_CTX_UCONTEXT defined (`make CTX=ucontext`), or for an architecture
+ * without such a routine, falls back to getcontext()/swapcontext().
+ */
+#if !defined(UTHREAD_CTX_UCONTEXT) && \
+	(defined(__x86_64__) || defined(__aarch64__))
+#define UTHREAD_CTX_ASM
+#else
+#include <ucontext.h>
+#endif
+
 /*
  * uthread_ctx_t - User-level thread context
  *
@@ -23,42 +39,313 @@
  * Such a context is initialized for the first time when creating a thread with
  * uthread_ctx_init(). Once initialized, it can be switched to with
  * uthread_ctx_switch().
+ *
+ * With the assembly backend, the registers of a switched-out context live on
+ * its own stack and the context itself is reduced to the saved stack pointer.
+ * A context running on the shared stack (see uthread_ctx_init_shared()) also
+ * keeps the copy of its stack made while it is switched out.
  */
+#ifdef UTHREAD_CTX_ASM
+typedef struct uthread_ctx {
+	void *sp;
+	/* Shared stack mode only */
+	void *save_buf;
+	size_t save_size;
+	size_t save_cap;
+	int shared;
+} uthread_ctx_t;
+#else
 typedef ucontext_t uthread_ctx_t;
+#endif
 
 /*
  * uthread_ctx_switch - Switch between two execution contexts
  * @prev: Pointer to the execution context structure in which to save the
  *	currently running thread
  * @next: Pointer to the execution context structure to resume
+ *
+ * With the assembly backend, the signal mask is not part of the context: it is
+ * left as is across switches and managed by the preemption API instead.
  */
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next);
 
+/* Default size of the stack for a thread (in bytes) */
+#define UTHREAD_STACK_SIZE 32768
+
 /*
  * uthread_ctx_alloc_stack - Allocate stack segment
+ * @size: Size of the stack segment (in bytes)
+ *
+ * The stack is taken from the stack cache if one of the same size class is
+ * available, and freshly mapped otherwise. Memory is only committed as the
+ * stack gets used, and the stack is preceded by a guard page if enabled.
  *
  * Return: Pointer to the top of a valid stack segment, or NULL in case of
  * failure
  */
-void *uthread_ctx_alloc_stack(void);
+void *uthread_ctx_alloc_stack(size_t size);
 
 /*
  * uthread_ctx_destroy_stack - Deallocate stack segment
  * @top_of_stack: Address of stack to deallocate
+ * @size: Size the stack was allocated with
+ *
+ * The stack is given back to the stack cache, unless its size class is already
+ * at the cache's high-water mark.
+ */
+void uthread_ctx_destroy_stack(void *top_of_stack, size_t size);
+
+/*
+ * uthread_ctx_stack_init - Configure stack allocation
+ * @config: Library configuration (stack guard, stack cache and workers
+ *	settings)
+ *
+ * Pre-warm the stack cache with stacks of the configured default size.
+ */
+void uthread_ctx_stack_init(const struct uthread_config *config);
+
+/*
+ * uthread_ctx_stack_cache_flush - Free every stack held in the stack cache
  */
-void uthread_ctx_destroy_stack(void *top_of_stack);
+void uthread_ctx_stack_cache_flush(void);
 
 /*
  * uthread_ctx_init - Initialize a thread's execution context
  * @uctx: Pointer to thread context to initialize
  * @top_of_stack: Pointer to the top of a valid stack segment, as allocated by
  *	uthread_ctx_alloc_stack()
+ * @stack_size: Size the stack segment was allocated with
  * @func: Function to be executed by the thread
  *
  * Return: 0 if @uctx was properly initialized, or -1 in case of failure
  */
 int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
-					 uthread_func_t func);
+					 size_t stack_size, uthread_func_t func);
+
+/*
+ * uthread_ctx_init_idle - Initialize a scheduler context
+ * @uctx: Pointer to context to initialize
+ * @top_of_stack: Pointer to the top of a valid stack segment
+ * @stack_size: Size the stack segment was allocated with
+ * @func: Function to be executed by the context, which must never return
+ *
+ * Unlike with uthread_ctx_init(), @func is called as is: preemption is left
+ * disabled and there is no thread to exit from.
+ *
+ * Return: 0 if @uctx was properly initialized, or -1 in case of failure
+ */
+int uthread_ctx_init_idle(uthread_ctx_t *uctx, void *top_of_stack,
+			  size_t stack_size, uthread_func_t func);
+
+/*
+ * uthread_ctx_shared_start - Set up the shared stack
+ * @size: Size of the shared stack (in bytes)
+ *
+ * Threads initialized with uthread_ctx_init_shared() all run on the shared
+ * stack. Only available with the assembly backend.
+ *
+ * Return: 0 in case of success, -1 in case of failure
+ */
+int uthread_ctx_shared_start(size_t size);
+
+/*
+ * uthread_ctx_shared_stop - Tear down the shared stack
+ */
+void uthread_ctx_shared_stop(void);
+
+/*
+ * uthread_ctx_init_shared - Initialize a thread context on the shared stack
+ * @uctx: Pointer to thread context to initialize
+ * @func: Function to be executed by the thread
+ *
+ * When such a context is switched out and another one needs the shared stack,
+ * the used part of its stack is copied into a private buffer sized to fit, and
+ * copied back when it is switched in again. As a consequence, the address of
+ * an object on the stack of such a thread must not be used by another thread.
+ *
+ * Return: 0 if @uctx was properly initialized, or -1 in case of failure
+ */
+int uthread_ctx_init_shared(uthread_ctx_t *uctx, uthread_func_t func);
+
+/*
+ * uthread_ctx_release - Release a context that will not be resumed anymore
+ * @uctx: Pointer to thread context to release
+ *
+ * Free the resources attached to @uctx other than its stack segment. @uctx can
+ * be the currently running context, as long as it is not switched to anymore.
+ */
+void uthread_ctx_release(uthread_ctx_t *uctx);
+
+/**
+ * Private scheduler API
+ */
+
+/*
+ * uthread_ready_threads - Number of threads ready to run
+ *
+ * Return: Number of threads waiting in the ready queue, not counting the
+ * currently running thread
+ */
+int uthread_ready_threads(void);
+
+/*
+ * uthread_timeouts_pending - Whether threads wait for a timeout on this worker
+ *
+ * Return: 1 if timeouts were started on the calling worker and neither expired
+ * nor were cancelled yet, which the preemption timer keeps ticking for. 0
+ * otherwise.
+ */
+int uthread_timeouts_pending(void);
+
+/*
+ * uthread_switch_finish - Complete a context switch
+ *
+ * To be called, with preemption disabled, by every context first thing after
+ * being switched to. It completes the switch away from the previous thread of
+ * the worker, whose context can only be resumed by another worker once saved.
+ */
+void uthread_switch_finish(void);
+
+/* Set when threads run on the shared stack, see struct uthread_config */
+extern int use_shared_stack;
+
+struct queue_node;
+
+/*
+ * uthread_waiter - Get the wait queue link of the running thread
+ *
+ * The link is free while the thread is blocked, for the object it waits on to
+ * queue it with.
+ *
+ * Return: Link of the running thread, to pass to uthread_wake()
+ */
+struct queue_node *uthread_waiter(void);
+
+/*
+ * uthread_block - Block the running thread
+ * @lock: Spinlock held by the caller, or NULL
+ *
+ * To be called with preemption disabled, once, and held only once. The thread
+ * is switched out until made ready by uthread_wake(). @lock, which typically
+ * protects the wait queue the thread was put in, is released only once the
+ * thread is switched out, so that a waker taking it can't make the thread
+ * ready before its context is saved.
+ */
+void uthread_block(int *lock);
+
+/*
+ * uthread_wake - Make a blocked thread ready
+ * @waiter: Link of the thread, from uthread_waiter()
+ * @yield: Whether to switch to the thread right away
+ *
+ * To be called with preemption disabled, once, after taking @waiter out of its
+ * wait queue. When @yield is set, the calling thread is put in the ready
+ * queue, and the woken thread runs in its place without going through it.
+ */
+void uthread_wake(struct queue_node *waiter, int yield);
+
+/*
+ * uthread_timeout_func_t - Function called when a thread's timeout expires
+ * @waiter: Link of the thread, from uthread_waiter()
+ * @arg: Argument passed to uthread_timeout_start()
+ *
+ * Called with preemption disabled, by the worker the timeout was started on,
+ * once the thread is switched out. The thread may have been woken up already,
+ * which the function must find out, typically by taking the thread out of its
+ * wait queue under the lock it blocked with, before waking it up itself.
+ *
+ * Return: 1 if the thread was woken up by the function. 0 otherwise.
+ */
+typedef int (*uthread_timeout_func_t)(struct queue_node *waiter, void *arg);
+
+/*
+ * uthread_timeout_start - Start a timeout for the running thread
+ * @timeout_ns: Time after which @func is called (in nanoseconds)
+ * @func: Function to call
+ * @arg: Argument to pass to @func
+ *
+ * To be called with preemption disabled, right before blocking, so that the
+ * timeout can't expire before the thread is switched out. Every timeout
+ * started must be cancelled by uthread_timeout_cancel() once the thread is
+ * woken up.
+ */
+void uthread_timeout_start(uint64_t timeout_ns, uthread_timeout_func_t func, void *arg);
+
+/*
+ * uthread_timeout_cancel - Cancel the running thread's timeout
+ *
+ * To be called with preemption disabled. If the timeout is expiring, waits for
+ * its function to return.
+ *
+ * Return: 1 if the timeout's function woke the thread up. 0 otherwise.
+ */
+int uthread_timeout_cancel(void);
+
+/*
+ * uthread_preempt_yield - Forcefully yield the running thread
+ *
+ * Called by the preemption timer, with preemption enabled, when the running
+ * thread used up its quantum. Unlike uthread_yield(), this counts against the
+ * thread's priority level with the UTHREAD_SCHED_MLFQ policy.
+ */
+void uthread_preempt_yield(void);
+
+/*
+ * uthread_running_stack - Get the thread running on the calling kernel thread
+ * @tid: Address receiving the thread's TID
+ * @stack: Address receiving the lowest address of the thread's stack
+ * @size: Address receiving the size of the thread's stack
+ *
+ * Safe to call from a signal handler. The stack is reported empty for main and
+ * for threads running on the shared stack, whose stacks the library didn't
+ * allocate.
+ *
+ * Return: -1 if the kernel thread is not a worker, or is idle. 0 otherwise.
+ */
+int uthread_running_stack(uthread_t *tid, void **stack, size_t *size);
+
+
+/**
+ * Spinlocks
+ *
+ * Protect scheduler data shared between the kernel threads of an M:N setup. A
+ * spinlock must only be taken with preemption disabled, and only held for a
+ * short while. Spinning gives the CPU away after a while, in case the holder
+ * got descheduled by the kernel.
+ */
+#include <sched.h>
+
+#define SPIN_TRIES 128
+
+static inline void spin_relax(void)
+{
+#if defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+static inline void spin_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		int tries = 0;
+
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+			if (++tries < SPIN_TRIES) {
+				spin_relax();
+			} else {
+				sched_yield();
+				tries = 0;
+			}
+		}
+	}
+}
+
+static inline void spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 
 /**
@@ -67,11 +354,37 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 
 /*
  * preempt_start - Start thread preemption
+ * @config: Library configuration (quantum, clock, tickless and workers
+ *	settings)
  *
- * Configure a timer that must fire a virtual alarm at a frequency of 100 Hz and
- * setup a timer handler that forcefully yields the currently running thread.
+ * Setup a timer handler that forcefully yields the currently running thread,
+ * and start the timer of the calling kernel thread, worker 0. Every worker has
+ * a timer of its own, which fires an alarm at the worker's kernel thread once
+ * per quantum, measured in CPU time of that kernel thread or in wall-clock
+ * time.
+ *
+ * In tickless mode, a tick finding no other thread ready to run on its worker
+ * stops the timer, and preempt_rearm() starts it again.
+ *
+ * Return: 0 in case of success, -1 in case of failure
  */
-void preempt_start(void);
+int preempt_start(const struct uthread_config *config);
+
+/*
+ * preempt_start_worker - Start the timer of a worker
+ * @worker: Index of the worker, running on the calling kernel thread
+ *
+ * To be called by the kernel thread of every worker but worker 0, after
+ * preempt_start().
+ *
+ * Return: 0 in case of success, -1 in case of failure
+ */
+int preempt_start_worker(unsigned int worker);
+
+/*
+ * preempt_stop_worker - Stop the timer of the calling kernel thread's worker
+ */
+void preempt_stop_worker(void);
 
 /*
  * preempt_stop - Stop thread preemption
@@ -81,14 +394,240 @@ void preempt_start(void);
  */
 void preempt_stop(void);
 
+/*
+ * preempt_rearm - Restart a timer stopped in tickless mode
+ * @worker: Index of the worker whose timer to restart
+ *
+ * To be called, with preemption disabled, when a thread becomes ready on
+ * @worker while it might be the only one besides the running thread. This
+ * costs a system call only if the timer was actually stopped.
+ */
+void preempt_rearm(unsigned int worker);
+
 /*
  * preempt_enable - Enable preemption
+ *
+ * Leave a critical section opened by preempt_disable(). When leaving the
+ * outermost one, if a timer tick was missed in the meantime, the currently
+ * running thread is forcefully yielded right away.
  */
 void preempt_enable(void);
 
 /*
  * preempt_disable - Disable preemption
+ *
+ * Enter a critical section, during which timer ticks do not yield the running
+ * thread but are only recorded. Critical sections nest, and no system call is
+ * involved in entering or leaving them.
+ *
+ * A thread switching to another one does so with preemption disabled, and the
+ * thread being switched to is the one re-enabling it. The critical section
+ * count is kept per kernel thread, which works out as threads only ever switch
+ * with a count of one, whatever kernel thread they resume on.
  */
 void preempt_disable(void);
 
+
+/**
+ * Private I/O reactor API
+ */
+
+/*
+ * io_start - Start the I/O reactor
+ * @uring_entries: Size of the io_uring submission ring, 0 for none
+ *
+ * The ring is optional: if io_uring is unavailable, its operations take the
+ * synchronous path.
+ *
+ * Return: -1 in case of failure when creating the epoll instance. 0 otherwise.
+ */
+int io_start(unsigned int uring_entries);
+
+/*
+ * io_stop - Stop the I/O reactor
+ *
+ * No thread may be waiting for I/O.
+ */
+void io_stop(void);
+
+/*
+ * io_waiting - Number of threads blocked waiting for I/O
+ *
+ * Return: Number of threads the reactor may have to wake up
+ */
+int io_waiting(void);
+
+/*
+ * io_poll - Wake up threads whose file descriptors are ready
+ * @timeout_ns: Maximum time to wait for readiness (in nanoseconds), 0 to only
+ *	check, -1 to wait until a descriptor is ready or io_interrupt() is called
+ *
+ * To be called with preemption disabled. Woken threads are made ready on the
+ * calling worker.
+ *
+ * Return: Number of threads woken up
+ */
+int io_poll(long timeout_ns);
+
+/*
+ * io_interrupt - Get io_poll() to return
+ *
+ * Makes a worker waiting in io_poll(), or the next one to call it, return
+ * right away.
+ */
+void io_interrupt(void);
+
+
+/**
+ * Private io_uring API
+ */
+
+/*
+ * uring_start - Set up the io_uring instance
+ * @entries: Size of the submission ring
+ *
+ * Return: File descriptor of the ring, readable while it has completions to
+ * reap. -1 if io_uring is unavailable.
+ */
+int uring_start(unsigned int entries);
+
+/*
+ * uring_stop - Tear down the io_uring instance
+ *
+ * No thread may be waiting for an operation.
+ */
+void uring_stop(void);
+
+/*
+ * uring_waiting - Number of threads waiting for an operation to complete
+ */
+int uring_waiting(void);
+
+/*
+ * uring_queued - Whether operations are queued and not submitted yet
+ */
+int uring_queued(void);
+
+/*
+ * uring_submit - Submit the queued operations
+ *
+ * To be called with preemption disabled, and without holding a lock threads
+ * block with.
+ */
+void uring_submit(void);
+
+/*
+ * uring_reap - Wake up threads whose operations completed
+ *
+ * To be called with preemption disabled. Woken threads are made ready on the
+ * calling worker.
+ *
+ * Return: Number of threads woken up
+ */
+int uring_reap(void);
+
+
+/**
+ * Private tracing API
+ */
+
+/*
+ * Scheduler events, recorded by the worker they happen on. @tid is the thread
+ * the event is about, and @arg:
+ * - TRACE_CREATE: @tid created by thread @arg
+ * - TRACE_WAKE: @tid made ready by thread @arg
+ * - TRACE_YIELD, TRACE_PREEMPT, TRACE_BLOCK, TRACE_EXIT: @tid is about to be
+ *   switched out for that reason (unless nothing else is ready to run after a
+ *   yield or preemption)
+ * - TRACE_SWITCH: @tid switched to from thread @arg, either being
+ *   TRACE_IDLE for the worker's scheduling loop
+ */
+enum
+{
+	TRACE_CREATE,
+	TRACE_WAKE,
+	TRACE_YIELD,
+	TRACE_PREEMPT,
+	TRACE_BLOCK,
+	TRACE_EXIT,
+	TRACE_SWITCH,
+};
+
+#define TRACE_IDLE ((uthread_t) -1)
+
+/* Set while events are recorded, see uthread_trace_enable() */
+extern int trace_enabled;
+
+/*
+ * trace_start - Allocate the trace buffers
+ * @workers: Number of workers
+ * @events: Number of events kept per worker, 0 for no tracing at all
+ *
+ * Return: -1 in case of failure when allocating. 0 otherwise.
+ */
+int trace_start(unsigned int workers, size_t events);
+
+/*
+ * trace_stop - Disable tracing and free the trace buffers
+ */
+void trace_stop(void);
+
+/*
+ * trace_record - Record an event
+ * @worker: Index of the calling worker
+ * @type: Type of event
+ * @tid: Thread the event is about
+ * @arg: Detail of the event, depending on @type
+ *
+ * To be called with preemption disabled, through trace_event().
+ */
+void trace_record(unsigned int worker, int type, uthread_t tid, uthread_t arg);
+
+/*
+ * trace_event - Record an event if tracing is enabled
+ *
+ * A macro, so that nothing but the flag is looked at while tracing is
+ * disabled.
+ */
+#define trace_event(worker, type, tid, arg)					\
+do {										\
+	if (__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) \
+		trace_record(worker, type, tid, arg);				\
+} while (0)
+
+
+/**
+ * Private profiling API
+ */
+
+/* Set while samples are taken, see uthread_profile_enable() */
+extern int profile_enabled;
+
+/*
+ * profile_start - Allocate the sample buffers
+ * @workers: Number of workers
+ * @samples: Number of samples kept per worker, 0 for no profiling at all
+ *
+ * To be called by main.
+ *
+ * Return: -1 in case of failure when allocating. 0 otherwise.
+ */
+int profile_start(unsigned int workers, size_t samples);
+
+/*
+ * profile_stop - Disable profiling and free the sample buffers
+ *
+ * To be called once the preemption timers are stopped.
+ */
+void profile_stop(void);
+
+/*
+ * profile_record - Sample the running thread
+ * @worker: Index of the calling worker
+ * @ucontext: Context the preemption signal interrupted
+ *
+ * To be called from the preemption signal handler, while profiling is enabled.
+ */
+void profile_record(unsigned int worker, const void *ucontext);
+
 #endif /* _UTHREAD_PRIVATE_H */
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include "private.h"
+#include "uthread.h"
+
+#define CACHE_LINE 64
+
+// Frames kept per sample, the interrupted one included.
+#define PROFILE_DEPTH 16
+
+// Longest line of folded stacks, longer ones are cut at the last whole frame.
+#define PROFILE_LINE_MAX 4096
+
+struct profile_sample
+{
+	uthread_t tid;
+	unsigned int depth;
+	// Interrupted PC, then return addresses, innermost first.
+	uintptr_t frames[PROFILE_DEPTH];
+};
+
+// Samples of a worker, only taken by the worker itself from the preemption
+// handler. Readers take the samples published by count, which never goes
+// past size: once full, further samples are dropped.
+struct profile_buffer
+{
+	size_t count;
+	size_t size;
+	struct profile_sample *samples;
+} __attribute__((aligned(CACHE_LINE)));
+
+int profile_enabled;
+
+static struct profile_buffer *profile_buffers;
+static unsigned int profile_workers;
+
+// Stack main runs on, which isn't one the library allocated.
+static uintptr_t main_stack_low;
+static uintptr_t main_stack_high;
+
+int profile_start(unsigned int workers, size_t samples)
+{
+	pthread_attr_t attr;
+	void *stack;
+	size_t size;
+
+	profile_enabled = 0;
+	profile_buffers = NULL;
+	if (samples == 0)
+		return 0;
+	profile_buffers = aligned_alloc(CACHE_LINE, workers * sizeof(struct profile_buffer));
+	if (profile_buffers == NULL)
+		return -1;
+	profile_workers = workers;
+	for (unsigned int i = 0; i < workers; i++)
+	{
+		profile_buffers[i].count = 0;
+		profile_buffers[i].size = samples;
+		profile_buffers[i].samples = calloc(samples, sizeof(struct profile_sample));
+		if (profile_buffers[i].samples == NULL)
+		{
+			profile_workers = i;
+			profile_stop();
+			return -1;
+		}
+	}
+
+	// Called by main, find out where its stack is. Without knowing, its
+	// samples only get the interrupted PC.
+	main_stack_low = main_stack_high = 0;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0)
+	{
+		if (pthread_attr_getstack(&attr, &stack, &size) == 0)
+		{
+			main_stack_low = (uintptr_t) stack;
+			main_stack_high = main_stack_low + size;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	return 0;
+}
+
+void profile_stop(void)
+{
+	__atomic_store_n(&profile_enabled, 0, __ATOMIC_RELAXED);
+	if (profile_buffers == NULL)
+		return;
+	for (unsigned int i = 0; i < profile_workers; i++)
+		free(profile_buffers[i].samples);
+	free(profile_buffers);
+	profile_buffers = NULL;
+}
+
+void profile_record(unsigned int worker, const void *ucontext)
+{
+	struct profile_buffer *buffer = &profile_buffers[worker];
+	const ucontext_t *uc = ucontext;
+	size_t count = buffer->count;
+	struct profile_sample *sample;
+	uintptr_t pc, fp, sp, low, high;
+	void *stack;
+	size_t size;
+
+	if (count == buffer->size)
+		return;
+	sample = &buffer->samples[count];
+	if (uthread_running_stack(&sample->tid, &stack, &size))
+		return;
+	low = (uintptr_t) stack;
+	high = low + size;
+	if (sample->tid == 0)
+	{
+		low = main_stack_low;
+		high = main_stack_high;
+	}
+
+#if defined(__x86_64__)
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+	sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+	pc = uc->uc_mcontext.pc;
+	fp = uc->uc_mcontext.regs[29];
+	sp = uc->uc_mcontext.sp;
+#else
+	(void) uc;
+	return;
+#endif
+
+	// Every frame starts with the caller's frame pointer, followed by the
+	// return address. Code built without frame pointers leaves anything in
+	// the register, so only follow it while it points up the thread's own
+	// stack, which is all mapped. That also stops the walk in the middle of
+	// a switch, when the stack isn't yet the running thread's.
+	sample->frames[0] = pc;
+	sample->depth = 1;
+	while (sample->depth < PROFILE_DEPTH && fp >= sp && fp >= low &&
+	       fp + 2 * sizeof(uintptr_t) <= high && fp % sizeof(uintptr_t) == 0)
+	{
+		uintptr_t *frame = (uintptr_t *) fp;
+		if (frame[1] == 0)
+			break;
+		sample->frames[sample->depth++] = frame[1];
+		sp = fp + 2 * sizeof(uintptr_t);
+		fp = frame[0];
+	}
+	__atomic_store_n(&buffer->count, count + 1, __ATOMIC_RELEASE);
+}
+
+int uthread_profile_enable(int enable)
+{
+	if (profile_buffers == NULL)
+		return -1;
+	__atomic_store_n(&profile_enabled, enable != 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// Write the name of the function at @pc: its symbol if the dynamic symbol
+// table has one, its offset in the object it's in otherwise.
+static int profile_symbol(char *buf, size_t len, uintptr_t pc)
+{
+	Dl_info info;
+
+	if (dladdr((void *) pc, &info) == 0 || info.dli_fname == NULL)
+		return snprintf(buf, len, "0x%lx", (unsigned long) pc);
+	if (info.dli_sname != NULL)
+		return snprintf(buf, len, "%s", info.dli_sname);
+	const char *name = strrchr(info.dli_fname, '/');
+	return snprintf(buf, len, "%s+0x%lx", name != NULL ? name + 1 : info.dli_fname,
+			(unsigned long) (pc - (uintptr_t) info.dli_fbase));
+}
+
+// Fold a sample into a line: the thread, then its frames outermost first.
+static char *profile_fold(const struct profile_sample *sample)
+{
+	char line[PROFILE_LINE_MAX];
+	size_t len;
+
+	if (sample->tid == 0)
+		len = snprintf(line, sizeof(line), "main");
+	else
+		len = snprintf(line, sizeof(line), "uthread %u", sample->tid);
+	for (unsigned int i = sample->depth; i-- > 0;)
+	{
+		// A return address is past the call, look up the call itself.
+		uintptr_t pc = i ? sample->frames[i] - 1 : sample->frames[i];
+		size_t left = sizeof(line) - len;
+		int n = snprintf(line + len, left, ";");
+		n += profile_symbol(line + len + n, left - n, pc);
+		if ((size_t) n >= left)
+			break;
+		len += n;
+	}
+	line[len] = '\0';
+	return strdup(line);
+}
+
+static int profile_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+int uthread_profile_dump(const char *path)
+{
+	char **lines;
+	size_t total = 0, count = 0;
+	FILE *file;
+	int ret = -1;
+
+	if (profile_buffers == NULL)
+		return -1;
+	for (unsigned int i = 0; i < profile_workers; i++)
+		total += profile_buffers[i].size;
+	lines = malloc(total * sizeof(*lines));
+	if (lines == NULL)
+		return -1;
+
+	for (unsigned int i = 0; i < profile_workers; i++)
+	{
+		struct profile_buffer *buffer = &profile_buffers[i];
+		size_t taken = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+
+		for (size_t j = 0; j < taken; j++)
+		{
+			lines[count] = profile_fold(&buffer->samples[j]);
+			if (lines[count] == NULL)
+				goto out;
+			count++;
+		}
+	}
+
+	// Identical stacks end up next to each other, one line for each.
+	qsort(lines, count, sizeof(*lines), profile_compare);
+	file = fopen(path, "w");
+	if (file == NULL)
+		goto out;
+	for (size_t i = 0, j; i < count; i = j)
+	{
+		for (j = i + 1; j < count && strcmp(lines[i], lines[j]) == 0; j++);
+		fprintf(file, "%s %zu\n", lines[i], j - i);
+	}
+	ret = ferror(file) ? -1 : 0;
+	if (fclose(file)) ret = -1;
+
+out:
+	for (size_t i = 0; i < count; i++)
+		free(lines[i]);
+	free(lines);
+	return ret;
+}
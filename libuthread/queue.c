@@ -1,40 +1,264 @@
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include "queue.h"
 
-// struct representing an entry in a queue linked list.
-struct q_entry {
-	// Generic pointer for the entry's "value."
-	void *stored_data;
-	// The next oldest and newest entries relative to the entry in the queue.
-	struct q_entry *next;
-	struct q_entry *prev;
+// Initial number of slots of a queue, a power of two.
+#define QUEUE_MIN_SIZE 8
+
+// Using a growable ring buffer implementation.
+// Items are numbered by their position since the queue was created, oldest
+// first, and stored at their position modulo the size of the buffer. Positions
+// wrap around freely, as only their differences and low bits matter.
+// Deleting an item leaves a NULL slot behind, so that deleting is O(1). The
+// oldest slot is never a deleted one, and once deleted slots make up half of
+// the used part of the buffer, the items are moved down over them rather than
+// the buffer grown.
+// The handle of an item is an entry of the reference table, which holds the
+// item's position and follows it when it moves, and the generation of the
+// entry, which changes when the item leaves the queue so that stale handles are
+// told apart. The entry of each item is kept in a second ring, allocated when
+// a handle is first taken.
+struct queue_ref {
+	// Position of the item, or index + 1 of the next free entry.
+	unsigned int pos;
+	unsigned int gen;
 };
 
-// Using linked list implementation.
 struct queue {
-	int queue_length;
-	struct q_entry *oldest;
-	struct q_entry *newest;
+	void **items;
+	unsigned int size;
+	// Positions of the oldest item and of the next one to enqueue.
+	unsigned int oldest;
+	unsigned int newest;
+	// Number of deleted slots between them.
+	unsigned int deleted;
+	// Index + 1 of the reference of the item in each slot, 0 for none.
+	unsigned int *slot_refs;
+	// Reference table: allocated and ever used entries, in use ones, and
+	// index + 1 of the first free one.
+	struct queue_ref *refs;
+	unsigned int refs_size;
+	unsigned int refs_count;
+	unsigned int refs_used;
+	unsigned int refs_free;
+	// Number of iterations in progress, during which items must not move.
+	int iterating;
 };
 
+// Slot of the item at position @pos.
+static void **queue_slot(queue_t queue, unsigned int pos)
+{
+	return &queue->items[pos & (queue->size - 1)];
+}
+
+// Reference slot of the item at position @pos.
+static unsigned int *queue_slot_ref(queue_t queue, unsigned int pos)
+{
+	return &queue->slot_refs[pos & (queue->size - 1)];
+}
+
+// Take a reference for the item about to be enqueued at position @pos.
+static int queue_ref(queue_t queue, unsigned int pos, queue_handle_t *handle)
+{
+	unsigned int index;
+
+	if (queue->slot_refs == NULL)
+	{
+		queue->slot_refs = calloc(queue->size, sizeof(unsigned int));
+		if (queue->slot_refs == NULL) return -1;
+	}
+	if (queue->refs_free)
+	{
+		index = queue->refs_free - 1;
+		queue->refs_free = queue->refs[index].pos;
+	} else {
+		if (queue->refs_count == queue->refs_size)
+		{
+			unsigned int size = queue->refs_size ? 2 * queue->refs_size : QUEUE_MIN_SIZE;
+			struct queue_ref *refs = realloc(queue->refs, size * sizeof(struct queue_ref));
+			if (refs == NULL) return -1;
+			queue->refs = refs;
+			queue->refs_size = size;
+		}
+		index = queue->refs_count++;
+		queue->refs[index].gen = 0;
+	}
+	queue->refs[index].pos = pos;
+	queue->refs_used++;
+	*queue_slot_ref(queue, pos) = index + 1;
+	*handle = (queue_handle_t) queue->refs[index].gen << 32 | index;
+	return 0;
+}
+
+// Drop the reference of the item at position @pos if it has one, which makes
+// its handle stale.
+static void queue_unref(queue_t queue, unsigned int pos)
+{
+	if (queue->refs_used == 0) return;
+	unsigned int *ref = queue_slot_ref(queue, pos);
+	if (*ref == 0) return;
+
+	struct queue_ref *entry = &queue->refs[*ref - 1];
+	entry->gen++;
+	entry->pos = queue->refs_free;
+	queue->refs_free = *ref;
+	queue->refs_used--;
+	*ref = 0;
+}
+
+// Move the oldest position past deleted slots.
+static void queue_skip_deleted(queue_t queue)
+{
+	while (queue->deleted && *queue_slot(queue, queue->oldest) == NULL)
+	{
+		queue->oldest++;
+		queue->deleted--;
+	}
+}
+
+// Delete the item at position @pos.
+static void queue_delete_pos(queue_t queue, unsigned int pos)
+{
+	queue_unref(queue, pos);
+	*queue_slot(queue, pos) = NULL;
+	queue->deleted++;
+	queue_skip_deleted(queue);
+}
+
+// Move the items down over the deleted slots, keeping their order. The oldest
+// item stays where it is.
+static void queue_compact(queue_t queue)
+{
+	unsigned int to = queue->oldest;
+
+	for (unsigned int pos = queue->oldest; pos != queue->newest; pos++)
+	{
+		void *item = *queue_slot(queue, pos);
+		if (item == NULL) continue;
+		if (pos != to)
+		{
+			*queue_slot(queue, to) = item;
+			if (queue->refs_used)
+			{
+				unsigned int ref = *queue_slot_ref(queue, pos);
+				*queue_slot_ref(queue, to) = ref;
+				*queue_slot_ref(queue, pos) = 0;
+				if (ref) queue->refs[ref - 1].pos = to;
+			}
+		}
+		to++;
+	}
+	queue->newest = to;
+	queue->deleted = 0;
+}
+
+// Copy @count items from @src to the slots of positions @pos and following,
+// wrapping around the end of the buffer.
+static void queue_copy_in(queue_t queue, unsigned int pos, void **src, unsigned int count)
+{
+	unsigned int start = pos & (queue->size - 1);
+	unsigned int first = queue->size - start < count ? queue->size - start : count;
+
+	memcpy(&queue->items[start], src, first * sizeof(void*));
+	memcpy(queue->items, src + first, (count - first) * sizeof(void*));
+}
+
+// Copy @count items from the slots of positions @pos and following to @dst.
+static void queue_copy_out(queue_t queue, unsigned int pos, void **dst, unsigned int count)
+{
+	unsigned int start = pos & (queue->size - 1);
+	unsigned int first = queue->size - start < count ? queue->size - start : count;
+
+	memcpy(dst, &queue->items[start], first * sizeof(void*));
+	memcpy(dst + first, queue->items, (count - first) * sizeof(void*));
+}
+
+// Make room for @count more items, squeezing deleted slots out if there are
+// enough of them, doubling the buffer as many times as needed otherwise.
+// Outside of compaction, which iterations hold off, items keep their
+// positions, so that an iteration in progress is unaffected.
+static int queue_reserve(queue_t queue, unsigned int count)
+{
+	unsigned int length = queue->newest - queue->oldest;
+	unsigned int old_size = queue->size, size = old_size;
+	void **old_items = queue->items;
+	unsigned int *old_refs = queue->slot_refs;
+
+	if (count > (unsigned int) INT_MAX - length) return -1;
+	if (length + count <= size) return 0;
+	if (!queue->iterating && queue->deleted && queue->deleted >= length / 2)
+	{
+		queue_compact(queue);
+		length = queue->newest - queue->oldest;
+		if (length + count <= size) return 0;
+	}
+	while (size < length + count) size *= 2;
+
+	queue->items = malloc(size * sizeof(void*));
+	if (queue->items == NULL)
+	{
+		queue->items = old_items;
+		return -1;
+	}
+	if (old_refs != NULL)
+	{
+		queue->slot_refs = calloc(size, sizeof(unsigned int));
+		if (queue->slot_refs == NULL)
+		{
+			free(queue->items);
+			queue->items = old_items;
+			queue->slot_refs = old_refs;
+			return -1;
+		}
+		for (unsigned int pos = queue->oldest; pos != queue->newest; pos++)
+			queue->slot_refs[pos & (size - 1)] = old_refs[pos & (old_size - 1)];
+	}
+	queue->size = size;
+
+	// The items wrap around the end of the old buffer at most once.
+	unsigned int start = queue->oldest & (old_size - 1);
+	unsigned int first = old_size - start < length ? old_size - start : length;
+	queue_copy_in(queue, queue->oldest, old_items + start, first);
+	queue_copy_in(queue, queue->oldest + first, old_items, length - first);
+	free(old_items);
+	free(old_refs);
+	return 0;
+}
+
 queue_t queue_create(void)
 {
 	queue_t new_queue = malloc(sizeof(struct queue));
 	if (new_queue == NULL) return NULL;
 
-	// Initialize empty entries of the queue.
-	new_queue->newest = NULL;
-	new_queue->oldest = NULL;
-	new_queue->queue_length = 0;
+	new_queue->items = malloc(QUEUE_MIN_SIZE * sizeof(void*));
+	if (new_queue->items == NULL)
+	{
+		free(new_queue);
+		return NULL;
+	}
+	new_queue->size = QUEUE_MIN_SIZE;
+	new_queue->oldest = 0;
+	new_queue->newest = 0;
+	new_queue->deleted = 0;
+	new_queue->slot_refs = NULL;
+	new_queue->refs = NULL;
+	new_queue->refs_size = 0;
+	new_queue->refs_count = 0;
+	new_queue->refs_used = 0;
+	new_queue->refs_free = 0;
+	new_queue->iterating = 0;
 	return new_queue;
 }
 
 int queue_destroy(queue_t queue)
 {
-	if (queue == NULL || queue->queue_length) return -1;
+	if (queue == NULL || queue->newest != queue->oldest) return -1;
+	free(queue->items);
+	free(queue->slot_refs);
+	free(queue->refs);
 	free(queue);
 	return 0;
 }
@@ -42,118 +266,169 @@ int queue_destroy(queue_t queue)
 int queue_enqueue(queue_t queue, void *data)
 {
 	if (queue == NULL || data == NULL) return -1;
+	if (queue->newest - queue->oldest == queue->size && queue_reserve(queue, 1))
+		return -1;
 
-	// Allocate data for the new entry.
-	struct q_entry *new_entry = malloc(sizeof(struct q_entry));
-	if (new_entry == NULL) return -1;
-
-	// Set backwards link between latest entry in queue and the new entry.
-	new_entry->prev = queue->newest;
-	// If the new entry is not the first entry, then set forward link.
-	if (new_entry->prev != NULL) new_entry->prev->next = new_entry;
+	*queue_slot(queue, queue->newest++) = data;
+	return 0;
+}
 
-	// Since entry is newest, there are no entries after it.
-	queue->newest = new_entry;
-	new_entry->next = NULL;
+int queue_enqueue_handle(queue_t queue, void *data, queue_handle_t *handle)
+{
+	if (queue == NULL || data == NULL || handle == NULL) return -1;
+	if (queue->newest - queue->oldest == queue->size && queue_reserve(queue, 1))
+		return -1;
+	if (queue_ref(queue, queue->newest, handle)) return -1;
 
-	// If first entry in queue, it is the oldest and newest entry.
-	if (queue->queue_length == 0) queue->oldest = new_entry;
+	*queue_slot(queue, queue->newest++) = data;
+	return 0;
+}
 
-	// Set entry's data address to requested data parameter.
-	new_entry->stored_data = data;
-	queue->queue_length++;
+int queue_enqueue_batch(queue_t queue, void **data, int count)
+{
+	if (queue == NULL || data == NULL || count < 0) return -1;
+	if (queue_reserve(queue, count)) return -1;
 
+	queue_copy_in(queue, queue->newest, data, count);
+	queue->newest += count;
 	return 0;
 }
 
 int queue_dequeue(queue_t queue, void **data)
 {
-	if (queue == NULL || data == NULL || queue->queue_length == 0)
+	if (queue == NULL || data == NULL || queue->newest == queue->oldest)
 		return -1;
 
-	// Placeholder for the oldest entry so we can remember to free it later.
-	struct q_entry *pop_entry = queue->oldest;
+	queue_unref(queue, queue->oldest);
+	*data = *queue_slot(queue, queue->oldest++);
+	queue_skip_deleted(queue);
+	return 0;
+}
 
-	// Set the read data to the address of the oldest entry's data.
-	*data = queue->oldest->stored_data;
+int queue_dequeue_batch(queue_t queue, void **data, int count)
+{
+	if (queue == NULL || data == NULL || count < 0) return -1;
 
-	// Pop the queue, setting the oldest entry to the second entry of the queue.
-	queue->oldest = queue->oldest->next;
-	// Make sure oldest item has nothing behind it.
-	if (queue->oldest != NULL) queue->oldest->prev = NULL;
-	// If list is now empty there are no newer items.
-	else queue->newest = NULL;
-	queue->queue_length--;
+	unsigned int length = queue->newest - queue->oldest;
+	if (queue->deleted == 0 && queue->refs_used == 0)
+	{
+		if ((unsigned int) count > length) count = length;
+		queue_copy_out(queue, queue->oldest, data, count);
+		queue->oldest += count;
+		return count;
+	}
 
-	// Deallocate the oldest entry.
-	free(pop_entry);
-	return 0;
+	// Leave deleted slots out, and drop references.
+	int received = 0;
+	while (received < count && queue_dequeue(queue, &data[received]) == 0)
+		received++;
+	return received;
 }
 
 int queue_delete(queue_t queue, void *data)
 {
 	if (queue == NULL || data == NULL) return -1;
-	// Look for the data starting from the oldest entry.
-	struct q_entry *iter_entry = queue->oldest;
-	while(iter_entry != NULL)
+	// Look for the data starting from the oldest item.
+	for (unsigned int pos = queue->oldest; pos != queue->newest; pos++)
 	{
-		if (iter_entry->stored_data == data)
+		if (*queue_slot(queue, pos) == data)
 		{
-			if (iter_entry == queue->oldest)
-			{
-				// Oldest entry, mark next entry as oldest.
-				queue->oldest = iter_entry->next;
-				if (queue->oldest != NULL) queue->oldest->prev = NULL;
-				else queue->newest = NULL;
-			} else if (iter_entry == queue->newest)
-			{
-				// Newest entry, mark previous entry as newest.
-				queue->newest = iter_entry->prev;
-				queue->newest->next = NULL;
-			} else {
-				// Middle entry, bridge the gap between the next and previous entries.
-				iter_entry->prev->next = iter_entry->next;
-				iter_entry->next->prev = iter_entry->prev;
-			}
-
-			// Delete the entry.
-			free(iter_entry);
-			queue->queue_length--;
+			queue_delete_pos(queue, pos);
 			return 0;
 		}
-		iter_entry = iter_entry->next;
 	}
-	// The loop was exited because we didn't find the data among the queue entries.
+	// We didn't find the data among the queue items.
 	return -1;
 }
 
+int queue_delete_handle(queue_t queue, queue_handle_t handle)
+{
+	unsigned int index = (unsigned int) handle;
+
+	if (queue == NULL) return -1;
+	// Dequeued, deleted, or never enqueued.
+	if (index >= queue->refs_count || queue->refs[index].gen != handle >> 32)
+		return -1;
+	queue_delete_pos(queue, queue->refs[index].pos);
+	return 0;
+}
+
 int queue_iterate(queue_t queue, queue_func_t func, void *arg, void **data)
 {
 	// Uninitialized queue or invalid function.
 	if (queue == NULL || func == NULL) return -1;
-	struct q_entry *iter_entry = queue->oldest;
-	struct q_entry *iter_next = NULL;
-	void *save_data = NULL;
-	while (iter_entry != NULL)
+	// Positions don't change when the callback deletes or enqueues items.
+	queue->iterating++;
+	for (unsigned int pos = queue->oldest; pos != queue->newest; pos++)
 	{
-		// Store the next entry to iterate in case the current gets deleted.
-		iter_next = iter_entry->next;
-		// Store the current entry's data in case we return 1 following a deletion.
-		save_data = iter_entry->stored_data;
-		// If callback function returns 1, set address of data argument to address of current entry's data.
-		if (func(queue, iter_entry->stored_data, arg) == 1)
+		// Skip items the callback dequeued.
+		if ((int) (pos - queue->oldest) < 0) pos = queue->oldest;
+		if (pos == queue->newest) break;
+		void *item = *queue_slot(queue, pos);
+		if (item == NULL) continue;
+		// If callback function returns 1, set address of data argument to the current item.
+		if (func(queue, item, arg) == 1)
 		{
-			if (data != NULL) *data = save_data;
+			if (data != NULL) *data = item;
 			break;
 		}
-		iter_entry = iter_next;
 	}
+	queue->iterating--;
 	return 0;
 }
 
 int queue_length(queue_t queue)
 {
 	if (queue == NULL) return -1;
-	return queue->queue_length;
+	return queue->newest - queue->oldest - queue->deleted;
+}
+
+void iqueue_init(struct iqueue *queue)
+{
+	// The head links to itself when the queue is empty.
+	queue->head.next = &queue->head;
+	queue->head.prev = &queue->head;
+	queue->length = 0;
+}
+
+int iqueue_enqueue(struct iqueue *queue, struct queue_node *node)
+{
+	if (queue == NULL || node == NULL) return -1;
+
+	// Link the node between the newest node and the head.
+	node->next = &queue->head;
+	node->prev = queue->head.prev;
+	queue->head.prev->next = node;
+	queue->head.prev = node;
+	queue->length++;
+	return 0;
+}
+
+int iqueue_dequeue(struct iqueue *queue, struct queue_node **node)
+{
+	if (queue == NULL || node == NULL || queue->length == 0)
+		return -1;
+
+	*node = queue->head.next;
+	return iqueue_delete(queue, *node);
+}
+
+int iqueue_delete(struct iqueue *queue, struct queue_node *node)
+{
+	// Unlinked nodes have no neighbors.
+	if (queue == NULL || node == NULL || node->next == NULL) return -1;
+
+	// Bridge the gap between the previous and next nodes.
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = NULL;
+	node->prev = NULL;
+	queue->length--;
+	return 0;
 }
 
+int iqueue_length(struct iqueue *queue)
+{
+	if (queue == NULL) return -1;
+	return queue->length;
+}
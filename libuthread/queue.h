@@ -1,6 +1,9 @@
 #ifndef _QUEUE_H
 #define _QUEUE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /*
  * queue_t - Queue type
  *
@@ -9,9 +12,23 @@
  * first and so on.
  *
  * Apart from delete and iterate operations, all operations should be O(1).
+ * Items are stored contiguously in a ring buffer, which doubles in size when
+ * full and never shrinks, so enqueueing is amortized O(1) and only allocates
+ * memory when growing. Deleted items leave a gap until the buffer is full, at
+ * which point the gaps are squeezed out instead of the buffer grown if they
+ * take half of it, so that the buffer stays within twice the largest number of
+ * items the queue held. Batch operations move many items at once.
  */
 typedef struct queue* queue_t;
 
+/*
+ * queue_handle_t - Queue item handle type
+ *
+ * Opaque reference to an item of a queue, valid until the item is dequeued or
+ * deleted. Stale handles are told apart from live ones.
+ */
+typedef uint64_t queue_handle_t;
+
 /*
  * queue_create - Allocate an empty queue
  *
@@ -45,6 +62,37 @@ int queue_destroy(queue_t queue);
  */
 int queue_enqueue(queue_t queue, void *data);
 
+/*
+ * queue_enqueue_handle - Enqueue data item and get a handle to it
+ * @queue: Queue in which to enqueue item
+ * @data: Address of data item to enqueue
+ * @handle: Address where the handle of the item is received
+ *
+ * Same as queue_enqueue(), and also sets @handle so that the item can be
+ * deleted with queue_delete_handle().
+ *
+ * Return: -1 if @queue, @data or @handle are NULL, or in case of memory
+ * allocation error when enqueing. 0 if @data was successfully enqueued in
+ * @queue.
+ */
+int queue_enqueue_handle(queue_t queue, void *data, queue_handle_t *handle);
+
+/*
+ * queue_enqueue_batch - Enqueue several data items
+ * @queue: Queue in which to enqueue items
+ * @data: Array of the addresses of the data items to enqueue
+ * @count: Number of items in @data
+ *
+ * Enqueue the @count addresses contained in @data in the queue @queue, in
+ * order, as if by as many calls to queue_enqueue(). The addresses are not
+ * checked against NULL, which must not be enqueued.
+ *
+ * Return: -1 if @queue or @data are NULL, if @count is negative, or in case of
+ * memory allocation error when enqueing, in which case nothing is enqueued. 0
+ * if the items were successfully enqueued in @queue.
+ */
+int queue_enqueue_batch(queue_t queue, void **data, int count);
+
 /*
  * queue_dequeue - Dequeue data item
  * @queue: Queue in which to dequeue item
@@ -58,6 +106,20 @@ int queue_enqueue(queue_t queue, void *data);
  */
 int queue_dequeue(queue_t queue, void **data);
 
+/*
+ * queue_dequeue_batch - Dequeue several data items
+ * @queue: Queue in which to dequeue items
+ * @data: Array where items are received
+ * @count: Maximum number of items to dequeue, the size of @data
+ *
+ * Remove up to @count of the oldest items of queue @queue and store them in
+ * @data, oldest first.
+ *
+ * Return: -1 if @queue or @data are NULL, or if @count is negative. Number of
+ * items received in @data otherwise, less than @count only if @queue ran out.
+ */
+int queue_dequeue_batch(queue_t queue, void **data, int count);
+
 /*
  * queue_delete - Delete data item
  * @queue: Queue in which to delete item
@@ -71,6 +133,19 @@ int queue_dequeue(queue_t queue, void **data);
  */
 int queue_delete(queue_t queue, void *data);
 
+/*
+ * queue_delete_handle - Delete data item by handle
+ * @queue: Queue in which to delete item
+ * @handle: Handle of the item, from queue_enqueue_handle()
+ *
+ * Delete the item of queue @queue referred to by @handle, in O(1), unlike
+ * queue_delete() which has to look for it.
+ *
+ * Return: -1 if @queue is NULL, or if the item of @handle was already dequeued
+ * or deleted. 0 if the item was deleted from @queue.
+ */
+int queue_delete_handle(queue_t queue, queue_handle_t handle);
+
 /*
  * queue_func_t - Queue callback function type
  * @queue: Queue to which item belongs
@@ -113,4 +188,84 @@ int queue_iterate(queue_t queue, queue_func_t func, void *arg, void **data);
  */
 int queue_length(queue_t queue);
 
+/*
+ * Intrusive queues
+ *
+ * An intrusive queue has the same FIFO semantics as queue_t, but links items
+ * through a struct queue_node that the caller embeds in each of them instead of
+ * allocating an entry per item. Both the queue and the nodes are owned by the
+ * caller, so no operation allocates memory or can fail for lack of it, and
+ * all of them, delete included, are O(1).
+ *
+ * A node can only be in one intrusive queue at a time.
+ */
+
+/*
+ * struct queue_node - Intrusive queue link
+ */
+struct queue_node {
+	struct queue_node *next;
+	struct queue_node *prev;
+};
+
+/*
+ * struct iqueue - Intrusive queue
+ */
+struct iqueue {
+	struct queue_node head;
+	int length;
+};
+
+/*
+ * queue_entry - Get the item containing a node
+ * @node: Address of the node
+ * @type: Type of the item
+ * @member: Name of the node member within @type
+ */
+#define queue_entry(node, type, member) \
+	((type *) ((char *) (node) - offsetof(type, member)))
+
+/*
+ * iqueue_init - Initialize an empty intrusive queue
+ * @queue: Queue to initialize
+ */
+void iqueue_init(struct iqueue *queue);
+
+/*
+ * iqueue_enqueue - Enqueue node
+ * @queue: Queue in which to enqueue node
+ * @node: Node to enqueue, which must not be in a queue already
+ *
+ * Return: -1 if @queue or @node are NULL. 0 if @node was enqueued in @queue.
+ */
+int iqueue_enqueue(struct iqueue *queue, struct queue_node *node);
+
+/*
+ * iqueue_dequeue - Dequeue node
+ * @queue: Queue in which to dequeue node
+ * @node: Address of node pointer where the oldest node is received
+ *
+ * Return: -1 if @queue or @node are NULL, or if the queue is empty. 0 if @node
+ * was set with the oldest node of @queue.
+ */
+int iqueue_dequeue(struct iqueue *queue, struct queue_node **node);
+
+/*
+ * iqueue_delete - Delete node
+ * @queue: Queue in which to delete node
+ * @node: Node to delete
+ *
+ * Return: -1 if @queue or @node are NULL, or if @node is not in a queue. 0 if
+ * @node was removed from @queue.
+ */
+int iqueue_delete(struct iqueue *queue, struct queue_node *node);
+
+/*
+ * iqueue_length - Intrusive queue length
+ * @queue: Queue to get the length of
+ *
+ * Return: -1 if @queue is NULL. Length of @queue otherwise.
+ */
+int iqueue_length(struct iqueue *queue);
+
 #endif /* _QUEUE_H */
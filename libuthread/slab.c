@@ -0,0 +1,77 @@
+#include <stdlib.h>
+
+#include "slab.h"
+
+// Size of the slab header, which holds the link to the next slab.
+static size_t slab_header_size(size_t align)
+{
+	return (sizeof(void*) + align - 1) & ~(align - 1);
+}
+
+int slab_init(struct slab_cache *cache, size_t object_size, size_t align,
+	      unsigned int per_slab)
+{
+	if (align == 0 || (align & (align - 1)) || per_slab == 0) return -1;
+
+	// Objects must be able to hold the free list link, and stay aligned when
+	// laid out back to back.
+	if (object_size < sizeof(void*)) object_size = sizeof(void*);
+	if (align < sizeof(void*)) align = sizeof(void*);
+	cache->object_size = (object_size + align - 1) & ~(align - 1);
+	cache->align = align;
+	cache->slab_size = slab_header_size(align) + cache->object_size * per_slab;
+	cache->free = NULL;
+	cache->slabs = NULL;
+	return 0;
+}
+
+// Carve a new slab into objects and add them to the free list.
+static int slab_grow(struct slab_cache *cache)
+{
+	char *slab = aligned_alloc(cache->align, cache->slab_size);
+	char *first, *object;
+
+	if (slab == NULL) return -1;
+	*(void**) slab = cache->slabs;
+	cache->slabs = slab;
+
+	// Chain objects backwards, so that they are handed out in address order.
+	first = slab + slab_header_size(cache->align);
+	object = slab + cache->slab_size;
+	while (object != first)
+	{
+		object -= cache->object_size;
+		*(void**) object = cache->free;
+		cache->free = object;
+	}
+	return 0;
+}
+
+void *slab_alloc(struct slab_cache *cache)
+{
+	void *object;
+
+	if (cache->free == NULL && slab_grow(cache)) return NULL;
+	object = cache->free;
+	cache->free = *(void**) object;
+	return object;
+}
+
+void slab_free(struct slab_cache *cache, void *object)
+{
+	if (object == NULL) return;
+	*(void**) object = cache->free;
+	cache->free = object;
+}
+
+void slab_destroy(struct slab_cache *cache)
+{
+	void *slab;
+
+	while ((slab = cache->slabs) != NULL)
+	{
+		cache->slabs = *(void**) slab;
+		free(slab);
+	}
+	cache->free = NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+
+/*
+ * struct slab_cache - Object cache
+ *
+ * A slab cache hands out fixed-size objects carved from large chunks of memory
+ * (slabs), and keeps freed objects in a free list for reuse instead of giving
+ * them back to the system. Objects are aligned on the requested boundary,
+ * typically a cache line, and objects allocated one after the other are close
+ * to each other in memory.
+ *
+ * Slabs are only released when the whole cache is destroyed.
+ */
+struct slab_cache {
+	size_t object_size;
+	size_t align;
+	size_t slab_size;
+	/* Free objects, chained through their first word */
+	void *free;
+	/* Slabs, chained through their header */
+	void *slabs;
+};
+
+/*
+ * slab_init - Initialize a slab cache
+ * @cache: Cache to initialize
+ * @object_size: Size of the objects (in bytes)
+ * @align: Alignment of the objects, a power of two
+ * @per_slab: Number of objects carved out of each slab
+ *
+ * Return: -1 if @align is not a power of two or if @per_slab is 0. 0 if @cache
+ * was initialized.
+ */
+int slab_init(struct slab_cache *cache, size_t object_size, size_t align,
+	      unsigned int per_slab);
+
+/*
+ * slab_alloc - Allocate an object
+ * @cache: Cache from which to allocate
+ *
+ * Return: Pointer to an uninitialized object, or NULL in case of failure when
+ * allocating a new slab.
+ */
+void *slab_alloc(struct slab_cache *cache);
+
+/*
+ * slab_free - Free an object
+ * @cache: Cache from which the object was allocated
+ * @object: Object to free
+ */
+void slab_free(struct slab_cache *cache, void *object);
+
+/*
+ * slab_destroy - Release all the memory of a slab cache
+ * @cache: Cache to destroy
+ *
+ * All the objects allocated from @cache become invalid.
+ */
+void slab_destroy(struct slab_cache *cache);
+
+#endif /* _SLAB_H */
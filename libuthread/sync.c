@@ -0,0 +1,350 @@
+#include <stdlib.h>
+
+#include "private.h"
+#include "queue.h"
+#include "uthread.h"
+
+// Threads blocked waiting for a synchronization object, protected by lock.
+// Releasing a mutex or semaphore while a thread is about to wait for it, that
+// is has found it taken but isn't queued yet, leaves it a hand-over to take
+// instead of blocking.
+struct waitq
+{
+	int lock;
+	int handoffs;
+	struct iqueue waiters;
+};
+
+// A mutex's state counts the threads holding it or wanting it, so that
+// locking an unlocked mutex and unlocking a mutex nobody else wants are a
+// single atomic operation.
+struct uthread_mutex
+{
+	int state;
+	struct waitq queue;
+};
+
+// A semaphore's count is the number of resources available when positive, and
+// minus the number of threads wanting one otherwise.
+struct uthread_sem
+{
+	int count;
+	struct waitq queue;
+};
+
+struct uthread_cond
+{
+	struct waitq queue;
+};
+
+static void waitq_init(struct waitq *queue)
+{
+	queue->lock = 0;
+	queue->handoffs = 0;
+	iqueue_init(&queue->waiters);
+}
+
+// A waiter's timeout: unless handed the object meanwhile, it gives up.
+static int waitq_expired(struct queue_node *waiter, void *arg)
+{
+	struct waitq *queue = arg;
+	int queued;
+
+	spin_lock(&queue->lock);
+	queued = iqueue_delete(&queue->waiters, waiter) == 0;
+	spin_unlock(&queue->lock);
+	if (queued) uthread_wake(waiter, 0);
+	return queued;
+}
+
+// Block until handed the object, which the caller found taken, or until
+// @timeout_ns elapsed if @timed.
+// Return: 1 if timed out. 0 otherwise.
+static int waitq_wait(struct waitq *queue, int timed, uint64_t timeout_ns)
+{
+	int timed_out = 0;
+
+	preempt_disable();
+	spin_lock(&queue->lock);
+	if (queue->handoffs)
+	{
+		// Released meanwhile.
+		queue->handoffs--;
+		spin_unlock(&queue->lock);
+	} else {
+		iqueue_enqueue(&queue->waiters, uthread_waiter());
+		if (timed)
+			uthread_timeout_start(timeout_ns, waitq_expired, queue);
+		uthread_block(&queue->lock);
+		if (timed)
+			timed_out = uthread_timeout_cancel();
+	}
+	preempt_enable();
+	return timed_out;
+}
+
+// Take the hand-over meant for a waiter which gave up too late: the object was
+// released after the waiter timed out, but before it stopped wanting it.
+static void waitq_take_handoff(struct waitq *queue)
+{
+	for (;;)
+	{
+		preempt_disable();
+		spin_lock(&queue->lock);
+		if (queue->handoffs)
+		{
+			queue->handoffs--;
+			spin_unlock(&queue->lock);
+			preempt_enable();
+			return;
+		}
+		spin_unlock(&queue->lock);
+		preempt_enable();
+		// The releasing thread may be waiting to run.
+		uthread_yield();
+	}
+}
+
+// Hand the object over to the oldest waiter, which the caller found wanting it.
+static void waitq_handoff(struct waitq *queue, int yield)
+{
+	struct queue_node *waiter;
+
+	preempt_disable();
+	spin_lock(&queue->lock);
+	if (iqueue_dequeue(&queue->waiters, &waiter) == 0)
+	{
+		spin_unlock(&queue->lock);
+		uthread_wake(waiter, yield);
+	} else {
+		// Not queued yet.
+		queue->handoffs++;
+		spin_unlock(&queue->lock);
+	}
+	preempt_enable();
+}
+
+uthread_mutex_t uthread_mutex_create(void)
+{
+	uthread_mutex_t mutex = malloc(sizeof(struct uthread_mutex));
+	if (mutex == NULL) return NULL;
+
+	mutex->state = 0;
+	waitq_init(&mutex->queue);
+	return mutex;
+}
+
+int uthread_mutex_destroy(uthread_mutex_t mutex)
+{
+	if (mutex == NULL || mutex->state) return -1;
+	free(mutex);
+	return 0;
+}
+
+int uthread_mutex_lock(uthread_mutex_t mutex)
+{
+	if (mutex == NULL) return -1;
+	// Unlocked, it's ours.
+	if (__atomic_fetch_add(&mutex->state, 1, __ATOMIC_ACQUIRE) == 0)
+		return 0;
+	waitq_wait(&mutex->queue, 0, 0);
+	return 0;
+}
+
+int uthread_mutex_lock_timeout(uthread_mutex_t mutex, uint64_t timeout_ns)
+{
+	int state;
+
+	if (mutex == NULL) return -1;
+	if (__atomic_fetch_add(&mutex->state, 1, __ATOMIC_ACQUIRE) == 0)
+		return 0;
+	if (!waitq_wait(&mutex->queue, 1, timeout_ns))
+		return 0;
+	// Timed out, stop wanting it. Unless we're the only one left wanting it,
+	// in which case it was unlocked and is on its way to us.
+	state = __atomic_load_n(&mutex->state, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		if (state == 1)
+		{
+			waitq_take_handoff(&mutex->queue);
+			return 0;
+		}
+		if (__atomic_compare_exchange_n(&mutex->state, &state, state - 1, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	}
+}
+
+int uthread_mutex_trylock(uthread_mutex_t mutex)
+{
+	int unlocked = 0;
+
+	if (mutex == NULL) return -1;
+	if (!__atomic_compare_exchange_n(&mutex->state, &unlocked, 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return -1;
+	return 0;
+}
+
+int uthread_mutex_unlock(uthread_mutex_t mutex, int yield)
+{
+	if (mutex == NULL || __atomic_load_n(&mutex->state, __ATOMIC_RELAXED) == 0)
+		return -1;
+	// Nobody else wants it.
+	if (__atomic_fetch_sub(&mutex->state, 1, __ATOMIC_RELEASE) == 1)
+		return 0;
+	waitq_handoff(&mutex->queue, yield);
+	return 0;
+}
+
+uthread_sem_t uthread_sem_create(int count)
+{
+	if (count < 0) return NULL;
+	uthread_sem_t sem = malloc(sizeof(struct uthread_sem));
+	if (sem == NULL) return NULL;
+
+	sem->count = count;
+	waitq_init(&sem->queue);
+	return sem;
+}
+
+int uthread_sem_destroy(uthread_sem_t sem)
+{
+	if (sem == NULL || __atomic_load_n(&sem->count, __ATOMIC_RELAXED) < 0)
+		return -1;
+	free(sem);
+	return 0;
+}
+
+int uthread_sem_down(uthread_sem_t sem)
+{
+	if (sem == NULL) return -1;
+	// A resource was available.
+	if (__atomic_fetch_sub(&sem->count, 1, __ATOMIC_ACQUIRE) > 0)
+		return 0;
+	waitq_wait(&sem->queue, 0, 0);
+	return 0;
+}
+
+int uthread_sem_down_timeout(uthread_sem_t sem, uint64_t timeout_ns)
+{
+	int count;
+
+	if (sem == NULL) return -1;
+	if (__atomic_fetch_sub(&sem->count, 1, __ATOMIC_ACQUIRE) > 0)
+		return 0;
+	if (!waitq_wait(&sem->queue, 1, timeout_ns))
+		return 0;
+	// Timed out, stop wanting one. Unless nobody else is left wanting one, in
+	// which case one was released and is on its way to us.
+	count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		if (count >= 0)
+		{
+			waitq_take_handoff(&sem->queue);
+			return 0;
+		}
+		if (__atomic_compare_exchange_n(&sem->count, &count, count + 1, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	}
+}
+
+int uthread_sem_up(uthread_sem_t sem, int yield)
+{
+	if (sem == NULL) return -1;
+	// Nobody wants it.
+	if (__atomic_fetch_add(&sem->count, 1, __ATOMIC_RELEASE) >= 0)
+		return 0;
+	waitq_handoff(&sem->queue, yield);
+	return 0;
+}
+
+uthread_cond_t uthread_cond_create(void)
+{
+	uthread_cond_t cond = malloc(sizeof(struct uthread_cond));
+	if (cond == NULL) return NULL;
+
+	waitq_init(&cond->queue);
+	return cond;
+}
+
+int uthread_cond_destroy(uthread_cond_t cond)
+{
+	if (cond == NULL || iqueue_length(&cond->queue.waiters)) return -1;
+	free(cond);
+	return 0;
+}
+
+// Wait for a condition, giving up after @timeout_ns if @timed.
+static int cond_wait(uthread_cond_t cond, uthread_mutex_t mutex, int timed,
+		     uint64_t timeout_ns)
+{
+	int timed_out = 0;
+
+	if (cond == NULL || mutex == NULL) return -1;
+
+	// Queue ourselves before unlocking, so that a signal sent right after
+	// isn't missed. The condition's lock is only released once we're switched
+	// out, and signaling takes it.
+	preempt_disable();
+	spin_lock(&cond->queue.lock);
+	iqueue_enqueue(&cond->queue.waiters, uthread_waiter());
+	if (timed)
+		uthread_timeout_start(timeout_ns, waitq_expired, &cond->queue);
+	uthread_mutex_unlock(mutex, 0);
+	uthread_block(&cond->queue.lock);
+	if (timed)
+		timed_out = uthread_timeout_cancel();
+	preempt_enable();
+
+	uthread_mutex_lock(mutex);
+	return timed_out;
+}
+
+int uthread_cond_wait(uthread_cond_t cond, uthread_mutex_t mutex)
+{
+	return cond_wait(cond, mutex, 0, 0);
+}
+
+int uthread_cond_wait_timeout(uthread_cond_t cond, uthread_mutex_t mutex,
+			      uint64_t timeout_ns)
+{
+	return cond_wait(cond, mutex, 1, timeout_ns);
+}
+
+int uthread_cond_signal(uthread_cond_t cond)
+{
+	struct queue_node *waiter;
+	int found;
+
+	if (cond == NULL) return -1;
+	preempt_disable();
+	spin_lock(&cond->queue.lock);
+	found = iqueue_dequeue(&cond->queue.waiters, &waiter) == 0;
+	spin_unlock(&cond->queue.lock);
+	if (found) uthread_wake(waiter, 0);
+	preempt_enable();
+	return 0;
+}
+
+int uthread_cond_broadcast(uthread_cond_t cond)
+{
+	struct queue_node *waiter;
+	struct iqueue waiters;
+
+	if (cond == NULL) return -1;
+	// Take all the waiters at once, to wake them without the lock.
+	iqueue_init(&waiters);
+	preempt_disable();
+	spin_lock(&cond->queue.lock);
+	while (iqueue_dequeue(&cond->queue.waiters, &waiter) == 0)
+		iqueue_enqueue(&waiters, waiter);
+	spin_unlock(&cond->queue.lock);
+	while (iqueue_dequeue(&waiters, &waiter) == 0)
+		uthread_wake(waiter, 0);
+	preempt_enable();
+	return 0;
+}
@@ -0,0 +1,171 @@
+#include <stddef.h>
+
+#include "timer.h"
+
+// Number of bits of a tick count indexing the slots of a level.
+#define TIMER_SLOT_BITS 6
+_Static_assert(TIMER_SLOTS == 1 << TIMER_SLOT_BITS, "a slot bitmap is 64 bits");
+
+// Ticks covered by a slot of a level.
+#define TIMER_SLOT_TICKS(level) ((uint64_t) 1 << (TIMER_SLOT_BITS * (level)))
+
+// Tick a time falls in, which ends once the time is past.
+static uint64_t timer_tick(uint64_t time)
+{
+	return time >> TIMER_TICK_SHIFT;
+}
+
+// Tick by the end of which a time is past.
+static uint64_t timer_tick_after(uint64_t time)
+{
+	return timer_tick(time) + ((time & ((1 << TIMER_TICK_SHIFT) - 1)) != 0);
+}
+
+static uint64_t timer_rotate(uint64_t bitmap, unsigned int shift)
+{
+	shift %= 64;
+	return shift ? bitmap >> shift | bitmap << (64 - shift) : bitmap;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+	wheel->now = timer_tick(now);
+	wheel->count = 0;
+	for (int level = 0; level < TIMER_LEVELS; level++)
+	{
+		wheel->occupied[level] = 0;
+		for (int i = 0; i < TIMER_SLOTS; i++)
+			wheel->slots[level][i] = NULL;
+	}
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer *timer)
+{
+	uint64_t expires = timer_tick_after(timer->expires);
+	uint64_t delta;
+	unsigned int level = 0;
+
+	if (expires < wheel->now)
+		expires = wheel->now;
+	// The level whose slots cover the time left, expiring further than the
+	// last one covers is cut short and put back when it cascades.
+	delta = expires - wheel->now;
+	while (level < TIMER_LEVELS - 1 && delta >= TIMER_SLOT_TICKS(level + 1))
+		level++;
+	if (delta >= TIMER_SLOT_TICKS(TIMER_LEVELS))
+		expires = wheel->now + TIMER_SLOT_TICKS(TIMER_LEVELS) - 1;
+
+	unsigned int index = (expires >> (TIMER_SLOT_BITS * level)) % TIMER_SLOTS;
+	struct timer **head = &wheel->slots[level][index];
+	timer->next = *head;
+	if (timer->next != NULL)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+	timer->slot = level * TIMER_SLOTS + index;
+	wheel->occupied[level] |= (uint64_t) 1 << index;
+	wheel->count++;
+}
+
+void timer_wheel_del(struct timer_wheel *wheel, struct timer *timer)
+{
+	unsigned int level = timer->slot / TIMER_SLOTS;
+	unsigned int index = timer->slot % TIMER_SLOTS;
+
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	if (wheel->slots[level][index] == NULL)
+		wheel->occupied[level] &= ~((uint64_t) 1 << index);
+	wheel->count--;
+}
+
+// Take all the timers of a slot.
+static struct timer *timer_wheel_take(struct timer_wheel *wheel, unsigned int level,
+				      unsigned int index)
+{
+	struct timer *timers = wheel->slots[level][index];
+
+	wheel->slots[level][index] = NULL;
+	wheel->occupied[level] &= ~((uint64_t) 1 << index);
+	for (struct timer *timer = timers; timer != NULL; timer = timer->next)
+		wheel->count--;
+	return timers;
+}
+
+// Next tick at which a slot expires or cascades, UINT64_MAX if none.
+static uint64_t timer_wheel_next_tick(struct timer_wheel *wheel)
+{
+	uint64_t next = UINT64_MAX;
+
+	for (unsigned int level = 0; level < TIMER_LEVELS; level++)
+	{
+		if (wheel->occupied[level] == 0)
+			continue;
+		// First start of a slot of this level from now, and how many
+		// slots further the first one holding timers is.
+		uint64_t unit = TIMER_SLOT_TICKS(level);
+		uint64_t start = (wheel->now + unit - 1) / unit;
+		unsigned int skip = __builtin_ctzll(timer_rotate(wheel->occupied[level],
+								 start % TIMER_SLOTS));
+		uint64_t tick = (start + skip) * unit;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now)
+{
+	uint64_t target = timer_tick(now);
+	struct timer *expired = NULL;
+
+	while (wheel->now <= target)
+	{
+		uint64_t tick = timer_wheel_next_tick(wheel);
+		if (tick > target)
+		{
+			// Nothing happens until then.
+			wheel->now = target + 1;
+			break;
+		}
+		wheel->now = tick;
+
+		// Spread the slots starting now over the levels below, every
+		// level having gone full circle over the one below.
+		for (unsigned int level = 1; level < TIMER_LEVELS; level++)
+		{
+			if (tick % TIMER_SLOT_TICKS(level))
+				break;
+			unsigned int index = (tick >> (TIMER_SLOT_BITS * level)) % TIMER_SLOTS;
+			struct timer *timer = timer_wheel_take(wheel, level, index);
+			while (timer != NULL)
+			{
+				struct timer *next = timer->next;
+				timer_wheel_add(wheel, timer);
+				timer = next;
+			}
+		}
+
+		// Every timer of this tick's slot expires now.
+		struct timer *timer = timer_wheel_take(wheel, 0, tick % TIMER_SLOTS);
+		while (timer != NULL)
+		{
+			struct timer *next = timer->next;
+			timer->next = expired;
+			expired = timer;
+			timer = next;
+		}
+		wheel->now = tick + 1;
+	}
+	return expired;
+}
+
+uint64_t timer_wheel_next(struct timer_wheel *wheel)
+{
+	uint64_t tick = timer_wheel_next_tick(wheel);
+
+	if (tick == UINT64_MAX || tick > UINT64_MAX >> TIMER_TICK_SHIFT)
+		return UINT64_MAX;
+	return tick << TIMER_TICK_SHIFT;
+}
@@ -0,0 +1,108 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * struct timer_wheel - Hierarchical timer wheel
+ *
+ * Timers are kept in lists hashed by their expiry time, in TIMER_LEVELS
+ * levels of TIMER_SLOTS slots each. A slot of level 0 holds the timers
+ * expiring during one tick, a slot of level 1 those expiring during
+ * TIMER_SLOTS ticks, and so on. Adding and deleting a timer is a list
+ * operation. As time goes by, the slots of level 0 are expired one tick after
+ * the other, and each time a level has gone full circle the next slot of the
+ * level above is cascaded, that is its timers are spread over the level
+ * below. A timer is thus moved at most TIMER_LEVELS - 1 times before it
+ * expires, and never looked at otherwise: timers that don't expire cost
+ * nothing.
+ *
+ * A bitmap of the slots holding timers lets expiring skip the empty ones, so
+ * that advancing the wheel over a long idle period is cheap too.
+ *
+ * The wheel doesn't lock, nor read a clock: times are nanoseconds on whatever
+ * clock the user passes them from.
+ */
+#define TIMER_LEVELS 6
+#define TIMER_SLOTS 64
+
+/* Length of a tick (in nanoseconds, as a power of two) */
+#define TIMER_TICK_SHIFT 14
+
+/*
+ * struct timer - Timer, to be embedded in the structure it belongs to
+ * @expires: Expiry time (in nanoseconds)
+ */
+struct timer {
+	struct timer *next;
+	struct timer **pprev;
+	uint64_t expires;
+	/* Slot it's in, as level * TIMER_SLOTS + index */
+	unsigned int slot;
+};
+
+/*
+ * timer_entry - Get the structure containing a timer
+ * @timer: Address of the timer
+ * @type: Type of the structure
+ * @member: Name of the timer member within @type
+ */
+#define timer_entry(timer, type, member) \
+	((type *) ((char *) (timer) - offsetof(type, member)))
+
+struct timer_wheel {
+	/* Next tick to expire */
+	uint64_t now;
+	unsigned long count;
+	uint64_t occupied[TIMER_LEVELS];
+	struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/*
+ * timer_wheel_init - Initialize an empty timer wheel
+ * @wheel: Wheel to initialize
+ * @now: Current time (in nanoseconds)
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+/*
+ * timer_wheel_add - Add a timer to a wheel
+ * @wheel: Wheel to add to
+ * @timer: Timer not in any wheel, with @timer->expires set
+ *
+ * A timer expiring in the past expires on the next call to
+ * timer_wheel_expire().
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct timer *timer);
+
+/*
+ * timer_wheel_del - Delete a timer from a wheel
+ * @wheel: Wheel @timer is in
+ * @timer: Timer to delete
+ */
+void timer_wheel_del(struct timer_wheel *wheel, struct timer *timer);
+
+/*
+ * timer_wheel_expire - Take the timers expired so far out of a wheel
+ * @wheel: Wheel to expire timers of
+ * @now: Current time (in nanoseconds)
+ *
+ * Return: List of the expired timers, linked through their next field, NULL
+ * if none.
+ */
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now);
+
+/*
+ * timer_wheel_next - Time of the next expiry of a wheel
+ * @wheel: Wheel to look into
+ *
+ * The time is that of the next slot to expire or cascade, which may be before
+ * its timers actually expire, but never after.
+ *
+ * Return: Time (in nanoseconds) before which timer_wheel_expire() would
+ * return no timer, UINT64_MAX if @wheel is empty.
+ */
+uint64_t timer_wheel_next(struct timer_wheel *wheel);
+
+#endif /* _TIMER_H */
@@ -0,0 +1,316 @@
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "private.h"
+#include "uthread.h"
+
+#define CACHE_LINE 64
+
+struct trace_entry
+{
+	uint64_t time;
+	int type;
+	uthread_t tid;
+	uthread_t arg;
+};
+
+// Events of a worker, only written by the worker itself. Event number i is in
+// entry i % size, which is overwritten by event number i + size. Readers take
+// events published by head, and those overwritten while they were copying
+// them are ignored.
+struct trace_ring
+{
+	uint64_t head;
+	struct trace_entry *entries;
+	uint64_t mask;
+} __attribute__((aligned(CACHE_LINE)));
+
+int trace_enabled;
+
+static struct trace_ring *trace_rings;
+static unsigned int trace_workers;
+
+// Readings of both clocks when tracing started, to convert the trace clock.
+static uint64_t trace_start_time;
+static uint64_t trace_start_ns;
+
+// Time of an event: the cycle counter where there is one, in nanoseconds
+// otherwise.
+static uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+static uint64_t trace_clock_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int trace_start(unsigned int workers, size_t events)
+{
+	size_t size = 1;
+
+	trace_enabled = 0;
+	trace_rings = NULL;
+	if (events == 0)
+		return 0;
+	while (size < events)
+		size *= 2;
+	trace_rings = aligned_alloc(CACHE_LINE, workers * sizeof(struct trace_ring));
+	if (trace_rings == NULL)
+		return -1;
+	trace_workers = workers;
+	for (unsigned int i = 0; i < workers; i++)
+	{
+		trace_rings[i].head = 0;
+		trace_rings[i].mask = size - 1;
+		trace_rings[i].entries = calloc(size, sizeof(struct trace_entry));
+		if (trace_rings[i].entries == NULL)
+		{
+			trace_workers = i;
+			trace_stop();
+			return -1;
+		}
+	}
+	trace_start_time = trace_clock();
+	trace_start_ns = trace_clock_ns();
+	return 0;
+}
+
+void trace_stop(void)
+{
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+	if (trace_rings == NULL)
+		return;
+	for (unsigned int i = 0; i < trace_workers; i++)
+		free(trace_rings[i].entries);
+	free(trace_rings);
+	trace_rings = NULL;
+}
+
+void trace_record(unsigned int worker, int type, uthread_t tid, uthread_t arg)
+{
+	struct trace_ring *ring = &trace_rings[worker];
+	uint64_t head = ring->head;
+	struct trace_entry *entry = &ring->entries[head & ring->mask];
+
+	// The entry may hold an event a reader is copying. Order the store of
+	// head that published the previous event before the entry's new contents,
+	// so that a reader seeing any of them also sees head moved past the event
+	// it overwrites, and drops that event (see trace_snapshot()). Release
+	// stores don't order the stores after them.
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	entry->time = trace_clock();
+	entry->type = type;
+	entry->tid = tid;
+	entry->arg = arg;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int uthread_trace_enable(int enable)
+{
+	if (trace_rings == NULL)
+		return -1;
+	__atomic_store_n(&trace_enabled, enable != 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// Copy the events of a ring still there once copied, oldest first.
+// Return: Number of events copied to @events, which holds the ring's size.
+static size_t trace_snapshot(struct trace_ring *ring, struct trace_entry *events)
+{
+	uint64_t size = ring->mask + 1;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > size ? head - size : 0;
+
+	for (uint64_t i = first; i < head; i++)
+		events[i - first] = ring->entries[i & ring->mask];
+	// Events overwritten meanwhile, or being overwritten, are garbage.
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t valid = now >= size ? now - size + 1 : 0;
+	if (valid <= first)
+		return head - first;
+	if (valid >= head)
+		return 0;
+	memmove(events, events + (valid - first), (head - valid) * sizeof(*events));
+	return head - valid;
+}
+
+static const char *trace_reason(int type)
+{
+	switch (type)
+	{
+	case TRACE_PREEMPT:
+		return "preempt";
+	case TRACE_BLOCK:
+		return "block";
+	case TRACE_EXIT:
+		return "exit";
+	default:
+		return "yield";
+	}
+}
+
+// Writes one JSON object after another, separated by commas.
+struct trace_writer
+{
+	FILE *file;
+	int first;
+	// Ticks of the trace clock per microsecond.
+	double rate;
+	// Threads named so far, by TID.
+	unsigned char named[(USHRT_MAX + 1) / 8];
+};
+
+static void trace_write(struct trace_writer *writer, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void trace_write(struct trace_writer *writer, const char *format, ...)
+{
+	va_list args;
+
+	fputs(writer->first ? "\n" : ",\n", writer->file);
+	writer->first = 0;
+	va_start(args, format);
+	vfprintf(writer->file, format, args);
+	va_end(args);
+}
+
+static double trace_us(struct trace_writer *writer, uint64_t time)
+{
+	return (int64_t) (time - trace_start_time) / writer->rate;
+}
+
+// Name a thread's track the first time it shows up.
+static void trace_name_thread(struct trace_writer *writer, uthread_t tid)
+{
+	if (writer->named[tid / 8] & 1 << tid % 8)
+		return;
+	writer->named[tid / 8] |= 1 << tid % 8;
+	if (tid == 0)
+		trace_write(writer, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":0,"
+			    "\"args\":{\"name\":\"main\"}}");
+	else
+		trace_write(writer, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,"
+			    "\"args\":{\"name\":\"uthread %u\"}}", tid, tid);
+}
+
+// Threads run on a worker from one switch to the next, and stop for the
+// reason recorded last before the switch.
+static void trace_write_worker(struct trace_writer *writer, unsigned int worker,
+			       struct trace_entry *events, size_t count)
+{
+	uthread_t running = TRACE_IDLE;
+	uint64_t since = 0;
+	int known = 0;
+	int reason = TRACE_YIELD;
+
+	trace_write(writer, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":%u,"
+		    "\"args\":{\"name\":\"worker %u\"}}", worker, worker);
+	for (size_t i = 0; i < count; i++)
+	{
+		struct trace_entry *e = &events[i];
+		double ts = trace_us(writer, e->time);
+
+		switch (e->type)
+		{
+		case TRACE_CREATE:
+		case TRACE_WAKE:
+			trace_name_thread(writer, e->tid);
+			trace_write(writer, "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":1,"
+				    "\"tid\":%u,\"ts\":%.3f,\"args\":{\"by\":%u,\"worker\":%u}}",
+				    e->type == TRACE_CREATE ? "create" : "wake", e->tid, ts,
+				    e->arg, worker);
+			break;
+		case TRACE_SWITCH:
+			// Until the first switch, who runs since when is unknown.
+			if (known && running != TRACE_IDLE)
+			{
+				double start = trace_us(writer, since);
+				trace_name_thread(writer, running);
+				trace_write(writer, "{\"ph\":\"X\",\"name\":\"run\",\"pid\":1,"
+					    "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+					    "\"args\":{\"worker\":%u,\"out\":\"%s\"}}",
+					    running, start, ts - start, worker,
+					    trace_reason(reason));
+				trace_write(writer, "{\"ph\":\"X\",\"name\":\"uthread %u\",\"pid\":0,"
+					    "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+					    "\"args\":{\"out\":\"%s\"}}",
+					    running, worker, start, ts - start,
+					    trace_reason(reason));
+			}
+			running = e->tid;
+			since = e->time;
+			known = 1;
+			reason = TRACE_YIELD;
+			break;
+		default:
+			reason = e->type;
+			break;
+		}
+	}
+}
+
+int uthread_trace_dump(const char *path)
+{
+	struct trace_writer *writer;
+	struct trace_entry *events;
+	uint64_t time, ns;
+	int ret;
+
+	if (trace_rings == NULL)
+		return -1;
+	writer = calloc(1, sizeof(*writer));
+	events = malloc((trace_rings[0].mask + 1) * sizeof(*events));
+	if (writer == NULL || events == NULL)
+		goto fail;
+	writer->file = fopen(path, "w");
+	if (writer->file == NULL)
+		goto fail;
+	writer->first = 1;
+
+	// Tell the rate of the trace clock from the time elapsed on both since
+	// tracing started, which gets closer the longer the trace. A trace too
+	// short to tell is too short for the rate to matter.
+	time = trace_clock() - trace_start_time;
+	ns = trace_clock_ns() - trace_start_ns;
+	writer->rate = time && ns ? (double) time / ns * 1000 : 1000;
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", writer->file);
+	trace_write(writer, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":0,"
+		    "\"args\":{\"name\":\"workers\"}}");
+	trace_write(writer, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,"
+		    "\"args\":{\"name\":\"threads\"}}");
+	for (unsigned int i = 0; i < trace_workers; i++)
+	{
+		size_t count = trace_snapshot(&trace_rings[i], events);
+		trace_write_worker(writer, i, events, count);
+	}
+	fputs("\n]}\n", writer->file);
+	ret = ferror(writer->file) ? -1 : 0;
+	if (fclose(writer->file)) ret = -1;
+	free(events);
+	free(writer);
+	return ret;
+
+fail:
+	free(events);
+	free(writer);
+	return -1;
+}
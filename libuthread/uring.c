@@ -0,0 +1,430 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "private.h"
+#include "queue.h"
+#include "uthread.h"
+
+// Number of queued operations which get submitted right away rather than
+// when the worker is next idle or polls.
+#define URING_BATCH 16
+
+// Submission and completion rings, shared with the kernel, protected by lock.
+struct uring
+{
+	int lock;
+	int fd;
+	// Submission ring, and its entries.
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	// Completion ring, in the same mapping as the submission ring if the
+	// kernel supports it.
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	unsigned int cq_entries;
+	struct io_uring_cqe *cqes;
+	// Operations in the submission ring not submitted yet.
+	unsigned int queued;
+	// Whether files and buffers registered by the user are with the kernel
+	// too, rather than only kept to fall back on.
+	int fixed_files;
+	int fixed_buffers;
+};
+
+static struct uring uring = { .fd = -1 };
+
+// Number of threads waiting for an operation to complete.
+static int uring_waiters;
+
+// Files and buffers registered by the user.
+static int *uring_files;
+static unsigned int uring_nr_files;
+static struct iovec *uring_buffers;
+static unsigned int uring_nr_buffers;
+
+// Operation of a blocked thread, identified by its address in the ring.
+struct uring_request
+{
+	struct queue_node *thread;
+	int result;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(unsigned int to_submit)
+{
+	return syscall(__NR_io_uring_enter, uring.fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int uring_register(unsigned int opcode, const void *arg, unsigned int count)
+{
+	return syscall(__NR_io_uring_register, uring.fd, opcode, arg, count);
+}
+
+int uring_start(unsigned int entries)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CLAMP;
+	uring.fd = uring_setup(entries, &params);
+	if (uring.fd < 0)
+		return -1;
+	// Reading and writing at the current position, which sockets and pipes
+	// need, came with the plain read and write operations.
+	if (!(params.features & IORING_FEAT_RW_CUR_POS))
+		goto fail_sq;
+
+	uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (uring.cq_ring_size > uring.sq_ring_size)
+			uring.sq_ring_size = uring.cq_ring_size;
+		uring.cq_ring_size = 0;
+	}
+	uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (uring.sq_ring == MAP_FAILED)
+		goto fail_sq;
+	uring.cq_ring = uring.sq_ring;
+	if (uring.cq_ring_size)
+	{
+		uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+		if (uring.cq_ring == MAP_FAILED)
+			goto fail_cq;
+	}
+	uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED)
+		goto fail_sqes;
+
+	sq = uring.sq_ring;
+	uring.sq_head = (unsigned int*) (sq + params.sq_off.head);
+	uring.sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+	uring.sq_array = (unsigned int*) (sq + params.sq_off.array);
+	uring.sq_mask = *(unsigned int*) (sq + params.sq_off.ring_mask);
+	uring.sq_entries = params.sq_entries;
+	cq = uring.cq_ring;
+	uring.cq_head = (unsigned int*) (cq + params.cq_off.head);
+	uring.cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+	uring.cq_mask = *(unsigned int*) (cq + params.cq_off.ring_mask);
+	uring.cq_entries = params.cq_entries;
+	uring.cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+	// Entries are used in ring order.
+	for (unsigned int i = 0; i < uring.sq_entries; i++)
+		uring.sq_array[i] = i;
+
+	uring.lock = 0;
+	uring.queued = 0;
+	uring.fixed_files = 0;
+	uring.fixed_buffers = 0;
+	uring_waiters = 0;
+	return uring.fd;
+
+fail_sqes:
+	if (uring.cq_ring_size) munmap(uring.cq_ring, uring.cq_ring_size);
+fail_cq:
+	munmap(uring.sq_ring, uring.sq_ring_size);
+fail_sq:
+	close(uring.fd);
+	uring.fd = -1;
+	return -1;
+}
+
+void uring_stop(void)
+{
+	if (uring.fd >= 0)
+	{
+		munmap(uring.sqes, uring.sqes_size);
+		if (uring.cq_ring_size) munmap(uring.cq_ring, uring.cq_ring_size);
+		munmap(uring.sq_ring, uring.sq_ring_size);
+		close(uring.fd);
+		uring.fd = -1;
+	}
+	free(uring_files);
+	free(uring_buffers);
+	uring_files = NULL;
+	uring_buffers = NULL;
+	uring_nr_files = 0;
+	uring_nr_buffers = 0;
+}
+
+int uring_waiting(void)
+{
+	return __atomic_load_n(&uring_waiters, __ATOMIC_RELAXED);
+}
+
+int uring_queued(void)
+{
+	return __atomic_load_n(&uring.queued, __ATOMIC_RELAXED) != 0;
+}
+
+// Hand the queued operations over to the kernel, with the lock held. Those it
+// doesn't take for now stay queued.
+static void uring_submit_locked(void)
+{
+	int ret = uring_enter(uring.queued);
+
+	if (ret > 0)
+		__atomic_store_n(&uring.queued, uring.queued - ret, __ATOMIC_RELAXED);
+}
+
+void uring_submit(void)
+{
+	if (!uring_queued())
+		return;
+	spin_lock(&uring.lock);
+	if (uring.queued)
+		uring_submit_locked();
+	spin_unlock(&uring.lock);
+}
+
+int uring_reap(void)
+{
+	struct queue_node *thread;
+	struct iqueue woken;
+	unsigned int head, tail;
+	int count = 0;
+
+	if (uring.fd < 0)
+		return 0;
+	iqueue_init(&woken);
+	spin_lock(&uring.lock);
+	head = *uring.cq_head;
+	tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+		struct uring_request *request = (void*) (uintptr_t) cqe->user_data;
+		request->result = cqe->res;
+		iqueue_enqueue(&woken, request->thread);
+	}
+	// Give the entries back to the kernel.
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+	spin_unlock(&uring.lock);
+
+	while (iqueue_dequeue(&woken, &thread) == 0)
+	{
+		__atomic_sub_fetch(&uring_waiters, 1, __ATOMIC_SEQ_CST);
+		uthread_wake(thread, 0);
+		count++;
+	}
+	return count;
+}
+
+// Queue an operation and block until it completes. The lock is held from
+// queuing until the thread is switched out, and taken to reap completions,
+// so a completion can't wake it before that.
+// Return: 0 with the operation's result in @result, -1 if the ring is full.
+static int uring_run(const struct io_uring_sqe *sqe, int *result)
+{
+	struct uring_request request;
+	unsigned int tail;
+
+	preempt_disable();
+	spin_lock(&uring.lock);
+	// Completions that don't fit in the completion ring wait in the kernel
+	// for a call asking for them, which workers never make: never have more
+	// operations in flight than fit.
+	if ((unsigned int) uring_waiting() >= uring.cq_entries)
+	{
+		spin_unlock(&uring.lock);
+		preempt_enable();
+		return -1;
+	}
+	tail = *uring.sq_tail;
+	if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+	{
+		// Make room, if the kernel takes what's queued.
+		uring_submit_locked();
+		if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+		{
+			spin_unlock(&uring.lock);
+			preempt_enable();
+			return -1;
+		}
+	}
+	request.thread = uthread_waiter();
+	uring.sqes[tail & uring.sq_mask] = *sqe;
+	uring.sqes[tail & uring.sq_mask].user_data = (uintptr_t) &request;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&uring.queued, uring.queued + 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&uring_waiters, 1, __ATOMIC_SEQ_CST);
+	if (uring.queued >= URING_BATCH)
+		uring_submit_locked();
+	uthread_block(&uring.lock);
+	preempt_enable();
+
+	*result = request.result;
+	return 0;
+}
+
+// Read or write the synchronous way: through the reactor from the current
+// position, which only blocks the thread on sockets and pipes, or with an
+// offset, which only files support and are never waited for anyway.
+static ssize_t uring_fallback(int write, int fd, void *buf, size_t count, off_t offset)
+{
+	if (offset == -1)
+		return write ? uthread_write(fd, buf, count) : uthread_read(fd, buf, count);
+	return write ? pwrite(fd, buf, count, offset) : pread(fd, buf, count, offset);
+}
+
+// Read or write through the ring, or the synchronous way if it's unavailable,
+// or if the descriptor is non-blocking which the ring would give up on.
+// A fixed file is an index in the registered files, a fixed buffer one in the
+// registered buffers which @buf is part of, -1 if not.
+static ssize_t uring_rw(int write, int fd, int file, void *buf, size_t count,
+			off_t offset, int buffer)
+{
+	struct io_uring_sqe sqe;
+	int result;
+
+	if (file >= 0)
+	{
+		if ((unsigned int) file >= uring_nr_files)
+		{
+			errno = EBADF;
+			return -1;
+		}
+		fd = uring_files[file];
+	}
+	if (buffer >= 0)
+	{
+		char *base = (unsigned int) buffer < uring_nr_buffers ?
+			uring_buffers[buffer].iov_base : NULL;
+		if (base == NULL || (char*) buf < base ||
+		    (char*) buf + count > base + uring_buffers[buffer].iov_len)
+		{
+			errno = EFAULT;
+			return -1;
+		}
+	}
+	if (uring.fd < 0)
+		return uring_fallback(write, fd, buf, count, offset);
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.fd = fd;
+	if (file >= 0 && uring.fixed_files)
+	{
+		sqe.fd = file;
+		sqe.flags = IOSQE_FIXED_FILE;
+	}
+	sqe.addr = (uintptr_t) buf;
+	sqe.len = count;
+	sqe.off = offset;
+	if (buffer >= 0 && uring.fixed_buffers)
+	{
+		sqe.opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe.buf_index = buffer;
+	} else {
+		sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+
+	if (uring_run(&sqe, &result) || result == -EAGAIN)
+		return uring_fallback(write, fd, buf, count, offset);
+	if (result < 0)
+	{
+		errno = -result;
+		return -1;
+	}
+	return result;
+}
+
+ssize_t uthread_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	return uring_rw(0, fd, -1, buf, count, offset, -1);
+}
+
+ssize_t uthread_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	return uring_rw(1, fd, -1, (void*) buf, count, offset, -1);
+}
+
+ssize_t uthread_pread_fixed(int file, void *buf, size_t count, off_t offset, int buffer)
+{
+	return uring_rw(0, -1, file, buf, count, offset, buffer);
+}
+
+ssize_t uthread_pwrite_fixed(int file, const void *buf, size_t count, off_t offset,
+			     int buffer)
+{
+	return uring_rw(1, -1, file, (void*) buf, count, offset, buffer);
+}
+
+int uthread_io_register_files(const int *fds, unsigned int count)
+{
+	int *files = NULL;
+
+	if (count && fds == NULL) return -1;
+	if (count)
+	{
+		files = malloc(count * sizeof(int));
+		if (files == NULL) return -1;
+		memcpy(files, fds, count * sizeof(int));
+	}
+	if (uring.fd >= 0)
+	{
+		if (uring.fixed_files)
+			uring_register(IORING_UNREGISTER_FILES, NULL, 0);
+		// Without the kernel's table, operations use the descriptors.
+		uring.fixed_files = count &&
+			uring_register(IORING_REGISTER_FILES, files, count) == 0;
+	}
+	free(uring_files);
+	uring_files = files;
+	uring_nr_files = count;
+	return 0;
+}
+
+int uthread_io_register_buffers(const struct iovec *iovecs, unsigned int count)
+{
+	struct iovec *buffers = NULL;
+
+	if (count && iovecs == NULL) return -1;
+	if (count)
+	{
+		buffers = malloc(count * sizeof(struct iovec));
+		if (buffers == NULL) return -1;
+		memcpy(buffers, iovecs, count * sizeof(struct iovec));
+	}
+	if (uring.fd >= 0)
+	{
+		if (uring.fixed_buffers)
+			uring_register(IORING_UNREGISTER_BUFFERS, NULL, 0);
+		// Pinning may exceed RLIMIT_MEMLOCK, plain operations do then.
+		uring.fixed_buffers = count &&
+			uring_register(IORING_REGISTER_BUFFERS, buffers, count) == 0;
+	}
+	free(uring_buffers);
+	uring_buffers = buffers;
+	uring_nr_buffers = count;
+	return 0;
+}
+
+int uthread_io_uring(void)
+{
+	return uring.fd >= 0;
+}
@@ -1,14 +1,23 @@
 #include <assert.h>
 #include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "deque.h"
 #include "private.h"
 #include "queue.h"
+#include "slab.h"
+#include "timer.h"
 #include "uthread.h"
 
 // State variable for thread status.
@@ -17,232 +26,1519 @@ enum thread_state
 	READY,
 	RUNNING,
 	BLOCKED,
+	// Exited, but still running on its stack until switched out.
+	EXITING,
 	ZOMBIE
 };
 
+// Size of a cache line, TCBs are aligned on it.
+#define CACHE_LINE 64
+
 // Thread information storage.
+// Fields used on every context switch come first and share a cache line, the
+// rest is only used when creating, exiting or joining the thread.
 struct TCB
 {
 	// Execution context.
-	uthread_t TID;
+	uthread_ctx_t context;
+	// Link in the ready queue, or in the wait queue it's blocked in.
+	struct queue_node link;
 	int status;
-	void *stack;
-	uthread_ctx_t *context;
-	// Joining information.
+	uthread_t TID;
+	// Priority level the thread is queued at when ready.
+	unsigned char level;
+
+	// Stack, only used at creation and collection.
+	void *stack __attribute__((aligned(CACHE_LINE)));
+	size_t stack_size;
+	// Joining information, protected by lock.
+	int lock;
 	struct TCB* joiner;
 	int return_value;
-	// If the thread needs to collect from a zombie.
-	int collector;
+	// Level the thread gets back to when boosted.
+	unsigned char priority;
+	// Function given the thread's data, see uthread_create_data(), and the
+	// copy of the data: on top of the thread's stack, or allocated in shared
+	// stack mode.
+	uthread_data_func_t data_func;
+	void *data;
+
+	// Timeout of the blocking call it's in, see uthread_timeout_start().
+	// Pending in the timer wheel of the worker it was started on, whose
+	// lock protects the state.
+	struct timer timer;
+	int timeout_state;
+	struct worker *timeout_worker;
+	uthread_timeout_func_t timeout_func;
+	void *timeout_arg;
+
+	// Statistics, see uthread_thread_stats(), and when it was last made
+	// ready.
+	struct uthread_thread_stats stats;
+	uint64_t ready_since;
+} __attribute__((aligned(CACHE_LINE)));
+
+// States of a thread's timeout.
+enum
+{
+	// Not started, or cancelled.
+	TIMEOUT_NONE,
+	TIMEOUT_PENDING,
+	// Its function is running, then returned without or after waking the
+	// thread up.
+	TIMEOUT_FIRING,
+	TIMEOUT_MISSED,
+	TIMEOUT_EXPIRED,
 };
 
-// Scheduler queue and data structures to hold zombies.
-queue_t scheduler;
-queue_t zombie_q;
-// The currently running thread.
-struct TCB *cur_thread = NULL;
+#ifdef UTHREAD_CTX_ASM
+_Static_assert(offsetof(struct TCB, level) + sizeof(unsigned char) <= CACHE_LINE,
+	       "TCB fields used when switching must fit in a cache line");
+#endif
+
+// Number of TCBs allocated at once by the TCB cache.
+#define TCBS_PER_SLAB 64
+
+// Cache TCBs are allocated from.
+struct slab_cache tcb_cache;
+
+// Scheduler queues, of ready threads linked through their TCB.
+// There is one queue per priority level, and bit i of the bitmap is set when
+// the queue of level i is not empty, so that the highest priority ready thread
+// is found in constant time. With the FIFO policy, every thread is at level 0.
+struct runqueue
+{
+	uint32_t bitmap;
+	int length;
+	// Number of queued threads that must stay on this worker (main).
+	int pinned;
+	struct iqueue levels[UTHREAD_PRIO_LEVELS];
+};
+_Static_assert(UTHREAD_PRIO_LEVELS <= 32, "runqueue bitmap is 32 bits");
+
+// A kernel thread running user threads.
+// Worker 0 is the kernel thread that started the library, and the only one
+// running main. Every other worker runs on a pthread of its own.
+struct worker
+{
+	// Thread running on this worker, NULL when idle.
+	struct TCB *cur;
+	// Thread this worker just switched away from, see uthread_switch_finish(),
+	// the lock to release then if it blocked, and the thread it blocked
+	// joining if so.
+	struct TCB *prev;
+	int *prev_lock;
+	struct TCB *prev_joined;
+	// Ready threads. In a locked run queue, or with work stealing in a deque
+	// only this worker pushes to, and main's slot on worker 0.
+	int lock;
+	struct runqueue queue;
+	struct deque deque;
+	struct TCB *pinned;
+	// Random state for picking victims to steal from.
+	unsigned int random;
+	// Number of times to look for threads when idle, before parking.
+	unsigned int spins;
+	// Preemptions since the last MLFQ boost.
+	unsigned int ticks_since_boost;
+	// Switches since the last check for ready I/O.
+	unsigned int switches_since_poll;
+	// Switches to threads, the CPU time of this kernel thread when the running
+	// thread was switched to, and how long threads waited in the ready queues,
+	// see uthread_stats().
+	unsigned long switches;
+	uint64_t cpu_since;
+	unsigned long ready_latency[UTHREAD_STATS_BUCKETS];
+	// Timeouts of the threads that started one on this worker, protected by
+	// timer_lock, and the time before which none expires.
+	int timer_lock;
+	uint64_t timer_next;
+	struct timer_wheel timers;
+	// Context running the scheduling loop when there is no thread to run.
+	uthread_ctx_t idle;
+	void *idle_stack;
+	// Futex word, set while the worker sleeps for lack of threads to run,
+	// to PARKED_POLLING if waiting for I/O.
+	int parked;
+	unsigned int index;
+	pthread_t pthread;
+} __attribute__((aligned(CACHE_LINE)));
+
+// Workers, and how many there are.
+struct worker *workers;
+unsigned int num_workers;
+// Whether ready threads go to lock-free work-stealing deques rather than
+// locked run queues, which is with FIFO scheduling and several workers: a
+// deque has no priority levels, and a single worker has no one to steal from.
+int stealing;
+// Number of parked workers.
+int parked_workers;
+// Set while a parked worker waits for I/O, which one at a time does.
+int io_polling;
+// Set by uthread_stop() to get workers out of their scheduling loop.
+int workers_stopping;
+// Whether threads are preempted.
+int preemptive;
+// Scheduling policy, and MLFQ boost period in preemptions.
+int sched_policy;
+unsigned int boost_ticks;
+// Every thread not collected yet, main included, indexed by TID.
+// TIDs of collected threads are handed out again before new ones, so that the
+// table stays as dense as the threads that exist at once.
+struct TCB **tid_table;
+size_t tid_table_size;
+// Stack of the TIDs to hand out again, as large as the table.
+uthread_t *free_tids;
+size_t num_free_tids;
+// Number of threads created and not collected yet, and of those which exited.
+int live_threads;
+int zombie_threads;
+// Whether switches measure the times of thread statistics, and since when.
+int timing_stats;
+uint64_t start_time;
 // The main thread.
 struct TCB *main_thread = NULL;
-// Keep track of TID numbers.
+// Highest TID handed out.
 uthread_t num_thread;
+// Protects the TID table, the thread counters and the TCB cache.
+int threads_lock;
+// Stack size of threads created without a specific one.
+size_t default_stack_size;
+// Whether threads run on the shared stack.
+int use_shared_stack;
+
+// Worker of the calling kernel thread.
+static __thread struct worker *self_worker;
+
+// Initial number of entries of the TID table.
+#define TID_TABLE_SIZE 1024
+
+// Default time slice, 100 Hz.
+#define QUANTUM_US 10000
+
+// Default MLFQ boost period, once a second with the default time slice.
+#define BOOST_TICKS 100
+
+// Default number of free stacks kept per size class, and allocated at start.
+#define STACK_CACHE_MAX 64
+#define STACK_CACHE_PREWARM 8
+
+// Stack of worker 0's scheduling loop, which also takes signal frames.
+#define IDLE_STACK_SIZE UTHREAD_STACK_SIZE
+
+// Initial capacity of the work-stealing deques, which grow as needed.
+#define DEQUE_SIZE 256
+
+// Bounds of the number of times an idle worker looks for threads before
+// parking.
+#define IDLE_SPINS_MIN 16
+#define IDLE_SPINS_MAX 4096
+
+// Number of switches between checks for threads whose I/O is ready, while
+// there are threads to run.
+#define IO_POLL_SWITCHES 64
+
+// Value of a worker's parked word while it sleeps in io_poll() rather than
+// on the futex.
+#define PARKED_POLLING 2
+
+// Get the worker of the calling kernel thread.
+// A thread may resume on another kernel thread after any switch, so this must
+// be called again after switching rather than cached. It's kept out of line so
+// that the compiler can't cache the thread-local address either.
+static __attribute__((noinline)) struct worker *this_worker(void)
+{
+	struct worker *w = self_worker;
+	__asm__ volatile("" ::: "memory");
+	return w;
+}
+
+// Run queues and thread data are only shared in M:N mode, don't bother
+// locking with a single worker.
+static void worker_lock(struct worker *w)
+{
+	if (num_workers > 1) spin_lock(&w->lock);
+}
+
+static void worker_unlock(struct worker *w)
+{
+	if (num_workers > 1) spin_unlock(&w->lock);
+}
+
+static void lock_threads(void)
+{
+	if (num_workers > 1) spin_lock(&threads_lock);
+}
+
+static void unlock_threads(void)
+{
+	if (num_workers > 1) spin_unlock(&threads_lock);
+}
+
+static void lock_thread(struct TCB *thread)
+{
+	if (num_workers > 1) spin_lock(&thread->lock);
+}
+
+static void unlock_thread(struct TCB *thread)
+{
+	if (num_workers > 1) spin_unlock(&thread->lock);
+}
+
+static uint64_t clock_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// CPU time consumed by the calling kernel thread, in nanoseconds.
+static uint64_t cpu_clock_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void scheduling_loop(struct worker *w);
+
+// TID of the thread running on a worker, for traces.
+static uthread_t worker_tid(struct worker *w)
+{
+	return w->cur != NULL ? w->cur->TID : TRACE_IDLE;
+}
+
+// Record an event about the running thread, with preemption disabled.
+#define trace_running(type) \
+	trace_event(this_worker()->index, type, this_worker()->cur->TID, 0)
+
+// Body of worker 0's idle context.
+static int worker_idle(void)
+{
+	scheduling_loop(this_worker());
+	return 0;
+}
+
+// Body of the pthread of every other worker.
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	self_worker = w;
+	// The scheduling loop runs with preemption disabled, as any context
+	// switching to threads. Without a timer, the worker is only cooperative.
+	preempt_disable();
+	if (preemptive && preempt_start_worker(w->index))
+		perror("preempt_start_worker");
+	scheduling_loop(w);
+	if (preemptive) preempt_stop_worker();
+	return NULL;
+}
+
+void uthread_config_init(struct uthread_config *config)
+{
+	config->preempt = 0;
+	config->quantum_us = QUANTUM_US;
+	config->preempt_clock = UTHREAD_CLOCK_CPU;
+	config->sched_policy = UTHREAD_SCHED_FIFO;
+	config->boost_ticks = BOOST_TICKS;
+	config->tickless = 1;
+	config->workers = 1;
+	config->stack_size = UTHREAD_STACK_SIZE;
+	config->stack_guard = 1;
+	config->stack_cache_max = STACK_CACHE_MAX;
+	config->stack_cache_prewarm = STACK_CACHE_PREWARM;
+	config->shared_stack_size = 0;
+	config->io_uring_entries = 0;
+	config->trace_events = 0;
+	config->stats = 0;
+	config->profile_samples = 0;
+}
 
 int uthread_start(int preempt)
 {
+	struct uthread_config config;
+
+	uthread_config_init(&config);
+	config.preempt = preempt;
+	return uthread_start_config(&config);
+}
+
+int uthread_start_config(const struct uthread_config *config)
+{
+	// Threads need room for their initial frame above the guard page.
+	if (config->stack_size < PTHREAD_STACK_MIN) return -1;
+	if (config->preempt && config->quantum_us <= 0) return -1;
+	// Samples are taken on preemption ticks.
+	if (config->profile_samples && !config->preempt) return -1;
+	if (config->sched_policy != UTHREAD_SCHED_FIFO &&
+	    config->sched_policy != UTHREAD_SCHED_MLFQ) return -1;
+	// The shared stack can only be used by one kernel thread.
+	if (config->workers == 0) return -1;
+	if (config->workers > 1 && config->shared_stack_size) return -1;
+
 	// Set up a TCB for the main thread.
-	main_thread = malloc(sizeof(struct TCB));
+	if (slab_init(&tcb_cache, sizeof(struct TCB), CACHE_LINE, TCBS_PER_SLAB))
+		return -1;
+	main_thread = slab_alloc(&tcb_cache);
 	if (main_thread == NULL) return -1;
 
-	// Prepare the scheduler and zombie queues.
-	scheduler = queue_create();
-	if (scheduler == NULL) return -1;
-	zombie_q = queue_create();
-	if (zombie_q == NULL) return -1;
+	// Prepare the workers and the TID table.
+	num_workers = config->workers;
+	workers = aligned_alloc(CACHE_LINE, num_workers * sizeof(struct worker));
+	if (workers == NULL) return -1;
+	memset(workers, 0, num_workers * sizeof(struct worker));
+	stealing = num_workers > 1 && config->sched_policy == UTHREAD_SCHED_FIFO;
+	for (unsigned int i = 0; i < num_workers; i++)
+	{
+		workers[i].index = i;
+		workers[i].random = i + 1;
+		workers[i].spins = IDLE_SPINS_MIN;
+		workers[i].timer_next = UINT64_MAX;
+		timer_wheel_init(&workers[i].timers, clock_ns());
+		for (int j = 0; j < UTHREAD_PRIO_LEVELS; j++)
+			iqueue_init(&workers[i].queue.levels[j]);
+		if (stealing && deque_init(&workers[i].deque, DEQUE_SIZE))
+			return -1;
+	}
+	if (trace_start(num_workers, config->trace_events))
+		return -1;
+	if (profile_start(num_workers, config->profile_samples))
+		return -1;
+	parked_workers = 0;
+	io_polling = 0;
+	workers_stopping = 0;
+	preemptive = config->preempt;
+	sched_policy = config->sched_policy;
+	boost_ticks = config->boost_ticks;
+	tid_table_size = TID_TABLE_SIZE;
+	tid_table = calloc(tid_table_size, sizeof(struct TCB*));
+	if (tid_table == NULL) return -1;
+	free_tids = malloc(tid_table_size * sizeof(uthread_t));
+	if (free_tids == NULL) return -1;
+	num_free_tids = 0;
+	live_threads = 0;
+	zombie_threads = 0;
+	timing_stats = config->stats;
+	start_time = clock_ns();
+	workers[0].cpu_since = cpu_clock_ns();
 
 	// Initialize thread identity information.
 	main_thread->TID = 0;
-	main_thread->context = malloc(sizeof(uthread_ctx_t));
+	main_thread->priority = UTHREAD_PRIO_DEFAULT;
+	main_thread->level = sched_policy == UTHREAD_SCHED_MLFQ ? UTHREAD_PRIO_DEFAULT : 0;
+	memset(&main_thread->context, 0, sizeof(uthread_ctx_t));
+
+	memset(&main_thread->stats, 0, sizeof(main_thread->stats));
 
 	// Initialize joining information.
+	main_thread->lock = 0;
 	main_thread->joiner = NULL;
 	main_thread->return_value = 0;
-	main_thread->collector = 0;
 
-	// The main thread is also the only thread running at the moment.
+	// The main thread is also the only thread running at the moment, on
+	// worker 0.
 	main_thread->status = RUNNING;
-	cur_thread = main_thread;
+	self_worker = &workers[0];
+	workers[0].cur = main_thread;
 	num_thread = 0;
+	tid_table[0] = main_thread;
+
+	// Fill the stack cache so that the first threads don't hit the allocator.
+	default_stack_size = config->stack_size;
+	uthread_ctx_stack_init(config);
+
+	// Worker 0 runs main on the original stack, its scheduling loop needs
+	// one of its own. It's not taken from the stack cache, which is left
+	// to user threads.
+	workers[0].idle_stack = aligned_alloc(CACHE_LINE, IDLE_STACK_SIZE);
+	if (workers[0].idle_stack == NULL) return -1;
+	if (uthread_ctx_init_idle(&workers[0].idle, workers[0].idle_stack,
+				  IDLE_STACK_SIZE, worker_idle))
+		return -1;
+
+	// Set up the stack all threads run on in shared stack mode.
+	use_shared_stack = config->shared_stack_size != 0;
+	if (use_shared_stack && uthread_ctx_shared_start(config->shared_stack_size))
+		return -1;
+
+	// Get ready to wait for I/O. The ring completes operations by writing to
+	// the thread's stack, which in shared stack mode may be another's.
+	if (io_start(use_shared_stack ? 0 : config->io_uring_entries)) return -1;
 
 	// Toggle preemption.
-	if (preempt)
+	if (config->preempt && preempt_start(config)) return -1;
+
+	// Start the other workers.
+	for (unsigned int i = 1; i < num_workers; i++)
 	{
-		preempt_start();
-		// Since main never calls ctx_init, must enable ourselves.
-		preempt_enable();
+		if (pthread_create(&workers[i].pthread, NULL, worker_main, &workers[i]))
+			return -1;
 	}
- 	return 0;
+
+	// Since main never calls ctx_init, must enable ourselves.
+	if (config->preempt) preempt_enable();
+	return 0;
 }
 
+static void worker_unpark(struct worker *w);
+
 int uthread_stop(void)
 {
 	// Main must be running.
-	if (cur_thread != main_thread) 
+	if (self_worker == NULL || self_worker->cur != main_thread)
 		return -1;
 
 	// If there are user threads remaining then user error due to them not joining them all.
-	// Account for 1 in case of main in scheduler, since main doesn't call uthread_exit.
-	if (queue_length(scheduler) > 1 || queue_length(zombie_q)) return -1;
+	if (live_threads) return -1;
 
-	preempt_stop();
+	// Get the other workers out of their scheduling loop.
+	__atomic_store_n(&workers_stopping, 1, __ATOMIC_SEQ_CST);
+	for (unsigned int i = 1; i < num_workers; i++)
+		worker_unpark(&workers[i]);
+	for (unsigned int i = 1; i < num_workers; i++)
+		pthread_join(workers[i].pthread, NULL);
 
-	// Remove main thread if it's still there to allow scheduler to be freed.
-	queue_delete(scheduler, (void*) main_thread);
+	preempt_stop();
+	profile_stop();
+	io_stop();
+	trace_stop();
 
 	// Stop the scheduler.
-	queue_destroy(scheduler);
-	queue_destroy(zombie_q);
-	scheduler = NULL;
-	zombie_q = NULL;
+	free(tid_table);
+	tid_table = NULL;
+	free(free_tids);
+	free_tids = NULL;
+	free(workers[0].idle_stack);
+	for (unsigned int i = 0; stealing && i < num_workers; i++)
+		deque_destroy(&workers[i].deque);
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+	self_worker = NULL;
 
 	// Main thread no longer needed.
-	free(main_thread->context);
-	free(main_thread);
-	cur_thread = NULL;
+	slab_free(&tcb_cache, main_thread);
+	slab_destroy(&tcb_cache);
 	main_thread = NULL;
+
+	// Give cached stacks back to the system.
+	if (use_shared_stack) uthread_ctx_shared_stop();
+	uthread_ctx_stack_cache_flush();
 	return 0;
 }
 
+static int worker_queued(struct worker *w);
+
+int uthread_ready_threads(void)
+{
+	return worker_queued(this_worker());
+}
+
+int uthread_timeouts_pending(void)
+{
+	return __atomic_load_n(&this_worker()->timers.count, __ATOMIC_RELAXED) != 0;
+}
+
+// Queue a ready thread at the end of the queue of its level.
+static void runqueue_push(struct runqueue *queue, struct TCB *thread)
+{
+	iqueue_enqueue(&queue->levels[thread->level], &thread->link);
+	queue->bitmap |= (uint32_t)1 << thread->level;
+	if (thread == main_thread) queue->pinned++;
+	// Read without the lock by idle workers and the preemption handler.
+	__atomic_store_n(&queue->length, queue->length + 1, __ATOMIC_RELAXED);
+}
+
+// Unlink a queued thread.
+static void runqueue_remove(struct runqueue *queue, struct TCB *thread, int level)
+{
+	iqueue_delete(&queue->levels[level], &thread->link);
+	if (iqueue_length(&queue->levels[level]) == 0)
+		queue->bitmap &= ~((uint32_t)1 << level);
+	if (thread == main_thread) queue->pinned--;
+	__atomic_store_n(&queue->length, queue->length - 1, __ATOMIC_RELAXED);
+}
+
+// Take the oldest thread of the highest non-empty level, NULL if none or if
+// that level is beyond max_level.
+static struct TCB *runqueue_pop(struct runqueue *queue, int max_level)
+{
+	if (queue->bitmap == 0)
+		return NULL;
+
+	int level = __builtin_ctz(queue->bitmap);
+	if (level > max_level)
+		return NULL;
+	struct TCB *thread = queue_entry(queue->levels[level].head.next,
+					 struct TCB, link);
+	runqueue_remove(queue, thread, level);
+	return thread;
+}
+
+// Take the oldest thread of the highest level that may run on another worker,
+// NULL if none.
+static struct TCB *runqueue_steal(struct runqueue *queue)
+{
+	for (uint32_t bitmap = queue->bitmap; bitmap; bitmap &= bitmap - 1)
+	{
+		int level = __builtin_ctz(bitmap);
+		struct queue_node *head = &queue->levels[level].head;
+		for (struct queue_node *node = head->next; node != head; node = node->next)
+		{
+			struct TCB *thread = queue_entry(node, struct TCB, link);
+			if (thread != main_thread)
+			{
+				runqueue_remove(queue, thread, level);
+				return thread;
+			}
+		}
+	}
+	return NULL;
+}
+
+// Number of threads another worker could steal from a queue.
+static int runqueue_stealable(struct runqueue *queue)
+{
+	return __atomic_load_n(&queue->length, __ATOMIC_RELAXED) -
+		__atomic_load_n(&queue->pinned, __ATOMIC_RELAXED);
+}
+
+// Put every thread back at the level of its priority.
+// Ready threads of the worker are requeued from the highest level down, so
+// that they keep their relative order within a level. Those queued on other
+// workers are requeued at their new level when they next become ready.
+static void runqueue_boost(struct worker *w)
+{
+	struct iqueue boosted;
+	struct TCB *thread;
+
+	lock_threads();
+	for (size_t tid = 0; tid <= num_thread; tid++)
+	{
+		if (tid_table[tid] != NULL)
+			tid_table[tid]->level = tid_table[tid]->priority;
+	}
+	unlock_threads();
+
+	iqueue_init(&boosted);
+	worker_lock(w);
+	while ((thread = runqueue_pop(&w->queue, UTHREAD_PRIO_LEVELS)) != NULL)
+		iqueue_enqueue(&boosted, &thread->link);
+	struct queue_node *node;
+	while (iqueue_dequeue(&boosted, &node) == 0)
+		runqueue_push(&w->queue, queue_entry(node, struct TCB, link));
+	worker_unlock(w);
+}
+
+// Queue a ready thread on a worker, which must be the calling one when
+// stealing unless the thread is main.
+static void worker_push(struct worker *w, struct TCB *thread)
+{
+	if (!stealing)
+	{
+		worker_lock(w);
+		runqueue_push(&w->queue, thread);
+		worker_unlock(w);
+	} else if (thread == main_thread) {
+		__atomic_store_n(&w->pinned, thread, __ATOMIC_RELEASE);
+	} else if (deque_push(&w->deque, thread)) {
+		perror("deque_push");
+		exit(1);
+	}
+}
+
+// Take the next thread to run from the calling worker's own queue, NULL if
+// none. A yielding prev keeps running unless another thread of its priority
+// level or higher is ready. When stealing, main goes first, then threads are
+// taken oldest first for fairness, like thieves do. Except that a thread
+// blocking to join the newest thread runs it next, while it's cache hot.
+static struct TCB *worker_pop(struct worker *w, struct TCB *prev)
+{
+	struct TCB *next;
+
+	if (!stealing)
+	{
+		worker_lock(w);
+		next = runqueue_pop(&w->queue, prev != NULL && prev->status == RUNNING ?
+				    prev->level : UTHREAD_PRIO_LEVELS);
+		worker_unlock(w);
+		return next;
+	}
+	if (__atomic_load_n(&w->pinned, __ATOMIC_RELAXED) != NULL)
+		return __atomic_exchange_n(&w->pinned, NULL, __ATOMIC_ACQUIRE);
+	if (prev != NULL && prev->status == BLOCKED && w->prev_joined != NULL)
+	{
+		next = deque_pop(&w->deque);
+		if (next == w->prev_joined)
+			return next;
+		if (next != NULL)
+			deque_push(&w->deque, next);
+	}
+	return deque_steal(&w->deque);
+}
+
+// Take a thread from another worker's queue, NULL if none.
+static struct TCB *worker_steal(struct worker *victim)
+{
+	struct TCB *thread;
+
+	if (stealing)
+		return deque_steal(&victim->deque);
+	worker_lock(victim);
+	thread = runqueue_steal(&victim->queue);
+	worker_unlock(victim);
+	return thread;
+}
+
+// Number of threads ready on a worker.
+static int worker_queued(struct worker *w)
+{
+	if (stealing)
+		return deque_length(&w->deque) +
+			(__atomic_load_n(&w->pinned, __ATOMIC_RELAXED) != NULL);
+	return __atomic_load_n(&w->queue.length, __ATOMIC_RELAXED);
+}
+
+// Number of threads another worker could steal from a worker.
+static int worker_stealable(struct worker *w)
+{
+	if (stealing)
+		return deque_length(&w->deque);
+	return runqueue_stealable(&w->queue);
+}
+
+static void futex(int *addr, int op, int val, const struct timespec *timeout)
+{
+	syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+// Time left before a worker's next timeout may expire (in nanoseconds), -1 if
+// there is none.
+static long worker_timeout(struct worker *w)
+{
+	uint64_t next, now;
+
+	if (__atomic_load_n(&w->timers.count, __ATOMIC_RELAXED) == 0)
+		return -1;
+	next = __atomic_load_n(&w->timer_next, __ATOMIC_RELAXED);
+	now = clock_ns();
+	if (next <= now)
+		return 0;
+	return next - now > LONG_MAX ? LONG_MAX : (long) (next - now);
+}
+
+// Expire the timeouts of a worker that are due, with preemption disabled.
+static void worker_timers(struct worker *w)
+{
+	struct timer *expired;
+	uint64_t now;
+
+	if (__atomic_load_n(&w->timers.count, __ATOMIC_RELAXED) == 0)
+		return;
+	now = clock_ns();
+	if (now < __atomic_load_n(&w->timer_next, __ATOMIC_RELAXED))
+		return;
+
+	spin_lock(&w->timer_lock);
+	expired = timer_wheel_expire(&w->timers, now);
+	for (struct timer *timer = expired; timer != NULL; timer = timer->next)
+		timer_entry(timer, struct TCB, timer)->timeout_state = TIMEOUT_FIRING;
+	__atomic_store_n(&w->timer_next, timer_wheel_next(&w->timers), __ATOMIC_RELAXED);
+	spin_unlock(&w->timer_lock);
+
+	// Once done with a timeout, its thread may start another one.
+	while (expired != NULL)
+	{
+		struct TCB *thread = timer_entry(expired, struct TCB, timer);
+		expired = expired->next;
+		int woken = thread->timeout_func(&thread->link, thread->timeout_arg);
+		__atomic_store_n(&thread->timeout_state,
+				 woken ? TIMEOUT_EXPIRED : TIMEOUT_MISSED, __ATOMIC_RELEASE);
+	}
+}
+
+// Whether a worker would find a thread to run, in its queue or another's.
+static int worker_has_work(struct worker *w)
+{
+	if (worker_queued(w))
+		return 1;
+	for (unsigned int i = 0; i < num_workers; i++)
+	{
+		if (worker_stealable(&workers[i]))
+			return 1;
+	}
+	return 0;
+}
+
+// Sleep until woken up by worker_unpark(), unless there's work to do.
+static void worker_park(struct worker *w)
+{
+	// Announce that we're parked before looking for work one last time,
+	// whoever makes a thread ready then either sees us parked or is seen.
+	__atomic_store_n(&w->parked, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&parked_workers, 1, __ATOMIC_SEQ_CST);
+	if (!worker_has_work(w) && !__atomic_load_n(&workers_stopping, __ATOMIC_SEQ_CST))
+	{
+		// One of the parked workers waits for I/O rather than the futex,
+		// if threads are. Unparking it then interrupts io_poll().
+		// Either way, not past the next timeout.
+		int parked = 1;
+		long timeout = worker_timeout(w);
+		struct timespec spec = { timeout / 1000000000, timeout % 1000000000 };
+		if (timeout == 0)
+		{
+			// Due already.
+		} else if (io_waiting() && !__atomic_exchange_n(&io_polling, 1, __ATOMIC_SEQ_CST))
+		{
+			if (__atomic_compare_exchange_n(&w->parked, &parked, PARKED_POLLING, 0,
+							__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				io_poll(timeout);
+			__atomic_store_n(&io_polling, 0, __ATOMIC_SEQ_CST);
+		} else {
+			futex(&w->parked, FUTEX_WAIT_PRIVATE, 1, timeout < 0 ? NULL : &spec);
+		}
+	}
+	// Woken up by a signal or found work, we unpark ourselves.
+	if (__atomic_exchange_n(&w->parked, 0, __ATOMIC_SEQ_CST))
+		__atomic_sub_fetch(&parked_workers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void worker_unpark(struct worker *w)
+{
+	int parked = __atomic_exchange_n(&w->parked, 0, __ATOMIC_SEQ_CST);
+
+	if (parked)
+	{
+		__atomic_sub_fetch(&parked_workers, 1, __ATOMIC_SEQ_CST);
+		if (parked == PARKED_POLLING)
+			io_interrupt();
+		else
+			futex(&w->parked, FUTEX_WAKE_PRIVATE, 1, NULL);
+	}
+}
+
+// A thread was made ready on w, get a parked worker to run it.
+static void worker_notify(struct worker *w)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&parked_workers, __ATOMIC_SEQ_CST) == 0)
+		return;
+	if (__atomic_load_n(&w->parked, __ATOMIC_SEQ_CST))
+	{
+		worker_unpark(w);
+		return;
+	}
+	for (unsigned int i = 1; i < num_workers; i++)
+	{
+		struct worker *other = &workers[(w->index + i) % num_workers];
+		if (__atomic_load_n(&other->parked, __ATOMIC_SEQ_CST))
+		{
+			worker_unpark(other);
+			return;
+		}
+	}
+}
+
+// Find a thread for an idle worker, from its queue or stolen from another's.
+// Victims are tried starting from a random one, so that thieves spread out.
+static struct TCB *worker_next(struct worker *w)
+{
+	struct TCB *next = worker_pop(w, NULL);
+
+	if (next != NULL || num_workers == 1)
+		return next;
+
+	// xorshift32
+	w->random ^= w->random << 13;
+	w->random ^= w->random >> 17;
+	w->random ^= w->random << 5;
+	for (unsigned int i = 0; next == NULL && i < num_workers; i++)
+	{
+		struct worker *victim = &workers[(w->random + i) % num_workers];
+		if (victim != w && worker_stealable(victim))
+			next = worker_steal(victim);
+	}
+	return next;
+}
+
+// Wait for threads to run. Threads often become ready shortly, so look for
+// them for a while before parking. The time spent looking adapts: it doubles
+// when it pays off and halves when it doesn't, so that the workers of a mostly
+// idle process soon stop burning CPU.
+static void worker_wait(struct worker *w)
+{
+	// Whoever waits for I/O may be asleep already, get the operations queued
+	// here going.
+	uring_submit();
+	if (num_workers > 1)
+	{
+		for (unsigned int i = 0; i < w->spins; i++)
+		{
+			if (worker_has_work(w) ||
+			    __atomic_load_n(&workers_stopping, __ATOMIC_RELAXED))
+			{
+				if (w->spins < IDLE_SPINS_MAX) w->spins *= 2;
+				return;
+			}
+			spin_relax();
+		}
+		if (w->spins > IDLE_SPINS_MIN) w->spins /= 2;
+	}
+	worker_park(w);
+}
+
+// Account for a switch from prev to next on a worker, either being NULL for its
+// scheduling loop: the CPU time prev used, and how long next waited if it was
+// ready.
+static void stats_switch(struct worker *w, struct TCB *prev, struct TCB *next)
+{
+	uint64_t cpu = cpu_clock_ns();
+
+	if (prev != NULL)
+		prev->stats.cpu_ns += cpu - w->cpu_since;
+	if (next == NULL)
+		return;
+	if (next->status == READY)
+	{
+		uint64_t wait = clock_ns() - next->ready_since;
+		unsigned int bucket = 63 - __builtin_clzll(wait | 1);
+		next->stats.ready_ns += wait;
+		w->ready_latency[bucket < UTHREAD_STATS_BUCKETS ? bucket :
+				 UTHREAD_STATS_BUCKETS - 1]++;
+	}
+	w->cpu_since = cpu;
+}
+
+// Run threads until uthread_stop(), sleeping while there are none.
+// Worker 0's loop runs in its idle context and is simply not resumed anymore
+// once stopping, as main is running then.
+static void scheduling_loop(struct worker *w)
+{
+	uthread_switch_finish();
+	for (;;)
+	{
+		struct TCB *next = worker_next(w);
+		if (next != NULL)
+		{
+			if (timing_stats) stats_switch(w, NULL, next);
+			w->switches++;
+			next->status = RUNNING;
+			w->cur = next;
+			trace_event(w->index, TRACE_SWITCH, next->TID, TRACE_IDLE);
+			uthread_ctx_switch(&w->idle, &next->context);
+			uthread_switch_finish();
+			continue;
+		}
+		if (w->index && __atomic_load_n(&workers_stopping, __ATOMIC_SEQ_CST))
+			return;
+		worker_wait(w);
+		worker_timers(w);
+	}
+}
+
+// Make a thread ready to run, at the end of the ready queue of its level.
+// Threads go to the queue of the worker making them ready, except main which
+// only runs on worker 0.
+static void uthread_ready(struct TCB *thread)
+{
+	struct worker *w = thread == main_thread ? &workers[0] : this_worker();
+
+	// Recorded by the caller's worker, whether or not the thread goes there.
+	if (thread->status == BLOCKED)
+		trace_event(this_worker()->index, TRACE_WAKE, thread->TID,
+			    worker_tid(this_worker()));
+	thread->status = READY;
+	if (timing_stats) thread->ready_since = clock_ns();
+	worker_push(w, thread);
+	// There may be two runnable threads now, get the timer going again.
+	preempt_rearm(w->index);
+	if (num_workers > 1) worker_notify(w);
+}
+
+void uthread_attr_init(struct uthread_attr *attr)
+{
+	attr->stack_size = 0;
+	attr->priority = UTHREAD_PRIO_DEFAULT;
+}
+
 int uthread_create(uthread_func_t func)
 {
-	// Do not force yield in the middle of initializing a new thread.
+	return uthread_create_attr(func, NULL);
+}
+
+// Body of the threads created by uthread_create_data().
+static int uthread_data_thread(void)
+{
+	struct TCB *self;
+
 	preempt_disable();
-	// TID overflow check.
-	if (num_thread == USHRT_MAX)
+	self = this_worker()->cur;
+	preempt_enable();
+	return self->data_func(self->data);
+}
+
+// Create a thread running @func, or @data_func given a copy of @size bytes at
+// @data if not NULL.
+static int uthread_create_thread(uthread_func_t func, const struct uthread_attr *attr,
+				 uthread_data_func_t data_func, const void *data,
+				 size_t size)
+{
+	int priority = attr != NULL ? attr->priority : UTHREAD_PRIO_DEFAULT;
+	if (priority < 0 || priority >= UTHREAD_PRIO_LEVELS)
 		return -1;
-	num_thread++;
+
+	// Do not force yield in the middle of initializing a new thread.
+	preempt_disable();
+	lock_threads();
+	// Without a TID to hand out again, take a new one.
+	if (num_free_tids == 0)
+	{
+		// TID overflow check.
+		if (num_thread == USHRT_MAX)
+			goto fail;
+
+		// Make room in the TID table, and for its TIDs once collected.
+		if ((size_t) num_thread + 1 == tid_table_size)
+		{
+			uthread_t *tids = realloc(free_tids, 2 * tid_table_size * sizeof(uthread_t));
+			if (tids == NULL)
+				goto fail;
+			free_tids = tids;
+			struct TCB **table = realloc(tid_table, 2 * tid_table_size * sizeof(struct TCB*));
+			if (table == NULL)
+				goto fail;
+			memset(table + tid_table_size, 0, tid_table_size * sizeof(struct TCB*));
+			tid_table = table;
+			tid_table_size *= 2;
+		}
+	}
 
 	// Allocate a TCB for the new thread.
-	struct TCB *new_thread = malloc(sizeof(struct TCB));
+	struct TCB *new_thread = slab_alloc(&tcb_cache);
 	if (new_thread == NULL)
-		return -1;
+		goto fail;
+	new_thread->TID = num_free_tids ? free_tids[--num_free_tids] : ++num_thread;
+	unlock_threads();
 
 	// Initialize execution context of the new thread.
-	new_thread->TID = num_thread;
 	new_thread->status = READY;
-	new_thread->stack = uthread_ctx_alloc_stack();
-	new_thread->context = malloc(sizeof(uthread_ctx_t));
-	if (uthread_ctx_init(new_thread->context, new_thread->stack, func))
-		return -1;
+	new_thread->priority = priority;
+	new_thread->level = sched_policy == UTHREAD_SCHED_MLFQ ? priority : 0;
+	new_thread->data_func = data_func;
+	new_thread->data = NULL;
+	if (data_func != NULL)
+		func = uthread_data_thread;
+	if (use_shared_stack)
+	{
+		// Runs on the shared stack, no stack of its own.
+		new_thread->stack_size = 0;
+		new_thread->stack = NULL;
+		if (data_func != NULL)
+		{
+			new_thread->data = malloc(size ? size : 1);
+			if (new_thread->data == NULL)
+				goto fail_tcb;
+			memcpy(new_thread->data, data, size);
+		}
+		if (uthread_ctx_init_shared(&new_thread->context, func))
+			goto fail_data;
+	} else {
+		size_t usable;
+		new_thread->stack_size = default_stack_size;
+		if (attr != NULL && attr->stack_size)
+			new_thread->stack_size = attr->stack_size;
+		if (new_thread->stack_size < PTHREAD_STACK_MIN)
+			goto fail_tcb;
+		if (data_func != NULL && size > new_thread->stack_size / 2)
+			goto fail_tcb;
+		new_thread->stack = uthread_ctx_alloc_stack(new_thread->stack_size);
+		if (new_thread->stack == NULL)
+			goto fail_tcb;
+		// The data goes on top, aligned for any type, and the thread's
+		// frames below it.
+		usable = new_thread->stack_size;
+		if (data_func != NULL)
+		{
+			usable = (new_thread->stack_size - size) & ~(size_t) 15;
+			new_thread->data = (char *) new_thread->stack + usable;
+			memcpy(new_thread->data, data, size);
+		}
+		if (uthread_ctx_init(&new_thread->context, new_thread->stack,
+				     usable, func))
+			goto fail_stack;
+	}
+
+	memset(&new_thread->stats, 0, sizeof(new_thread->stats));
 
 	// Initialize joining information.
+	new_thread->lock = 0;
 	new_thread->joiner = NULL;
 	new_thread->return_value = 0;
-	new_thread->collector = 0;
 
-	queue_enqueue(scheduler, new_thread);
+	lock_threads();
+	tid_table[new_thread->TID] = new_thread;
+	live_threads++;
+	unlock_threads();
+	trace_event(this_worker()->index, TRACE_CREATE, new_thread->TID,
+		    this_worker()->cur->TID);
+	uthread_ready(new_thread);
 	preempt_enable();
 	return new_thread->TID;
+
+fail_data:
+	free(new_thread->data);
+fail_stack:
+	// No-op for threads on the shared stack.
+	uthread_ctx_destroy_stack(new_thread->stack, new_thread->stack_size);
+fail_tcb:
+	// Give the TID and the TCB back.
+	lock_threads();
+	free_tids[num_free_tids++] = new_thread->TID;
+	slab_free(&tcb_cache, new_thread);
+fail:
+	unlock_threads();
+	preempt_enable();
+	return -1;
+}
+
+int uthread_create_attr(uthread_func_t func, const struct uthread_attr *attr)
+{
+	return uthread_create_thread(func, attr, NULL, NULL, 0);
+}
+
+int uthread_create_data(uthread_data_func_t func, const void *data, size_t size,
+			const struct uthread_attr *attr)
+{
+	if (func == NULL)
+		return -1;
+	return uthread_create_thread(NULL, attr, func, data, size);
+}
+
+void uthread_switch_finish(void)
+{
+	struct worker *w = this_worker();
+	struct TCB *prev = w->prev;
+
+	if (prev == NULL)
+		return;
+	w->prev = NULL;
+
+	switch (prev->status)
+	{
+	case READY:
+		// Yielded, can now be run again, here or by another worker.
+		if (timing_stats) prev->ready_since = clock_ns();
+		worker_push(w, prev);
+		break;
+	case BLOCKED:
+		// Its context is saved, let it be made ready.
+		if (w->prev_lock != NULL)
+			spin_unlock(w->prev_lock);
+		w->prev_lock = NULL;
+		w->prev_joined = NULL;
+		break;
+	case EXITING:
+	{
+		// Off its stack, it can be collected now.
+		lock_thread(prev);
+		prev->status = ZOMBIE;
+		struct TCB *joiner = prev->joiner;
+		unlock_thread(prev);
+		__atomic_add_fetch(&zombie_threads, 1, __ATOMIC_RELAXED);
+		// If thread is joined, unblock its joiner, unless it was
+		// switched to directly.
+		if (joiner != NULL && joiner->status == BLOCKED)
+			uthread_ready(joiner);
+		break;
+	}
+	}
+	// The previous thread is switched out, its timeout may expire.
+	worker_timers(w);
+}
+
+// Switch from the running thread prev to next, or to the scheduling loop if
+// NULL, with preemption already disabled.
+static void uthread_switch_to(struct worker *w, struct TCB *prev, struct TCB *next)
+{
+	// Pause the current thread, it's put back into the scheduler once
+	// switched out.
+	if (prev->status == RUNNING)
+		prev->status = READY;
+	w->prev = prev;
+	trace_event(w->index, TRACE_SWITCH, next != NULL ? next->TID : TRACE_IDLE, prev->TID);
+	if (timing_stats) stats_switch(w, prev, next);
+	if (next != NULL)
+	{
+		w->switches++;
+		next->status = RUNNING;
+		w->cur = next;
+		uthread_ctx_switch(&prev->context, &next->context);
+	} else {
+		// Nothing to run here, let the scheduling loop find something.
+		w->cur = NULL;
+		uthread_ctx_switch(&prev->context, &w->idle);
+	}
+	// We're back, possibly on another worker.
+	uthread_switch_finish();
+}
+
+// Switch to the next ready thread, with preemption already disabled.
+// The caller re-enables preemption once it's been switched back to, if ever.
+static void uthread_schedule(void)
+{
+	struct worker *w = this_worker();
+	struct TCB *prev = w->cur;
+	struct TCB *next;
+
+	// Threads waiting for I/O while others keep this worker busy get to run
+	// now and then, and operations they queued in the ring get submitted.
+	// Not when blocking, as the lock held may be a descriptor's or the
+	// ring's.
+	if (prev->status == RUNNING && io_waiting() &&
+	    (++w->switches_since_poll >= IO_POLL_SWITCHES || uring_queued()))
+	{
+		w->switches_since_poll = 0;
+		io_poll(0);
+	}
+	// Likewise for threads whose timeout is due, on preemption ticks too.
+	if (prev->status == RUNNING)
+		worker_timers(w);
+
+	// Prevent threads from yielding onto themselves.
+	next = worker_pop(w, prev);
+	if (next == NULL && prev->status == RUNNING)
+		return;
+	// An exiting thread with nothing else to run hands over to its joiner
+	// if it's waiting already, rather than going through the scheduling
+	// loop. Holding the lock means the joiner is switched out.
+	if (next == NULL && prev->status == EXITING)
+	{
+		lock_thread(prev);
+		struct TCB *joiner = prev->joiner;
+		unlock_thread(prev);
+		if (joiner != NULL && (joiner != main_thread || w->index == 0))
+		{
+			trace_event(w->index, TRACE_WAKE, joiner->TID, prev->TID);
+			next = joiner;
+		}
+	}
+
+	uthread_switch_to(w, prev, next);
 }
 
 void uthread_yield(void)
 {
 	// Do not force yield while the process is yielding already.
 	preempt_disable();
-	// Prevent threads from yielding onto themselves.
-	if (queue_length(scheduler) || cur_thread->status == ZOMBIE)
-	{
-		// Save current thread info for context switching.
-		struct TCB *prev_thread = cur_thread;
+	this_worker()->cur->stats.yields++;
+	trace_running(TRACE_YIELD);
+	uthread_schedule();
+	// We're back, allow preemption again.
+	preempt_enable();
+}
 
-		// Pause the current thread and put it back into the scheduler.
-		if (cur_thread->status == RUNNING)
+void uthread_preempt_yield(void)
+{
+	preempt_disable();
+	if (sched_policy == UTHREAD_SCHED_MLFQ)
+	{
+		struct worker *w = this_worker();
+		// Used up its quantum, demote.
+		if (w->cur->level < UTHREAD_PRIO_LEVELS - 1)
+			w->cur->level++;
+		// Time to give demoted threads their priority back.
+		if (boost_ticks && ++w->ticks_since_boost >= boost_ticks)
 		{
-			cur_thread->status = READY;
-			queue_enqueue(scheduler, cur_thread);
+			w->ticks_since_boost = 0;
+			runqueue_boost(w);
 		}
+	}
+	this_worker()->cur->stats.preemptions++;
+	trace_running(TRACE_PREEMPT);
+	uthread_schedule();
+	preempt_enable();
+}
 
-		// Get the oldest ready thread, and set that to be the current running thread.
-		// If no ready user threads, default to main.
-		if (queue_length(scheduler))
-			queue_dequeue(scheduler, (void**) &cur_thread);
-		else
-			cur_thread = main_thread;
-		cur_thread->status = RUNNING;
+struct queue_node *uthread_waiter(void)
+{
+	return &this_worker()->cur->link;
+}
+
+void uthread_block(int *lock)
+{
+	struct worker *w = this_worker();
 
-		// Switch context, then allow preemption on the way back.
-		// Except for threads that return to collecting in join since they edit data.
-		uthread_ctx_switch(prev_thread->context, cur_thread->context);
-		if (!cur_thread->collector) preempt_enable();
+	trace_event(w->index, TRACE_BLOCK, w->cur->TID, 0);
+	w->cur->status = BLOCKED;
+	w->prev_lock = lock;
+	uthread_schedule();
+}
+
+void uthread_wake(struct queue_node *waiter, int yield)
+{
+	struct TCB *thread = queue_entry(waiter, struct TCB, link);
+	struct worker *w = this_worker();
+
+	// Main only runs on worker 0, it can't be switched to from another.
+	if (!yield || (thread == main_thread && w->index != 0))
+	{
+		uthread_ready(thread);
+		return;
+	}
+	trace_event(w->index, TRACE_WAKE, thread->TID, w->cur->TID);
+	trace_event(w->index, TRACE_YIELD, w->cur->TID, 0);
+	uthread_switch_to(w, w->cur, thread);
+}
+
+void uthread_timeout_start(uint64_t timeout_ns, uthread_timeout_func_t func, void *arg)
+{
+	struct worker *w = this_worker();
+	struct TCB *self = w->cur;
+	uint64_t now = clock_ns();
+
+	self->timer.expires = timeout_ns > UINT64_MAX - now ? UINT64_MAX : now + timeout_ns;
+	self->timeout_worker = w;
+	self->timeout_func = func;
+	self->timeout_arg = arg;
+	spin_lock(&w->timer_lock);
+	self->timeout_state = TIMEOUT_PENDING;
+	timer_wheel_add(&w->timers, &self->timer);
+	if (self->timer.expires < w->timer_next)
+		__atomic_store_n(&w->timer_next, self->timer.expires, __ATOMIC_RELAXED);
+	spin_unlock(&w->timer_lock);
+	// Preemption ticks check timeouts, get them going again.
+	preempt_rearm(w->index);
+}
+
+int uthread_timeout_cancel(void)
+{
+	struct TCB *self = this_worker()->cur;
+	struct worker *w = self->timeout_worker;
+	int state;
+
+	spin_lock(&w->timer_lock);
+	state = self->timeout_state;
+	if (state == TIMEOUT_PENDING)
+		timer_wheel_del(&w->timers, &self->timer);
+	spin_unlock(&w->timer_lock);
+	// Expiring, wait for it to be done with us.
+	while (state == TIMEOUT_FIRING)
+	{
+		spin_relax();
+		state = __atomic_load_n(&self->timeout_state, __ATOMIC_ACQUIRE);
 	}
+	self->timeout_state = TIMEOUT_NONE;
+	return state == TIMEOUT_EXPIRED;
+}
+
+// A sleeping thread's timeout, only it wakes it up.
+static int uthread_sleep_expired(struct queue_node *waiter, void *arg)
+{
+	(void) arg;
+	uthread_wake(waiter, 0);
+	return 1;
+}
+
+int uthread_sleep_ns(uint64_t ns)
+{
+	if (self_worker == NULL)
+		return -1;
+	preempt_disable();
+	uthread_timeout_start(ns, uthread_sleep_expired, NULL);
+	uthread_block(NULL);
+	uthread_timeout_cancel();
+	preempt_enable();
+	return 0;
 }
 
 uthread_t uthread_self(void)
 {
+	uthread_t tid;
+
 	// If there's no thread running can't return anything.
-	if (cur_thread == NULL)
+	if (self_worker == NULL)
+		return -1;
+	// Don't move to another worker while looking at its current thread.
+	preempt_disable();
+	tid = this_worker()->cur->TID;
+	preempt_enable();
+	return tid;
+}
+
+int uthread_running_stack(uthread_t *tid, void **stack, size_t *size)
+{
+	struct worker *w = self_worker;
+	struct TCB *cur;
+
+	if (w == NULL || (cur = w->cur) == NULL)
 		return -1;
-	return cur_thread->TID;
+	*tid = cur->TID;
+	*stack = cur != main_thread ? cur->stack : NULL;
+	*size = cur != main_thread ? cur->stack_size : 0;
+	return 0;
 }
 
 void uthread_exit(int retval)
 {
-	// Do not force yield while cur_thread and the queue are being edited.
+	// Do not force yield while the thread and the queue are being edited.
 	preempt_disable();
-	cur_thread->status = ZOMBIE;
-	cur_thread->return_value = retval;
-	// If thread is joined, unblock its joiner.
-	if (cur_thread->joiner != NULL)
-	{
-		// Move joiner to the end of the ready queue.
-		cur_thread->joiner->status = READY;
-		queue_enqueue(scheduler, cur_thread->joiner);
-	} else {
-		// Add to zombie queue to be freed later when joined.
-		// If already joined, joiner will free when they resume.
-		queue_enqueue(zombie_q, cur_thread);
-	}
-	uthread_yield();
+	struct TCB *self = this_worker()->cur;
+	self->return_value = retval;
+	// This context never resumes, its shared stack copy is useless.
+	uthread_ctx_release(&self->context);
+	// Stays in the TID table to be freed later when joined.
+	// It becomes a zombie and its joiner is woken up once switched out, see
+	// uthread_switch_finish().
+	self->status = EXITING;
+	trace_running(TRACE_EXIT);
+	uthread_schedule();
 }
 
-// Searches for a thread within a particular queue by TID
-int uthread_search(queue_t queue, void *incoming, void *check)
+// A joiner's timeout. Unless the child is exiting, in which case it wakes the
+// joiner up, the joiner gives up on it.
+static int uthread_join_expired(struct queue_node *waiter, void *arg)
 {
-	(void) queue;
-	if (((struct TCB*) incoming)->TID == *(uthread_t*) check) return 1;
-	return 0;
+	struct TCB *self = queue_entry(waiter, struct TCB, link);
+	struct TCB *child = arg;
+	int woken = 0;
+
+	lock_thread(child);
+	if (child->joiner == self && child->status != EXITING && child->status != ZOMBIE)
+	{
+		child->joiner = NULL;
+		woken = 1;
+	}
+	unlock_thread(child);
+	if (woken) uthread_wake(waiter, 0);
+	return woken;
 }
 
-int uthread_join(uthread_t tid, int *retval)
+// Join a thread, giving up after @timeout_ns if @timed.
+static int uthread_join_thread(uthread_t tid, int *retval, int timed, uint64_t timeout_ns)
 {
-	// Do not change the makeup of the queue while searching for tid.
+	// Do not change the makeup of the TID table while looking up tid.
 	preempt_disable();
+	struct TCB *self = this_worker()->cur;
 	struct TCB *child = NULL;
-	// Search for the tid within the scheduler. If not there, check to see if it's a zombie.
-	queue_iterate(scheduler, uthread_search, (void*) &tid, (void**) &child);
-	if (child == NULL) queue_iterate(zombie_q, uthread_search, (void*) &tid, (void**) &child);
-	// tid doesn't exist.
-	if (child == NULL) return -1;
-	// tid is main, the calling thread, or already joined.
-	if (tid == 0 || tid == cur_thread->TID || child->joiner != NULL) 
+	lock_threads();
+	if (tid <= num_thread) child = tid_table[tid];
+	// tid doesn't exist, is main, or the calling thread.
+	if (child == NULL || tid == 0 || child == self)
+	{
+		unlock_threads();
+		preempt_enable();
+		return -1;
+	}
+	// Only a joiner frees the child, and it can't be removed from the
+	// table while we hold the table lock, so it's safe to lock.
+	lock_thread(child);
+	unlock_threads();
+	// Already joined.
+	if (child->joiner != NULL)
+	{
+		unlock_thread(child);
+		preempt_enable();
 		return -1;
+	}
 
-	// If the child is a zombie, collect its return status and move on.
+	child->joiner = self;
 	if (child->status == ZOMBIE)
 	{
-		if (retval != NULL) *retval = child->return_value;
-		queue_delete(zombie_q, child);
+		// If the child is a zombie, collect its return status and move on.
+		unlock_thread(child);
 	}
 	else {
 		// Block the current thread and yield.
-		child->joiner = cur_thread;
-		cur_thread->status = BLOCKED;
-		cur_thread->collector = 1;
-		uthread_yield();
-		// We're back, collect then terminate the joined thread.
-		cur_thread->collector = 0;
-		if (retval != NULL) *retval = child->return_value;
-	}
-	uthread_ctx_destroy_stack(child->stack);
-	free(child->context);
-	free(child);
+		// The child's lock is released once we're switched out, so that
+		// it can't make us ready before then.
+		// Preemption stays disabled when we're back, since we edit data.
+		uint64_t since = timing_stats ? clock_ns() : 0;
+		if (timed)
+			uthread_timeout_start(timeout_ns, uthread_join_expired, child);
+		this_worker()->prev_joined = child;
+		uthread_block(&child->lock);
+		if (timing_stats) self->stats.join_ns += clock_ns() - since;
+		// Gave up, the child lives on.
+		if (timed && uthread_timeout_cancel())
+		{
+			preempt_enable();
+			return 1;
+		}
+	}
+	// We're back, collect then terminate the joined thread.
+	if (retval != NULL) *retval = child->return_value;
+	uthread_ctx_release(&child->context);
+	uthread_ctx_destroy_stack(child->stack, child->stack_size);
+	// Without a stack of its own, its data was allocated.
+	if (use_shared_stack) free(child->data);
+	// No longer a zombie before no longer live, see uthread_stats().
+	__atomic_sub_fetch(&zombie_threads, 1, __ATOMIC_RELAXED);
+	lock_threads();
+	tid_table[tid] = NULL;
+	free_tids[num_free_tids++] = tid;
+	live_threads--;
+	slab_free(&tcb_cache, child);
+	unlock_threads();
+	preempt_enable();
+	return 0;
+}
+
+int uthread_join(uthread_t tid, int *retval)
+{
+	return uthread_join_thread(tid, retval, 0, 0);
+}
+
+int uthread_join_timeout(uthread_t tid, int *retval, uint64_t timeout_ns)
+{
+	return uthread_join_thread(tid, retval, 1, timeout_ns);
+}
+
+int uthread_thread_stats(uthread_t tid, struct uthread_thread_stats *stats)
+{
+	struct worker *w;
+	struct TCB *thread = NULL;
+
+	if (self_worker == NULL) return -1;
+	// The TCB stays put while the TID table is locked.
+	preempt_disable();
+	w = this_worker();
+	lock_threads();
+	if (tid <= num_thread) thread = tid_table[tid];
+	if (thread != NULL)
+	{
+		*stats = thread->stats;
+		// The running thread's time includes its current run, on this
+		// kernel thread.
+		if (thread == w->cur && timing_stats)
+			stats->cpu_ns += cpu_clock_ns() - w->cpu_since;
+	}
+	unlock_threads();
 	preempt_enable();
+	return thread != NULL ? 0 : -1;
+}
+
+int uthread_stats(struct uthread_stats *stats)
+{
+	if (self_worker == NULL) return -1;
+	memset(stats, 0, sizeof(*stats));
+	stats->uptime_ns = clock_ns() - start_time;
+	for (unsigned int i = 0; i < num_workers; i++)
+	{
+		struct worker *w = &workers[i];
+		stats->switches += __atomic_load_n(&w->switches, __ATOMIC_RELAXED);
+		stats->ready += worker_queued(w);
+		for (int j = 0; j < UTHREAD_STATS_BUCKETS; j++)
+			stats->ready_latency[j] += __atomic_load_n(&w->ready_latency[j],
+								   __ATOMIC_RELAXED);
+	}
+	// The counters change meanwhile: a thread created and exited between the
+	// two loads is a zombie that isn't counted live yet.
+	int live = __atomic_load_n(&live_threads, __ATOMIC_RELAXED);
+	int zombies = __atomic_load_n(&zombie_threads, __ATOMIC_RELAXED);
+	stats->zombies = zombies;
+	stats->live = live > zombies ? live - zombies : 0;
 	return 0;
 }
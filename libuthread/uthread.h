@@ -1,14 +1,25 @@
 #ifndef _UTHREAD_H
 #define _UTHREAD_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * uthread_t - Thread identifier (TID) type
  *
- * Each user thread is assigned a different TID. TID are assigned in increasing
- * order and numbered starting from 1 (apart from the 'main' thread who
- * automatically gets TID #0). Overflowing the current TID value is considered a
- * case of failure (in other words, it is impossible to create more than
- * USHRT_MAX threads).
+ * Each user thread is assigned a different TID, numbered starting from 1
+ * (apart from the 'main' thread who automatically gets TID #0). The TID of a
+ * thread is given to a new thread once the thread is joined, so a TID must not
+ * be used after joining its thread. Overflowing the current TID value is
+ * considered a case of failure (in other words, it is impossible to have more
+ * than USHRT_MAX threads created and not joined yet).
  */
 typedef unsigned short uthread_t;
 
@@ -19,6 +30,145 @@ typedef unsigned short uthread_t;
  */
 typedef int (*uthread_func_t)(void);
 
+/*
+ * uthread_data_func_t - Thread function type, given the thread's data
+ * @data: Address of the thread's copy of the data it was created with
+ *
+ * Return: Integer value
+ */
+typedef int (*uthread_data_func_t)(void *data);
+
+/*
+ * Preemption clocks
+ *
+ * UTHREAD_CLOCK_CPU measures the quantum in CPU time consumed by the kernel
+ * thread of each worker (so time the kernel runs other workers or processes
+ * doesn't count against a thread), UTHREAD_CLOCK_WALL in elapsed (monotonic)
+ * time.
+ */
+enum {
+	UTHREAD_CLOCK_CPU,
+	UTHREAD_CLOCK_WALL,
+};
+
+/*
+ * Scheduling policies
+ *
+ * UTHREAD_SCHED_FIFO runs ready threads in the order they became ready,
+ * regardless of their priority.
+ *
+ * UTHREAD_SCHED_MLFQ is a multi-level feedback queue: the next thread to run
+ * is always the oldest ready thread of the highest priority level. A thread
+ * starts at the level of its priority, and is demoted one level each time the
+ * preemption timer forcefully yields it, whereas a thread yielding or blocking
+ * on its own keeps its level. Every so often, all threads are put back at the
+ * level of their priority so that demoted threads are not starved.
+ */
+enum {
+	UTHREAD_SCHED_FIFO,
+	UTHREAD_SCHED_MLFQ,
+};
+
+/* Number of priority levels, 0 being the highest priority */
+#define UTHREAD_PRIO_LEVELS 32
+/* Priority of threads created without a specific one, and of main */
+#define UTHREAD_PRIO_DEFAULT 8
+
+/*
+ * struct uthread_config - Library configuration
+ * @preempt: Preemption enable
+ * @quantum_us: Time slice after which a running thread is preempted (in
+ *	microseconds)
+ * @preempt_clock: Clock measuring the time slice (UTHREAD_CLOCK_CPU or
+ *	UTHREAD_CLOCK_WALL)
+ * @sched_policy: Scheduling policy (UTHREAD_SCHED_FIFO or UTHREAD_SCHED_MLFQ)
+ * @boost_ticks: With UTHREAD_SCHED_MLFQ, number of preemptions after which all
+ *	threads get back to the level of their priority (0 never does)
+ * @tickless: Stop the preemption timer while there is no other thread ready to
+ *	run, and restart it when one becomes ready
+ * @workers: Number of kernel threads running user threads (M:N mode when more
+ *	than one). The thread calling uthread_start_config() is the first of
+ *	them, and the only one running 'main'; the others are started as
+ *	pthreads. Any other thread may run on any kernel thread, and move to
+ *	another one whenever it yields, blocks or is preempted, so it must not
+ *	keep the address of a thread-local variable (errno included) across
+ *	those. Each worker runs the threads it made ready, and idle workers
+ *	steal threads from the others; with FIFO scheduling, without taking any
+ *	lock.
+ * @stack_size: Default size of a thread's stack (in bytes), at least
+ *	PTHREAD_STACK_MIN
+ * @stack_guard: Put an inaccessible guard page below every stack, so that a
+ *	stack overflow faults (each guarded stack costs two memory mappings
+ *	instead of one, which matters against the system's limit on mappings
+ *	when running tens of thousands of threads)
+ * @stack_cache_max: Maximum number of free stacks kept for reuse in each stack
+ *	size class (0 disables the stack cache)
+ * @stack_cache_prewarm: Number of default-sized stacks allocated and put in the
+ *	cache when the library starts
+ * @shared_stack_size: If not 0, enable shared stack mode with a shared stack of
+ *	this size (in bytes). Threads then all run on the shared stack, and a
+ *	switched-out thread only keeps a copy of the part of the stack it used,
+ *	which trades some switch latency for much less memory per idle thread.
+ *	In this mode, the address of an object on a thread's stack must not be
+ *	used by other threads. Not available with the ucontext backend, or with
+ *	more than one worker.
+ * @io_uring_entries: If not 0, submit the operations of uthread_pread() and
+ *	the like to an io_uring instance with a submission ring of this size
+ *	(rounded up to a power of two), rather than performing them
+ *	synchronously. Ignored in shared stack mode, or if the kernel doesn't
+ *	support io_uring.
+ * @trace_events: If not 0, number of scheduler events each worker keeps for
+ *	uthread_trace_dump() (rounded up to a power of two), the oldest being
+ *	overwritten. Recording them is off until uthread_trace_enable().
+ * @stats: Measure the times of thread statistics and the ready latency
+ *	histogram (see uthread_stats()), which costs reading the clock on every
+ *	switch
+ * @profile_samples: If not 0, number of samples each worker keeps for
+ *	uthread_profile_dump(), taken on every preemption tick. Requires
+ *	@preempt, and disables @tickless so that a thread running alone is
+ *	sampled too. Sampling is off until uthread_profile_enable(), and a
+ *	worker stops sampling once it took that many samples.
+ *
+ * A configuration should first be filled with the default values by
+ * uthread_config_init(), then adjusted before being passed to
+ * uthread_start_config().
+ */
+struct uthread_config {
+	int preempt;
+	long quantum_us;
+	int preempt_clock;
+	int sched_policy;
+	unsigned int boost_ticks;
+	int tickless;
+	unsigned int workers;
+	size_t stack_size;
+	int stack_guard;
+	unsigned int stack_cache_max;
+	unsigned int stack_cache_prewarm;
+	size_t shared_stack_size;
+	unsigned int io_uring_entries;
+	size_t trace_events;
+	int stats;
+	size_t profile_samples;
+};
+
+/*
+ * uthread_config_init - Initialize a configuration with default values
+ * @config: Configuration to initialize
+ */
+void uthread_config_init(struct uthread_config *config);
+
+/*
+ * uthread_start_config - Start the multithreading library
+ * @config: Library configuration
+ *
+ * Same as uthread_start(), with every setting taken from @config.
+ *
+ * Return: 0 in case of success, -1 in case of failure (e.g., memory
+ * allocation, invalid configuration).
+ */
+int uthread_start_config(const struct uthread_config *config);
+
 /*
  * uthread_start - Start the multithreading library
  * @preempt: Preemption enable
@@ -56,6 +206,61 @@ int uthread_stop(void);
  */
 int uthread_create(uthread_func_t func);
 
+/*
+ * struct uthread_attr - Thread attributes
+ * @stack_size: Size of the thread's stack (in bytes), or 0 for the default size
+ *	of the library configuration. Smaller than PTHREAD_STACK_MIN, the thread
+ *	can't be created. Stack memory is only committed as the
+ *	thread touches it, so a large stack only costs address space until used.
+ * @priority: Priority of the thread, from 0 (highest) to
+ *	UTHREAD_PRIO_LEVELS - 1 (lowest). Only used by UTHREAD_SCHED_MLFQ.
+ *
+ * Attributes should first be filled with the default values by
+ * uthread_attr_init(), then adjusted before being passed to
+ * uthread_create_attr().
+ */
+struct uthread_attr {
+	size_t stack_size;
+	int priority;
+};
+
+/*
+ * uthread_attr_init - Initialize thread attributes with default values
+ * @attr: Thread attributes to initialize
+ */
+void uthread_attr_init(struct uthread_attr *attr);
+
+/*
+ * uthread_create_attr - Create a new thread with specific attributes
+ * @func: Function to be executed by the thread
+ * @attr: Attributes of the new thread, or NULL for the default attributes
+ *
+ * Same as uthread_create(), with the new thread's properties taken from @attr.
+ *
+ * Return: -1 in case of failure (memory allocation, context creation, TID
+ * overflow, invalid priority or stack size, etc.), or the TID of the new thread.
+ */
+int uthread_create_attr(uthread_func_t func, const struct uthread_attr *attr);
+
+/*
+ * uthread_create_data - Create a new thread running a function on some data
+ * @func: Function to be executed by the thread
+ * @data: Address of the data to pass @func a copy of
+ * @size: Size of the data (in bytes), at most half the thread's stack size
+ * @attr: Attributes of the new thread, or NULL for the default attributes
+ *
+ * Same as uthread_create_attr(), except that @func is given the address of a
+ * copy of @data, which stays valid until the thread is joined. The copy is
+ * made on top of the new thread's stack, so it costs no allocation, except in
+ * shared stack mode. It is a plain copy of bytes, aligned for any type.
+ *
+ * Return: -1 in case of failure (memory allocation, context creation, TID
+ * overflow, invalid priority, data too large, etc.), or the TID of the new
+ * thread.
+ */
+int uthread_create_data(uthread_data_func_t func, const void *data, size_t size,
+			const struct uthread_attr *attr);
+
 /*
  * uthread_self - Get thread identifier
  *
@@ -71,6 +276,18 @@ uthread_t uthread_self(void);
  */
 void uthread_yield(void);
 
+/*
+ * uthread_sleep_ns - Sleep for a while
+ * @ns: Time to sleep (in nanoseconds)
+ *
+ * Block the calling thread for at least @ns nanoseconds, letting other threads
+ * run meanwhile. The thread is made ready again by the worker it blocked on,
+ * which sleeps until then if it has nothing else to run.
+ *
+ * Return: -1 if the library was not started. 0 once the time has passed.
+ */
+int uthread_sleep_ns(uint64_t ns);
+
 /*
  * uthread_exit - Exit from currently running thread
  * @retval: Return value
@@ -104,4 +321,707 @@ void uthread_exit(int retval);
  */
 int uthread_join(uthread_t tid, int *retval);
 
+/*
+ * uthread_join_timeout - Join a thread, giving up after a while
+ * @tid: TID of the thread to join
+ * @retval: Address of an integer that will receive the return value
+ * @timeout_ns: Time to wait for thread @tid to complete (in nanoseconds)
+ *
+ * Same as uthread_join(), unless thread @tid is still running @timeout_ns
+ * nanoseconds later, in which case it can be joined again.
+ *
+ * Return: -1 in the same cases as uthread_join(). 1 if the time ran out. 0
+ * otherwise.
+ */
+int uthread_join_timeout(uthread_t tid, int *retval, uint64_t timeout_ns);
+
+/*
+ * Synchronization
+ *
+ * Mutexes, semaphores and condition variables block threads that have to wait
+ * in a wait queue of their own, off the ready queue, instead of having them
+ * spin or yield until they can proceed. A thread that doesn't have to wait,
+ * and one that releases a mutex or semaphore nobody is waiting for, only goes
+ * through an atomic operation, never through the scheduler.
+ *
+ * A mutex or semaphore released while threads wait for it is handed over to
+ * the oldest of them directly, without being released in between, so that no
+ * other thread can take it first. Waiters thus get it in FIFO order.
+ *
+ * These can't be used from a signal handler.
+ */
+
+/*
+ * uthread_mutex_t - Mutex type
+ */
+typedef struct uthread_mutex* uthread_mutex_t;
+
+/*
+ * uthread_mutex_create - Allocate an unlocked mutex
+ *
+ * Return: Pointer to new mutex. NULL in case of failure when allocating the
+ * new mutex.
+ */
+uthread_mutex_t uthread_mutex_create(void);
+
+/*
+ * uthread_mutex_destroy - Deallocate a mutex
+ * @mutex: Mutex to deallocate
+ *
+ * Return: -1 if @mutex is NULL or if @mutex is locked. 0 if @mutex was
+ * successfully destroyed.
+ */
+int uthread_mutex_destroy(uthread_mutex_t mutex);
+
+/*
+ * uthread_mutex_lock - Lock a mutex
+ * @mutex: Mutex to lock
+ *
+ * Lock @mutex, blocking the calling thread until @mutex is handed to it if it
+ * is locked already. A mutex is not recursive.
+ *
+ * Return: -1 if @mutex is NULL. 0 once @mutex is locked.
+ */
+int uthread_mutex_lock(uthread_mutex_t mutex);
+
+/*
+ * uthread_mutex_lock_timeout - Lock a mutex, giving up after a while
+ * @mutex: Mutex to lock
+ * @timeout_ns: Time to wait for @mutex (in nanoseconds)
+ *
+ * Return: -1 if @mutex is NULL. 1 if @mutex was not handed to the calling
+ * thread in time. 0 once @mutex is locked.
+ */
+int uthread_mutex_lock_timeout(uthread_mutex_t mutex, uint64_t timeout_ns);
+
+/*
+ * uthread_mutex_trylock - Lock a mutex if unlocked
+ * @mutex: Mutex to lock
+ *
+ * Return: -1 if @mutex is NULL or locked already. 0 if @mutex was locked.
+ */
+int uthread_mutex_trylock(uthread_mutex_t mutex);
+
+/*
+ * uthread_mutex_unlock - Unlock a mutex
+ * @mutex: Mutex to unlock, locked by the calling thread
+ * @yield: Whether to run the thread @mutex is handed to right away
+ *
+ * Unlock @mutex, or hand it to the oldest thread waiting for it. In that case
+ * the thread is made ready, or, if @yield is set, runs in place of the calling
+ * thread, which is made ready instead.
+ *
+ * Return: -1 if @mutex is NULL or unlocked. 0 otherwise.
+ */
+int uthread_mutex_unlock(uthread_mutex_t mutex, int yield);
+
+/*
+ * uthread_sem_t - Semaphore type
+ */
+typedef struct uthread_sem* uthread_sem_t;
+
+/*
+ * uthread_sem_create - Allocate a semaphore
+ * @count: Initial count, the number of resources available
+ *
+ * Return: Pointer to new semaphore. NULL if @count is negative, or in case of
+ * failure when allocating the new semaphore.
+ */
+uthread_sem_t uthread_sem_create(int count);
+
+/*
+ * uthread_sem_destroy - Deallocate a semaphore
+ * @sem: Semaphore to deallocate
+ *
+ * Return: -1 if @sem is NULL or if threads are waiting for @sem. 0 if @sem was
+ * successfully destroyed.
+ */
+int uthread_sem_destroy(uthread_sem_t sem);
+
+/*
+ * uthread_sem_down - Take a resource
+ * @sem: Semaphore to take a resource from
+ *
+ * Take a resource from @sem, blocking the calling thread until one is handed to
+ * it if none is available.
+ *
+ * Return: -1 if @sem is NULL. 0 once a resource was taken.
+ */
+int uthread_sem_down(uthread_sem_t sem);
+
+/*
+ * uthread_sem_down_timeout - Take a resource, giving up after a while
+ * @sem: Semaphore to take a resource from
+ * @timeout_ns: Time to wait for a resource (in nanoseconds)
+ *
+ * Return: -1 if @sem is NULL. 1 if no resource was handed to the calling
+ * thread in time. 0 once a resource was taken.
+ */
+int uthread_sem_down_timeout(uthread_sem_t sem, uint64_t timeout_ns);
+
+/*
+ * uthread_sem_up - Release a resource
+ * @sem: Semaphore to release a resource to
+ * @yield: Whether to run the thread the resource is handed to right away
+ *
+ * Release a resource to @sem, or hand it to the oldest thread waiting for one.
+ * In that case the thread is made ready, or, if @yield is set, runs in place of
+ * the calling thread, which is made ready instead.
+ *
+ * Return: -1 if @sem is NULL. 0 otherwise.
+ */
+int uthread_sem_up(uthread_sem_t sem, int yield);
+
+/*
+ * uthread_cond_t - Condition variable type
+ */
+typedef struct uthread_cond* uthread_cond_t;
+
+/*
+ * uthread_cond_create - Allocate a condition variable
+ *
+ * Return: Pointer to new condition variable. NULL in case of failure when
+ * allocating the new condition variable.
+ */
+uthread_cond_t uthread_cond_create(void);
+
+/*
+ * uthread_cond_destroy - Deallocate a condition variable
+ * @cond: Condition variable to deallocate
+ *
+ * Return: -1 if @cond is NULL or if threads are waiting on @cond. 0 if @cond
+ * was successfully destroyed.
+ */
+int uthread_cond_destroy(uthread_cond_t cond);
+
+/*
+ * uthread_cond_wait - Wait on a condition variable
+ * @cond: Condition variable to wait on
+ * @mutex: Mutex locked by the calling thread
+ *
+ * Atomically unlock @mutex and block the calling thread until @cond is
+ * signaled, then lock @mutex again before returning. As the condition may
+ * have changed by then, it is to be checked again.
+ *
+ * Return: -1 if @cond or @mutex are NULL. 0 once signaled and @mutex locked.
+ */
+int uthread_cond_wait(uthread_cond_t cond, uthread_mutex_t mutex);
+
+/*
+ * uthread_cond_wait_timeout - Wait on a condition variable for a while
+ * @cond: Condition variable to wait on
+ * @mutex: Mutex locked by the calling thread
+ * @timeout_ns: Time to wait for @cond to be signaled (in nanoseconds)
+ *
+ * Same as uthread_cond_wait(), unless @cond is not signaled within @timeout_ns
+ * nanoseconds. @mutex is locked again before returning either way.
+ *
+ * Return: -1 if @cond or @mutex are NULL. 1 if the time ran out. 0 once
+ * signaled. @mutex is locked in both cases.
+ */
+int uthread_cond_wait_timeout(uthread_cond_t cond, uthread_mutex_t mutex,
+			      uint64_t timeout_ns);
+
+/*
+ * uthread_cond_signal - Signal a condition variable
+ * @cond: Condition variable to signal
+ *
+ * Make the oldest thread waiting on @cond ready, if any.
+ *
+ * Return: -1 if @cond is NULL. 0 otherwise.
+ */
+int uthread_cond_signal(uthread_cond_t cond);
+
+/*
+ * uthread_cond_broadcast - Signal a condition variable to every waiter
+ * @cond: Condition variable to signal
+ *
+ * Make every thread waiting on @cond ready.
+ *
+ * Return: -1 if @cond is NULL. 0 otherwise.
+ */
+int uthread_cond_broadcast(uthread_cond_t cond);
+
+/*
+ * Channels
+ *
+ * A channel passes values of a fixed size between threads, in FIFO order. A
+ * buffered channel holds up to its capacity of values sent and not received
+ * yet, an unbuffered one (of capacity 0) none: a send then waits for a receive
+ * and the other way around. Threads that have to wait block until another
+ * thread sends or receives on the channel, which copies the value straight
+ * from the sender's memory to the receiver's when one of them is waiting.
+ *
+ * A closed channel can't be sent to anymore, but values in its buffer can
+ * still be received.
+ *
+ * These can't be used from a signal handler.
+ */
+
+/*
+ * uthread_chan_t - Channel type
+ */
+typedef struct uthread_chan* uthread_chan_t;
+
+/*
+ * uthread_chan_create - Allocate a channel
+ * @elem_size: Size of the values passed through the channel (in bytes)
+ * @capacity: Number of values the channel can hold, 0 for an unbuffered
+ *	channel
+ *
+ * Return: Pointer to new channel. NULL in case of failure when allocating the
+ * new channel.
+ */
+uthread_chan_t uthread_chan_create(size_t elem_size, size_t capacity);
+
+/*
+ * uthread_chan_destroy - Deallocate a channel
+ * @chan: Channel to deallocate
+ *
+ * Values still in @chan's buffer are lost.
+ *
+ * Return: -1 if @chan is NULL or if threads are waiting on @chan. 0 if @chan
+ * was successfully destroyed.
+ */
+int uthread_chan_destroy(uthread_chan_t chan);
+
+/*
+ * uthread_chan_close - Close a channel
+ * @chan: Channel to close
+ *
+ * Threads waiting to send to @chan fail, as will later sends. Threads waiting
+ * to receive from @chan fail, as will later receives once @chan's buffer is
+ * empty.
+ *
+ * Return: -1 if @chan is NULL or already closed. 0 otherwise.
+ */
+int uthread_chan_close(uthread_chan_t chan);
+
+/*
+ * uthread_chan_send - Send a value
+ * @chan: Channel to send to
+ * @elem: Address of the value to send
+ *
+ * Send a copy of the value at @elem to @chan, blocking the calling thread
+ * until there's room in @chan's buffer, or, for an unbuffered channel, until a
+ * thread receives it. A thread waiting to receive from an unbuffered channel
+ * runs right away, in place of the sending thread.
+ *
+ * Return: -1 if @chan is NULL or closed. 0 once the value is sent.
+ */
+int uthread_chan_send(uthread_chan_t chan, const void *elem);
+
+/*
+ * uthread_chan_recv - Receive a value
+ * @chan: Channel to receive from
+ * @elem: Address where the value is copied, or NULL to drop it
+ *
+ * Receive the oldest value sent to @chan, blocking the calling thread until
+ * there is one.
+ *
+ * Return: -1 if @chan is NULL, or closed with nothing left to receive. 0 once
+ * a value is received.
+ */
+int uthread_chan_recv(uthread_chan_t chan, void *elem);
+
+/*
+ * Channel operations, for uthread_chan_select()
+ */
+enum {
+	UTHREAD_CHAN_SEND,
+	UTHREAD_CHAN_RECV,
+};
+
+/*
+ * struct uthread_chan_case - Channel operation of a select
+ * @chan: Channel to send to or receive from
+ * @op: UTHREAD_CHAN_SEND or UTHREAD_CHAN_RECV
+ * @elem: Address of the value to send, or where to copy the value received
+ *	(NULL to drop it)
+ * @closed: Set by uthread_chan_select() when the operation failed because
+ *	@chan is closed, cleared otherwise
+ */
+struct uthread_chan_case {
+	uthread_chan_t chan;
+	int op;
+	void *elem;
+	int closed;
+};
+
+/*
+ * uthread_chan_select - Perform one of several channel operations
+ * @cases: Operations to choose from
+ * @count: Number of operations in @cases
+ * @block: Whether to wait for an operation to be possible
+ *
+ * Perform one of the operations of @cases which can proceed without waiting,
+ * picked at random if several can, so that none is starved. If none can,
+ * block the calling thread until one can, or return right away if @block is 0.
+ * An operation on a closed channel proceeds, in that it fails without waiting.
+ *
+ * Return: -1 if @cases is NULL, if @count is not positive or if a channel is
+ * NULL. Index in @cases of the operation performed, or @count if @block is 0
+ * and none could be.
+ */
+int uthread_chan_select(struct uthread_chan_case *cases, int count, int block);
+
+/*
+ * uthread_chan_select_timeout - Perform one of several channel operations,
+ * giving up after a while
+ * @cases: Operations to choose from
+ * @count: Number of operations in @cases
+ * @timeout_ns: Time to wait for an operation to be possible (in nanoseconds)
+ *
+ * Same as uthread_chan_select() with @block set, unless none of the operations
+ * can proceed within @timeout_ns nanoseconds.
+ *
+ * Return: -1 in the same cases as uthread_chan_select(). Index in @cases of the
+ * operation performed, or @count if the time ran out.
+ */
+int uthread_chan_select_timeout(struct uthread_chan_case *cases, int count,
+				uint64_t timeout_ns);
+
+/*
+ * I/O
+ *
+ * These wrappers of the system calls of the same name make the file
+ * descriptor non-blocking, so that a call which would block only blocks the
+ * calling thread, rather than the kernel thread running it and every thread
+ * it could run. The thread waits off the ready queue until the descriptor is
+ * ready, which workers with nothing else to run wait for in epoll_wait().
+ *
+ * Since non-blocking mode is a property of the open file, other users of the
+ * descriptor, and of its duplicates, see it too. A descriptor used with these
+ * wrappers must be closed with uthread_close().
+ *
+ * These can't be used from a signal handler.
+ */
+
+/*
+ * uthread_read - Read from a file descriptor
+ * @fd: File descriptor to read from
+ * @buf: Buffer receiving the data
+ * @count: Maximum number of bytes to read
+ *
+ * Return: Same as read(2), blocking the calling thread only.
+ */
+ssize_t uthread_read(int fd, void *buf, size_t count);
+
+/*
+ * uthread_write - Write to a file descriptor
+ * @fd: File descriptor to write to
+ * @buf: Data to write
+ * @count: Number of bytes to write
+ *
+ * Return: Same as write(2), blocking the calling thread only.
+ */
+ssize_t uthread_write(int fd, const void *buf, size_t count);
+
+/*
+ * uthread_accept - Accept a connection on a socket
+ * @fd: Listening socket
+ * @addr: Address of the peer, or NULL
+ * @addrlen: Size of @addr, or NULL
+ *
+ * Return: Same as accept(2), blocking the calling thread only.
+ */
+int uthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/*
+ * uthread_connect - Connect a socket
+ * @fd: Socket to connect
+ * @addr: Address to connect to
+ * @addrlen: Size of @addr
+ *
+ * Return: Same as connect(2), blocking the calling thread only until the
+ * connection is established or fails.
+ */
+int uthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * uthread_close - Close a file descriptor
+ * @fd: File descriptor to close
+ *
+ * Threads waiting for @fd to be ready are woken up, and fail.
+ *
+ * Return: Same as close(2).
+ */
+int uthread_close(int fd);
+
+/*
+ * io_uring
+ *
+ * With an io_uring instance (see struct uthread_config), the calling thread
+ * queues its operation in the submission ring and blocks. Queued operations
+ * are submitted together once enough of them are queued, or the worker has
+ * nothing else to run, and workers reap completions in batches as they wait
+ * for I/O, making the threads ready again. Without one, the operations are
+ * performed synchronously, which only blocks the kernel thread on a file:
+ * from the current position, they go through uthread_read() and
+ * uthread_write() instead.
+ *
+ * The ring gives up on a non-blocking descriptor which isn't ready, the
+ * operation then takes the synchronous path. A descriptor used with both
+ * these and uthread_read() or the like is made non-blocking by the latter.
+ */
+
+/*
+ * uthread_pread - Read from a file descriptor at an offset
+ * @fd: File descriptor to read from
+ * @buf: Buffer receiving the data
+ * @count: Maximum number of bytes to read
+ * @offset: Offset to read from, -1 for the current position, which sockets
+ *	and pipes need
+ *
+ * Return: Same as pread(2), blocking the calling thread only.
+ */
+ssize_t uthread_pread(int fd, void *buf, size_t count, off_t offset);
+
+/*
+ * uthread_pwrite - Write to a file descriptor at an offset
+ * @fd: File descriptor to write to
+ * @buf: Data to write
+ * @count: Number of bytes to write
+ * @offset: Offset to write at, -1 for the current position
+ *
+ * Return: Same as pwrite(2), blocking the calling thread only.
+ */
+ssize_t uthread_pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+/*
+ * uthread_io_register_files - Register fixed files
+ * @fds: File descriptors to register
+ * @count: Number of descriptors, 0 to unregister the current ones
+ *
+ * Registered files are designated by their index in @fds. The ring then
+ * skips looking up the descriptor on each operation. Replaces the files
+ * registered before, which must not be in use.
+ *
+ * Return: -1 in case of failure (memory allocation, @fds NULL). 0 otherwise,
+ * including if the kernel refuses the files, which are then looked up as
+ * usual.
+ */
+int uthread_io_register_files(const int *fds, unsigned int count);
+
+/*
+ * uthread_io_register_buffers - Register fixed buffers
+ * @iovecs: Buffers to register
+ * @count: Number of buffers, 0 to unregister the current ones
+ *
+ * Registered buffers are designated by their index in @iovecs. The kernel
+ * keeps them mapped, so that operations don't map and unmap their pages
+ * each time. Replaces the buffers registered before, which must not be in
+ * use.
+ *
+ * Return: -1 in case of failure (memory allocation, @iovecs NULL). 0
+ * otherwise, including if the kernel refuses the buffers (e.g., exceeding
+ * RLIMIT_MEMLOCK), which are then mapped as usual.
+ */
+int uthread_io_register_buffers(const struct iovec *iovecs, unsigned int count);
+
+/*
+ * uthread_pread_fixed - Read from a fixed file into a fixed buffer
+ * @file: Index of the registered file to read from
+ * @buf: Buffer receiving the data, within the registered buffer @buffer
+ * @count: Maximum number of bytes to read
+ * @offset: Offset to read from, -1 for the current position
+ * @buffer: Index of the registered buffer containing @buf
+ *
+ * Return: Same as pread(2), blocking the calling thread only. -1 with errno
+ * set to EBADF if @file isn't registered, or EFAULT if @buf doesn't lie
+ * within registered buffer @buffer.
+ */
+ssize_t uthread_pread_fixed(int file, void *buf, size_t count, off_t offset, int buffer);
+
+/*
+ * uthread_pwrite_fixed - Write to a fixed file from a fixed buffer
+ * @file: Index of the registered file to write to
+ * @buf: Data to write, within the registered buffer @buffer
+ * @count: Number of bytes to write
+ * @offset: Offset to write at, -1 for the current position
+ * @buffer: Index of the registered buffer containing @buf
+ *
+ * Return: Same as uthread_pread_fixed().
+ */
+ssize_t uthread_pwrite_fixed(int file, const void *buf, size_t count, off_t offset,
+			     int buffer);
+
+/*
+ * uthread_io_uring - Whether operations go through io_uring
+ *
+ * Return: 1 if an io_uring instance was set up, 0 if operations are performed
+ * synchronously.
+ */
+int uthread_io_uring(void);
+
+/*
+ * struct uthread_stack_cache_stats - Stack cache counters
+ * @hits: Number of stacks handed out from the cache
+ * @misses: Number of stacks that had to be allocated because the cache was
+ *	empty for the requested size class
+ * @released: Number of stacks freed because their size class was already at
+ *	its high-water mark
+ * @cached: Number of stacks currently held in the cache
+ */
+struct uthread_stack_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long released;
+	unsigned long cached;
+};
+
+/*
+ * uthread_stack_cache_stats - Get stack cache counters
+ * @stats: Address of the structure receiving the counters
+ *
+ * Counters accumulate from the start of the library and are meant to help size
+ * the stack cache (see struct uthread_config).
+ */
+void uthread_stack_cache_stats(struct uthread_stack_cache_stats *stats);
+
+/*
+ * struct uthread_thread_stats - Thread counters
+ * @cpu_ns: CPU time consumed while running (in nanoseconds), that is the CPU
+ *	time of the worker's kernel thread from being switched to until being
+ *	switched out, which leaves out the time the kernel ran something else or
+ *	the thread blocked in a system call
+ * @ready_ns: Time spent ready to run, waiting for a worker to run it (in
+ *	nanoseconds)
+ * @join_ns: Time spent blocked in uthread_join() (in nanoseconds)
+ * @yields: Number of calls to uthread_yield()
+ * @preemptions: Number of times its time slice ran out
+ *
+ * Times are only measured if the library was started with @stats set (see
+ * struct uthread_config), and stay 0 otherwise.
+ */
+struct uthread_thread_stats {
+	uint64_t cpu_ns;
+	uint64_t ready_ns;
+	uint64_t join_ns;
+	unsigned long yields;
+	unsigned long preemptions;
+};
+
+/*
+ * uthread_thread_stats - Get a thread's counters
+ * @tid: TID of the thread, which may have exited but not been joined yet
+ * @stats: Address of the structure receiving the counters
+ *
+ * Return: -1 if the library was not started or if thread @tid cannot be found.
+ * 0 otherwise.
+ */
+int uthread_thread_stats(uthread_t tid, struct uthread_thread_stats *stats);
+
+/* Number of buckets of the ready latency histogram */
+#define UTHREAD_STATS_BUCKETS 40
+
+/*
+ * struct uthread_stats - Scheduler counters
+ * @uptime_ns: Time since the library was started (in nanoseconds)
+ * @switches: Number of switches to a thread since the library was started,
+ *	whose rate is the difference between two snapshots over the time
+ *	between them
+ * @ready: Number of threads ready to run, waiting for a worker
+ * @live: Number of threads created and not exited yet, main excluded
+ * @zombies: Number of threads exited and not joined yet
+ * @ready_latency: Histogram of the times threads waited ready to run before
+ *	running (see struct uthread_thread_stats), with bucket i counting the
+ *	waits from 2^i to 2^(i+1) nanoseconds, bucket 0 the shorter ones too
+ *	and the last bucket the longer ones too
+ *
+ * Counters are read from every worker without stopping them, so they may be
+ * slightly out of step with each other.
+ */
+struct uthread_stats {
+	uint64_t uptime_ns;
+	unsigned long switches;
+	unsigned int ready;
+	unsigned int live;
+	unsigned int zombies;
+	unsigned long ready_latency[UTHREAD_STATS_BUCKETS];
+};
+
+/*
+ * uthread_stats - Get scheduler counters
+ * @stats: Address of the structure receiving the counters
+ *
+ * Return: -1 if the library was not started. 0 otherwise.
+ */
+int uthread_stats(struct uthread_stats *stats);
+
+/*
+ * Tracing
+ *
+ * With trace buffers (see struct uthread_config), every worker records the
+ * threads it creates, wakes up and switches between, and why they are
+ * switched out, with a timestamp from the CPU's cycle counter where there is
+ * one. Recording an event takes a few nanoseconds, and nothing but a test of
+ * a flag while tracing is disabled.
+ */
+
+/*
+ * uthread_trace_enable - Start or stop recording scheduler events
+ * @enable: Whether to record events
+ *
+ * Return: -1 if the library was not started with trace buffers. 0 otherwise.
+ */
+int uthread_trace_enable(int enable);
+
+/*
+ * uthread_trace_dump - Write the recorded events out
+ * @path: Path of the file to write
+ *
+ * Write the events still in the trace buffers to @path in the Trace Event
+ * Format, which chrome://tracing and Perfetto display as a timeline: one track
+ * per thread, showing when it ran, on which worker and why it stopped, and
+ * one per worker, showing which thread it ran. Events keep being recorded
+ * meanwhile, if enabled.
+ *
+ * Return: -1 if the library was not started with trace buffers, or in case of
+ * failure when writing @path. 0 otherwise.
+ */
+int uthread_trace_dump(const char *path);
+
+/*
+ * Profiling
+ *
+ * With sample buffers (see struct uthread_config), every preemption tick
+ * records which thread it interrupted, where, and a backtrace of up to 16
+ * frames found by following frame pointers. Code built without them (as gcc
+ * does from -O1 on, unless given -fno-omit-frame-pointer) shows up with
+ * missing or bogus callers, but never makes the walk leave the thread's
+ * stack. Main's samples and those of threads on the shared stack only have
+ * the interrupted function. With the default CPU clock, samples are spread in
+ * proportion to the CPU time spent.
+ */
+
+/*
+ * uthread_profile_enable - Start or stop taking samples
+ * @enable: Whether to take samples
+ *
+ * Return: -1 if the library was not started with sample buffers. 0 otherwise.
+ */
+int uthread_profile_enable(int enable);
+
+/*
+ * uthread_profile_dump - Write the samples out as folded stacks
+ * @path: Path of the file to write
+ *
+ * Write the samples taken so far to @path, one line per distinct stack: the
+ * thread ("main" or "uthread <TID>"), then the functions from outermost to
+ * innermost, separated by semicolons, then the number of samples. That is
+ * what flamegraph.pl and speedscope take, giving a flame graph per thread.
+ * Functions are named after the dynamic symbol table, so executables should
+ * be linked with -rdynamic; others show up as an offset in their object
+ * file. Samples keep being taken meanwhile, if enabled.
+ *
+ * Return: -1 if the library was not started with sample buffers, or in case of
+ * failure when writing @path. 0 otherwise.
+ */
+int uthread_profile_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _THREAD_H */
@@ -0,0 +1,285 @@
+#ifndef _UTHREAD_HPP
+#define _UTHREAD_HPP
+
+/*
+ * C++ interface
+ *
+ * uthread::scheduler starts the library for as long as it lives, and
+ * uthread::thread<R> runs any callable in a new thread, joining it when
+ * destroyed if it wasn't already. join() returns what the callable returned.
+ *
+ * The callable is copied on top of the new thread's stack when that's a valid
+ * copy and it's small enough (see uthread_create_data()), which a lambda
+ * capturing a few variables or references is, and is moved to the heap
+ * otherwise. Results that fit in a thread's int return value are passed
+ * through it, others through a slot the handle allocates. A small trivially
+ * copyable callable returning an integer or nothing therefore costs exactly
+ * what a thread of the C API does.
+ *
+ * Exceptions escaping a thread's callable terminate the program.
+ */
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "uthread.h"
+
+namespace uthread {
+
+namespace detail {
+
+// Largest callable copied on top of the thread's stack.
+constexpr std::size_t inline_max = 128;
+
+template <typename F>
+constexpr bool fits_inline = std::is_trivially_copyable_v<F> &&
+	sizeof(F) <= inline_max && alignof(F) <= 16;
+
+template <typename R>
+constexpr bool fits_int = std::is_integral_v<R> && sizeof(R) <= sizeof(int);
+
+template <>
+constexpr bool fits_int<void> = true;
+
+// Callable as passed to the thread: the callable itself if it fits inline...
+template <typename F, bool = fits_inline<F>>
+struct closure
+{
+	F f;
+
+	template <typename G>
+	explicit closure(G &&g) : f(std::forward<G>(g)) {}
+
+	decltype(auto) operator()() { return f(); }
+
+	// The thread couldn't be created.
+	void discard() noexcept {}
+};
+
+// ...or a pointer to a copy on the heap, which the thread destroys.
+template <typename F>
+struct closure<F, false>
+{
+	F *f;
+
+	template <typename G>
+	explicit closure(G &&g) : f(new F(std::forward<G>(g))) {}
+
+	decltype(auto) operator()()
+	{
+		std::unique_ptr<F> owned(f);
+		return (*owned)();
+	}
+
+	void discard() noexcept { delete f; }
+};
+
+// Data of the thread: its callable, and where to put the result if it doesn't
+// fit in the return value.
+template <typename F, typename R, bool = fits_int<R>>
+struct payload
+{
+	closure<F> fn;
+
+	template <typename G>
+	payload(G &&g, void *) : fn(std::forward<G>(g)) {}
+
+	static int run(void *data) noexcept
+	{
+		auto &fn = static_cast<payload *>(data)->fn;
+		if constexpr (std::is_void_v<R>) {
+			fn();
+			return 0;
+		} else {
+			return static_cast<int>(fn());
+		}
+	}
+};
+
+template <typename F, typename R>
+struct payload<F, R, false>
+{
+	closure<F> fn;
+	std::optional<R> *result;
+
+	template <typename G>
+	payload(G &&g, void *result)
+		: fn(std::forward<G>(g)), result(static_cast<std::optional<R> *>(result)) {}
+
+	static int run(void *data) noexcept
+	{
+		auto *self = static_cast<payload *>(data);
+		self->result->emplace(self->fn());
+		return 0;
+	}
+};
+
+// Result of a thread, as kept by its handle: nothing but the return value...
+template <typename R, bool = fits_int<R>>
+struct result
+{
+	void *slot() noexcept { return nullptr; }
+	R take(int retval) noexcept { return static_cast<R>(retval); }
+};
+
+// ...or the slot the thread writes it to.
+template <typename R>
+struct result<R, false>
+{
+	std::unique_ptr<std::optional<R>> value;
+
+	void *slot()
+	{
+		value = std::make_unique<std::optional<R>>();
+		return value.get();
+	}
+
+	R take(int)
+	{
+		R r = std::move(**value);
+		value.reset();
+		return r;
+	}
+};
+
+} // namespace detail
+
+/*
+ * scheduler - The multithreading library, started for the object's lifetime
+ *
+ * Construct it from main, with the same arguments as uthread_start() or
+ * uthread_start_config(), which throws std::runtime_error if the library
+ * can't start. The library is stopped on destruction, by which time every
+ * thread must have been joined: declare the scheduler before the threads.
+ */
+class scheduler
+{
+public:
+	explicit scheduler(bool preempt = false)
+	{
+		if (uthread_start(preempt))
+			throw std::runtime_error("uthread: cannot start the library");
+	}
+
+	explicit scheduler(const uthread_config &config)
+	{
+		if (uthread_start_config(&config))
+			throw std::runtime_error("uthread: cannot start the library");
+	}
+
+	~scheduler() { uthread_stop(); }
+
+	scheduler(const scheduler &) = delete;
+	scheduler &operator=(const scheduler &) = delete;
+
+	// Default configuration, to adjust before constructing a scheduler.
+	static uthread_config default_config() noexcept
+	{
+		uthread_config config;
+		uthread_config_init(&config);
+		return config;
+	}
+};
+
+/*
+ * thread - Handle of a thread running a callable returning R
+ *
+ * Movable but not copyable. A handle owning a thread that wasn't joined
+ * joins it when destroyed or assigned to, discarding the result.
+ */
+template <typename R = void>
+class thread
+{
+	static_assert(!std::is_reference_v<R>, "uthread: threads return by value");
+
+public:
+	thread() noexcept = default;
+
+	/*
+	 * Run @f in a new thread, created with attributes @attr if not NULL.
+	 * Throws std::runtime_error if it can't be created.
+	 */
+	template <typename F,
+		  typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, thread>>>
+	explicit thread(F &&f, const uthread_attr *attr = nullptr)
+	{
+		using Fn = std::decay_t<F>;
+		using Payload = detail::payload<Fn, R>;
+		static_assert(std::is_void_v<R> ||
+			      std::is_convertible_v<std::invoke_result_t<Fn &>, R>,
+			      "uthread: the callable's result must convert to R");
+
+		Payload data(std::forward<F>(f), result_.slot());
+		int tid = uthread_create_data(&Payload::run, &data, sizeof(data), attr);
+		if (tid < 0) {
+			data.fn.discard();
+			throw std::runtime_error("uthread: cannot create thread");
+		}
+		tid_ = tid;
+		joinable_ = true;
+	}
+
+	thread(thread &&other) noexcept
+		: tid_(other.tid_), joinable_(std::exchange(other.joinable_, false)),
+		  result_(std::move(other.result_)) {}
+
+	thread &operator=(thread &&other) noexcept
+	{
+		if (this != &other) {
+			release();
+			tid_ = other.tid_;
+			joinable_ = std::exchange(other.joinable_, false);
+			result_ = std::move(other.result_);
+		}
+		return *this;
+	}
+
+	thread(const thread &) = delete;
+	thread &operator=(const thread &) = delete;
+
+	~thread() { release(); }
+
+	bool joinable() const noexcept { return joinable_; }
+
+	uthread_t get_id() const noexcept { return tid_; }
+
+	/*
+	 * Wait for the thread to finish, and return what its callable returned.
+	 * Throws std::logic_error if the handle owns no thread.
+	 */
+	R join()
+	{
+		int retval;
+
+		if (!joinable_ || uthread_join(tid_, &retval))
+			throw std::logic_error("uthread: thread not joinable");
+		joinable_ = false;
+		return result_.take(retval);
+	}
+
+private:
+	void release() noexcept
+	{
+		if (joinable_)
+			uthread_join(tid_, nullptr);
+		joinable_ = false;
+	}
+
+	uthread_t tid_ = 0;
+	bool joinable_ = false;
+	detail::result<R> result_;
+};
+
+template <typename F>
+thread(F &&) -> thread<std::invoke_result_t<std::decay_t<F> &>>;
+
+template <typename F>
+thread(F &&, const uthread_attr *) -> thread<std::invoke_result_t<std::decay_t<F> &>>;
+
+} // namespace uthread
+
+#endif /* _UTHREAD_HPP */